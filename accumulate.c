@@ -1,10 +1,42 @@
 #include "global.h"
 
+/* engine is one of the ENGINE_* constants; the moremem and lessmem engines
+ * are 0 and 1 so that a use_lessmem flag can be passed as is; they skip edge
+ * checks if dir_map and accum_map have a border of one null cell, which
+ * matters for lessmem because it looks around cells again on every visit
+ * while moremem does it once */
 void accumulate(struct raster_map *dir_map, struct raster_map *accum_map,
-                int use_lessmem)
+                int engine)
 {
-    if (use_lessmem)
+    if (dir_map->padding) {
+        if (engine == ENGINE_MOREMEM)
+            accumulate_padded_moremem(dir_map, accum_map);
+        else
+            accumulate_padded_lessmem(dir_map, accum_map);
+        return;
+    }
+
+    switch (engine) {
+    case ENGINE_MOREMEM:
+        accumulate_moremem(dir_map, accum_map);
+        break;
+    case ENGINE_HP:
+        accumulate_hp(dir_map, accum_map);
+        break;
+    case ENGINE_HYBRID:
+        accumulate_hybrid(dir_map, accum_map);
+        break;
+    default:
         accumulate_lessmem(dir_map, accum_map);
+        break;
+    }
+}
+
+void accumulate_area(struct raster_map *dir_map, struct raster_map *accum_map,
+                     int use_lessmem, const double *cell_areas)
+{
+    if (use_lessmem)
+        accumulate_area_lessmem(dir_map, accum_map, cell_areas);
     else
-        accumulate_moremem(dir_map, accum_map);
+        accumulate_area_moremem(dir_map, accum_map, cell_areas);
 }
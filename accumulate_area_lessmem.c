@@ -0,0 +1,3 @@
+#define USE_LESS_MEMORY
+#define USE_CELL_AREA
+#include "accumulate_funcs.h"
@@ -0,0 +1,2 @@
+#define USE_CELL_AREA
+#include "accumulate_funcs.h"
@@ -0,0 +1,2 @@
+#define USE_FRONTIER
+#include "accumulate_funcs.h"
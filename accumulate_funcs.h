@@ -1,47 +1,225 @@
 #include <stdlib.h>
+#ifdef USE_FRONTIER
+#include <limits.h>
+#include <omp.h>
+#endif
 #include "global.h"
+#ifdef USE_PADDING
+/* dir and accum have a border of one null cell */
+#define INDEX(row, col) \
+    ((size_t)((row) + 1) * (ctx->ncols + 2) + (col) + 1)
+#endif
+#include "look_around.h"
 
-#define INDEX(row, col) ((size_t)(row) * ncols + (col))
-#define DIR_NULL dir_map->null_value
-#define DIR(row, col) dir_map->cells.byte[INDEX(row, col)]
-#define ACCUM(row, col) accum_map->cells.uint32[INDEX(row, col)]
-#define FIND_UP(row, col) ( \
-        (row > 0 ? \
-         (col > 0 && DIR(row - 1, col - 1) == SE ? NW : 0) | \
-         (DIR(row - 1, col) == S ? N : 0) | \
-         (col < ncols - 1 && DIR(row - 1, col + 1) == SW ? NE : 0) : 0) | \
-        (col > 0 && DIR(row, col - 1) == E ? W : 0) | \
-        (col < ncols - 1 && DIR(row, col + 1) == W ? E : 0) | \
-        (row < nrows - 1 ? \
-         (col > 0 && DIR(row + 1, col - 1) == NE ? SW : 0) | \
-         (DIR(row + 1, col) == N ? S : 0) | \
-         (col < ncols - 1 && DIR(row + 1, col + 1) == NW ? SE : 0) : 0))
+#ifdef USE_CELL_AREA
+/* accumulate cell areas from a per-row table in a double accumulator; a cell
+ * area is always positive, so 0 still means "not visited" */
+#define ACCUM_TYPE double
+#define ACCUM(row, col) ctx->accum_map->cells.float64[INDEX(row, col)]
+#define CELL_VALUE(row, col) ctx->cell_areas[row]
+#else
+#define ACCUM_TYPE int
+#define ACCUM(row, col) ctx->accum_map->cells.uint32[INDEX(row, col)]
+#define CELL_VALUE(row, col) 1
+#endif
 
 #ifdef USE_LESS_MEMORY
+#ifdef USE_CELL_AREA
+#define ACCUMULATE accumulate_area_lessmem
+#elif defined USE_FRONTIER
+/* the frontier costs more than looking around saves */
+#error "USE_FRONTIER requires more memory"
+#elif defined USE_PROGRESS
+#define ACCUMULATE accumulate_progressive_lessmem
+#elif defined USE_PADDING
+#define ACCUMULATE accumulate_padded_lessmem
+#elif defined USE_RESUME
+#define ACCUMULATE accumulate_resumable_lessmem
+#else
 #define ACCUMULATE accumulate_lessmem
+#endif
 #define UP(row, col) FIND_UP(row, col)
 #else
+#ifdef USE_CELL_AREA
+#define ACCUMULATE accumulate_area_moremem
+#elif defined USE_FRONTIER
+#define ACCUMULATE accumulate_frontier_moremem
+#elif defined USE_PROGRESS
+#define ACCUMULATE accumulate_progressive_moremem
+#elif defined USE_PADDING
+#define ACCUMULATE accumulate_padded_moremem
+#elif defined USE_RESUME
+#define ACCUMULATE accumulate_resumable_moremem
+#else
 #define ACCUMULATE accumulate_moremem
-#define UP(row, col) up_cells[INDEX(row, col)]
-static unsigned char *up_cells;
+#endif
+#define UP(row, col) ctx->up_cells[INDEX(row, col)]
 #endif
 
-static int nrows, ncols;
+#ifdef USE_FRONTIER
+/* threads claim this many headwater cells at a time from a frontier */
+#define FRONTIER_CHUNK 256
+
+/* headwater cells in a band of rows in row-major order; cells are stored as
+ * offsets from the first cell of the band to halve the memory of size_t
+ * indices */
+struct frontier
+{
+    int first_row;
+    unsigned int *cells;
+    size_t num_cells, max_cells;
+    size_t next;
+};
+#endif
+
+/* all state for one call to ACCUMULATE() lives here instead of in file-static
+ * variables so that multiple rasters can be accumulated at the same time */
+struct accumulate_context
+{
+    struct raster_map *dir_map, *accum_map;
+    int nrows, ncols;
+#ifndef USE_LESS_MEMORY
+    unsigned char *up_cells;
+#endif
+#ifdef USE_CELL_AREA
+    const double *cell_areas;
+#endif
+#ifdef USE_PROGRESS
+    /* cells left to finalize in each band of band_rows rows */
+    int *band_cells;
+    int band_rows;
+#endif
+#ifdef USE_RESUME
+    /* accum_map holds cells accumulated before */
+    int resume;
+#endif
+};
 
-static void trace_down(struct raster_map *, struct raster_map *, int, int,
-                       int);
-static int sum_up(struct raster_map *, struct raster_map *, int, int);
+static void trace_down(struct accumulate_context *, int, int, ACCUM_TYPE);
+static ACCUM_TYPE sum_up(struct accumulate_context *, int, int);
 
+#ifdef USE_CELL_AREA
+void ACCUMULATE(struct raster_map *dir_map, struct raster_map *accum_map,
+                const double *cell_areas)
+#elif defined USE_PROGRESS
+void ACCUMULATE(struct raster_map *dir_map, struct raster_map *accum_map,
+                int *band_cells, int band_rows)
+#elif defined USE_RESUME
+void ACCUMULATE(struct raster_map *dir_map, struct raster_map *accum_map,
+                int resume)
+#else
 void ACCUMULATE(struct raster_map *dir_map, struct raster_map *accum_map)
+#endif
 {
+    struct accumulate_context context, *ctx = &context;
+    int nrows = dir_map->nrows, ncols = dir_map->ncols;
     int row, col;
+#ifdef USE_FRONTIER
+    struct frontier *frontiers;
+    int num_frontiers, band_rows, i;
+#endif
 
-    nrows = dir_map->nrows;
-    ncols = dir_map->ncols;
+    ctx->dir_map = dir_map;
+    ctx->accum_map = accum_map;
+    ctx->nrows = nrows;
+    ctx->ncols = ncols;
+#ifdef USE_CELL_AREA
+    ctx->cell_areas = cell_areas;
+#endif
+#ifdef USE_PROGRESS
+    ctx->band_cells = band_cells;
+    ctx->band_rows = band_rows;
+#endif
+#ifdef USE_RESUME
+    ctx->resume = resume;
+#endif
 
 #ifndef USE_LESS_MEMORY
-    up_cells = calloc((size_t)nrows * ncols, sizeof *up_cells);
+#ifdef USE_PADDING
+    ctx->up_cells = calloc((size_t)(nrows + 2) * (ncols + 2),
+                           sizeof *ctx->up_cells);
+#else
+    ctx->up_cells = calloc((size_t)nrows * ncols, sizeof *ctx->up_cells);
+#endif
+#endif
+
+#ifdef USE_FRONTIER
+    /* one band per thread unless offsets overflow */
+    num_frontiers = omp_get_max_threads();
+    band_rows = (nrows + num_frontiers - 1) / num_frontiers;
+    if ((size_t)band_rows * ncols > UINT_MAX) {
+        band_rows = UINT_MAX / ncols;
+        num_frontiers = (nrows + band_rows - 1) / band_rows;
+    }
+    frontiers = calloc(num_frontiers, sizeof *frontiers);
+
+    /* collect headwater cells in the same pass that finds upstream cells;
+     * each band is scanned by one thread, so its frontier is already sorted
+     * for locality */
+#pragma omp parallel for schedule(static) private(row, col)
+    for (i = 0; i < num_frontiers; i++) {
+        struct frontier *frontier = &frontiers[i];
+        int last_row = (i + 1) * band_rows;
 
+        frontier->first_row = i * band_rows;
+        if (last_row > nrows)
+            last_row = nrows;
+
+        for (row = frontier->first_row; row < last_row; row++) {
+            for (col = 0; col < ncols; col++) {
+                if (DIR(row, col) == DIR_NULL)
+                    continue;
+                UP(row, col) = FIND_UP(row, col);
+                if (UP(row, col))
+                    continue;
+                if (frontier->num_cells == frontier->max_cells) {
+                    frontier->max_cells += ncols;
+                    frontier->cells =
+                        realloc(frontier->cells,
+                                sizeof *frontier->cells * frontier->max_cells);
+                }
+                frontier->cells[frontier->num_cells++] =
+                    (size_t)(row - frontier->first_row) * ncols + col;
+            }
+        }
+    }
+
+    /* each thread traces down from its own frontier first and then steals
+     * chunks from the others */
+#pragma omp parallel
+    {
+        int num_threads = omp_get_num_threads();
+        int first = (size_t)omp_get_thread_num() * num_frontiers / num_threads;
+        int i;
+
+        for (i = 0; i < num_frontiers; i++) {
+            struct frontier *frontier =
+                &frontiers[(first + i) % num_frontiers];
+            size_t next, j;
+
+            do {
+#pragma omp atomic capture
+                {
+                    next = frontier->next;
+                    frontier->next += FRONTIER_CHUNK;
+                }
+                for (j = next;
+                     j < next + FRONTIER_CHUNK && j < frontier->num_cells;
+                     j++) {
+                    int row = frontier->first_row + frontier->cells[j] / ncols;
+                    int col = frontier->cells[j] % ncols;
+
+                    trace_down(ctx, row, col, CELL_VALUE(row, col));
+                }
+            } while (next < frontier->num_cells);
+        }
+    }
+
+    for (i = 0; i < num_frontiers; i++)
+        free(frontiers[i].cells);
+    free(frontiers);
+#else
+#ifndef USE_LESS_MEMORY
 #pragma omp parallel for schedule(dynamic) private(col)
     for (row = 0; row < nrows; row++) {
         for (col = 0; col < ncols; col++)
@@ -52,29 +230,63 @@ void ACCUMULATE(struct raster_map *dir_map, struct raster_map *accum_map)
 
 #pragma omp parallel for schedule(dynamic) private(col)
     for (row = 0; row < nrows; row++) {
+#ifdef USE_RESUME
+        for (col = 0; col < ncols; col++) {
+            ACCUM_TYPE accum_up = 0;
+
+            if (DIR(row, col) == DIR_NULL ||
+                (ctx->resume && ACCUM(row, col)))
+                continue;
+            /* when resuming, a cell left unaccumulated although all of its
+             * upstream cells are accumulated has lost the trace that was to
+             * reach it, so it starts tracing down like a headwater cell */
+            if (!UP(row, col) ||
+                (ctx->resume && (accum_up = sum_up(ctx, row, col))))
+                trace_down(ctx, row, col, accum_up + CELL_VALUE(row, col));
+        }
+#else
         for (col = 0; col < ncols; col++)
             /* if the current cell is not null and has no upstream cells, start
              * tracing down */
             if (DIR(row, col) != DIR_NULL && !UP(row, col))
-                trace_down(dir_map, accum_map, row, col, 1);
+                trace_down(ctx, row, col, CELL_VALUE(row, col));
+#endif
     }
+#endif
 
 #ifndef USE_LESS_MEMORY
-    free(up_cells);
+    free(ctx->up_cells);
 #endif
 }
 
-static void trace_down(struct raster_map *dir_map,
-                       struct raster_map *accum_map, int row, int col,
-                       int accum)
+static void trace_down(struct accumulate_context *ctx, int row, int col,
+                       ACCUM_TYPE accum)
 {
 #ifdef DONT_USE_TCO
     do {
 #endif
-        int accum_up = 0;
+        ACCUM_TYPE accum_up = 0;
+#ifdef USE_PROGRESS
+        ACCUM_TYPE old_accum;
+
+        /* accumulate the current cell itself; if another thread that saw the
+         * same upstream cells has done it already, leave the rest to it so
+         * that each cell is counted down exactly once */
+#pragma omp atomic capture
+        {
+            old_accum = ACCUM(row, col);
+            ACCUM(row, col) = accum;
+        }
+        if (old_accum)
+            return;
+#pragma omp flush
+#pragma omp atomic update
+        ctx->band_cells[row / ctx->band_rows]--;
+#else
 
         /* accumulate the current cell itself */
         ACCUM(row, col) = accum;
+#endif
 
         /* find the downstream cell */
         switch (DIR(row, col)) {
@@ -108,15 +320,29 @@ static void trace_down(struct raster_map *dir_map,
             break;
         }
 
+#ifdef USE_RESUME
+        /* a downstream cell already accumulated before the checkpoint or by
+         * another trace is final; cells below it are left to that trace or
+         * to the scan for cells whose traces were lost */
+        if (ctx->resume && row >= 0 && row < ctx->nrows && col >= 0 &&
+            col < ctx->ncols && ACCUM(row, col))
+            return;
+#endif
+
         /* if the downstream cell is null or any upstream cells of the
          * downstream cell have never been visited, stop tracing down */
-        if (row < 0 || row >= nrows || col < 0 || col >= ncols ||
+#ifdef USE_PADDING
+        if (DIR(row, col) == DIR_NULL || !(accum_up = sum_up(ctx, row, col)))
+            return;
+#else
+        if (row < 0 || row >= ctx->nrows || col < 0 || col >= ctx->ncols ||
             DIR(row, col) == DIR_NULL ||
-            !(accum_up = sum_up(dir_map, accum_map, row, col)))
+            !(accum_up = sum_up(ctx, row, col)))
             return;
+#endif
 
 #ifdef DONT_USE_TCO
-        accum = accum_up + 1;
+        accum = accum_up + CELL_VALUE(row, col);
     } while (1);
     /* XXX: work around an indent bug
      * #else
@@ -125,19 +351,18 @@ static void trace_down(struct raster_map *dir_map,
 #ifndef DONT_USE_TCO
     /* use gcc -O2 or -O3 flags for tail-call optimization
      * (-foptimize-sibling-calls) */
-    trace_down(dir_map, accum_map, row, col, accum_up + 1);
+    trace_down(ctx, row, col, accum_up + CELL_VALUE(row, col));
 #endif
 }
 
 /* if any upstream cells have never been visited, 0 is returned; otherwise, the
  * sum of upstream accumulation is returned */
-static int sum_up(struct raster_map *dir_map, struct raster_map *accum_map,
-                  int row, int col)
+static ACCUM_TYPE sum_up(struct accumulate_context *ctx, int row, int col)
 {
     int up = UP(row, col);
-    int sum = 0, accum;
+    ACCUM_TYPE sum = 0, accum;
 
-#pragma omp flush(accum_map)
+#pragma omp flush
     if (up & NW) {
         if (!(accum = ACCUM(row - 1, col - 1)))
             return 0;
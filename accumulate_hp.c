@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include "global.h"
+#include "look_around.h"
+
+#define ACCUM(row, col) ctx->accum_map->cells.uint32[INDEX(row, col)]
+
+/* headwater cells are marked so that cells whose pending inflows drop to 0
+ * during tracing are not mistaken for them */
+#define HEADWATER 0xff
+
+struct accumulate_context
+{
+    struct raster_map *dir_map, *accum_map;
+    int nrows, ncols;
+    unsigned char *num_ups;
+};
+
+static void trace_down(struct accumulate_context *, int, int);
+
+/* MEFA-HP: instead of looking around for unvisited upstream cells, every
+ * cell counts its pending inflows; tracing pushes accumulation down with
+ * atomic adds and only the thread that delivers the last inflow to a cell
+ * continues from it */
+void accumulate_hp(struct raster_map *dir_map, struct raster_map *accum_map)
+{
+    struct accumulate_context context, *ctx = &context;
+    int nrows = dir_map->nrows, ncols = dir_map->ncols;
+    int row, col;
+
+    ctx->dir_map = dir_map;
+    ctx->accum_map = accum_map;
+    ctx->nrows = nrows;
+    ctx->ncols = ncols;
+    ctx->num_ups = malloc((size_t)nrows * ncols);
+
+#pragma omp parallel for schedule(dynamic) private(col)
+    for (row = 0; row < nrows; row++) {
+        for (col = 0; col < ncols; col++) {
+            int up, n;
+
+            if (DIR(row, col) == DIR_NULL)
+                continue;
+
+            for (up = FIND_UP(row, col), n = 0; up; up &= up - 1)
+                n++;
+            ctx->num_ups[INDEX(row, col)] = n ? n : HEADWATER;
+            ACCUM(row, col) = 1;
+        }
+    }
+
+#pragma omp parallel for schedule(dynamic) private(col)
+    for (row = 0; row < nrows; row++) {
+        for (col = 0; col < ncols; col++)
+            if (DIR(row, col) != DIR_NULL &&
+                ctx->num_ups[INDEX(row, col)] == HEADWATER)
+                trace_down(ctx, row, col);
+    }
+
+    /* cells on flow direction loops never receive all their inflows; zero
+     * them as the other engines leave them */
+#pragma omp parallel for schedule(dynamic) private(col)
+    for (row = 0; row < nrows; row++) {
+        for (col = 0; col < ncols; col++)
+            if (DIR(row, col) != DIR_NULL && ctx->num_ups[INDEX(row, col)] &&
+                ctx->num_ups[INDEX(row, col)] != HEADWATER)
+                ACCUM(row, col) = 0;
+    }
+
+    free(ctx->num_ups);
+}
+
+/* the accumulation of the current cell is final when called */
+static void trace_down(struct accumulate_context *ctx, int row, int col)
+{
+    do {
+        unsigned int accum = ACCUM(row, col);
+        unsigned char num_ups;
+
+        /* find the downstream cell */
+        if (!move_down(DIR(row, col), &row, &col) || row < 0 ||
+            row >= ctx->nrows || col < 0 || col >= ctx->ncols ||
+            DIR(row, col) == DIR_NULL)
+            return;
+
+#pragma omp atomic update
+        ACCUM(row, col) += accum;
+#pragma omp flush
+#pragma omp atomic capture
+        num_ups = --ctx->num_ups[INDEX(row, col)];
+
+        /* other inflows are still pending */
+        if (num_ups)
+            return;
+#pragma omp flush
+    } while (1);
+}
@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "global.h"
+#include "look_around.h"
+
+#define ACCUM(row, col) ctx->accum_map->cells.uint32[INDEX(row, col)]
+
+/* rows of bits start at a word so that threads never share one */
+#define WORD(words, row, col) \
+    (words)[(size_t)(row) * ctx->row_words + ((col) >> 6)]
+#define BIT(col) ((unsigned long long)1 << ((col) & 63))
+
+/* upstream cells of confluence cells found by one thread for its contiguous
+ * rows */
+struct confluences
+{
+    int first_row;
+    unsigned char *ups;
+    size_t num_cells, max_cells;
+};
+
+struct accumulate_context
+{
+    struct raster_map *dir_map, *accum_map;
+    int nrows, ncols;
+    /* a bit per cell marks confluence cells; the upstream cells of the i-th
+     * confluence in a row are confluence_ups[row_confluences[row] + i] and
+     * word_ranks counts confluences in the row before each word */
+    size_t row_words;
+    unsigned long long *confluence_words;
+    unsigned int *word_ranks;
+    size_t *row_confluences;
+    unsigned char *confluence_ups;
+};
+
+static int count_bits(unsigned long long);
+static int find_confluence(struct accumulate_context *, int, int);
+static void trace_down(struct accumulate_context *, int, int);
+static unsigned int sum_up(struct accumulate_context *, int, int, int);
+
+/* between lessmem and moremem: upstream cells are stored only for confluence
+ * cells with two or more of them, in cell order and located by ranking a bit
+ * per cell; any other cell reached while tracing down has only the cell it
+ * was reached from upstream, so it needs no look-around at all */
+void accumulate_hybrid(struct raster_map *dir_map,
+                       struct raster_map *accum_map)
+{
+    struct accumulate_context context, *ctx = &context;
+    int nrows = dir_map->nrows, ncols = dir_map->ncols;
+    struct confluences *thread_confluences;
+    unsigned long long *headwater_words;
+    int num_threads = omp_get_max_threads();
+    int row, col, i;
+
+    ctx->dir_map = dir_map;
+    ctx->accum_map = accum_map;
+    ctx->nrows = nrows;
+    ctx->ncols = ncols;
+    ctx->row_words = (ncols + 63) / 64;
+    ctx->confluence_words =
+        calloc(nrows * ctx->row_words, sizeof *ctx->confluence_words);
+    ctx->word_ranks =
+        malloc(sizeof *ctx->word_ranks * nrows * ctx->row_words);
+    ctx->row_confluences = malloc(sizeof *ctx->row_confluences * (nrows + 1));
+    headwater_words = calloc(nrows * ctx->row_words, sizeof *headwater_words);
+    thread_confluences = calloc(num_threads, sizeof *thread_confluences);
+
+    /* find confluence and headwater cells in one pass; static scheduling gives
+     * each thread contiguous rows, so its confluences are already in order and
+     * can be copied into place as a whole */
+#pragma omp parallel private(col)
+    {
+        struct confluences *conf = &thread_confluences[omp_get_thread_num()];
+
+        conf->first_row = nrows;
+
+#pragma omp for schedule(static)
+        for (row = 0; row < nrows; row++) {
+            size_t n = conf->num_cells;
+
+            if (conf->first_row == nrows)
+                conf->first_row = row;
+            for (col = 0; col < ncols; col++) {
+                int up;
+
+                if (!(col & 63))
+                    WORD(ctx->word_ranks, row, col) = conf->num_cells - n;
+                if (DIR(row, col) == DIR_NULL)
+                    continue;
+                if (!(up = FIND_UP(row, col))) {
+                    WORD(headwater_words, row, col) |= BIT(col);
+                    continue;
+                }
+                /* one upstream cell */
+                if (!(up & (up - 1)))
+                    continue;
+                if (conf->num_cells == conf->max_cells) {
+                    conf->max_cells = 2 * conf->max_cells + ncols;
+                    conf->ups = realloc(conf->ups, conf->max_cells);
+                }
+                conf->ups[conf->num_cells++] = up;
+                WORD(ctx->confluence_words, row, col) |= BIT(col);
+            }
+            ctx->row_confluences[row + 1] = conf->num_cells - n;
+        }
+    }
+
+    ctx->row_confluences[0] = 0;
+    for (row = 0; row < nrows; row++)
+        ctx->row_confluences[row + 1] += ctx->row_confluences[row];
+    ctx->confluence_ups = malloc(ctx->row_confluences[nrows]);
+
+#pragma omp parallel for schedule(static)
+    for (i = 0; i < num_threads; i++) {
+        struct confluences *conf = &thread_confluences[i];
+
+        if (conf->num_cells)
+            memcpy(ctx->confluence_ups +
+                   ctx->row_confluences[conf->first_row], conf->ups,
+                   conf->num_cells);
+        free(conf->ups);
+    }
+    free(thread_confluences);
+
+#pragma omp parallel for schedule(dynamic) private(col)
+    for (row = 0; row < nrows; row++) {
+        for (col = 0; col < ncols; col += 64) {
+            unsigned long long bits = WORD(headwater_words, row, col);
+            int bit;
+
+            for (bit = 0; bits; bit++, bits >>= 1)
+                if (bits & 1)
+                    trace_down(ctx, row, col + bit);
+        }
+    }
+    free(headwater_words);
+
+    free(ctx->confluence_words);
+    free(ctx->word_ranks);
+    free(ctx->row_confluences);
+    free(ctx->confluence_ups);
+}
+
+/* portable population count */
+static int count_bits(unsigned long long bits)
+{
+    bits -= bits >> 1 & 0x5555555555555555ULL;
+    bits = (bits & 0x3333333333333333ULL) +
+        (bits >> 2 & 0x3333333333333333ULL);
+    bits = (bits + (bits >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+
+    return bits * 0x0101010101010101ULL >> 56;
+}
+
+/* return the upstream cells of a confluence cell or 0 for any other cell */
+static int find_confluence(struct accumulate_context *ctx, int row, int col)
+{
+    unsigned long long bits = WORD(ctx->confluence_words, row, col);
+
+    if (!(bits & BIT(col)))
+        return 0;
+
+    return ctx->confluence_ups[ctx->row_confluences[row] +
+                               WORD(ctx->word_ranks, row, col) +
+                               count_bits(bits & (BIT(col) - 1))];
+}
+
+static void trace_down(struct accumulate_context *ctx, int row, int col)
+{
+    unsigned int accum = 1;
+
+    do {
+        int up;
+
+        /* accumulate the current cell itself */
+        ACCUM(row, col) = accum;
+
+        /* find the downstream cell */
+        if (!move_down(DIR(row, col), &row, &col) || row < 0 ||
+            row >= ctx->nrows || col < 0 || col >= ctx->ncols ||
+            DIR(row, col) == DIR_NULL)
+            return;
+
+        /* if any upstream cells of a downstream confluence have never been
+         * visited, stop tracing down; otherwise, the current cell is the only
+         * upstream cell */
+        if ((up = find_confluence(ctx, row, col)) &&
+            !(accum = sum_up(ctx, row, col, up)))
+            return;
+        accum++;
+    } while (1);
+}
+
+/* if any upstream cells have never been visited, 0 is returned; otherwise, the
+ * sum of upstream accumulation is returned */
+static unsigned int sum_up(struct accumulate_context *ctx, int row, int col,
+                           int up)
+{
+    unsigned int sum = 0, accum;
+
+#pragma omp flush
+    if (up & NW) {
+        if (!(accum = ACCUM(row - 1, col - 1)))
+            return 0;
+        sum += accum;
+    }
+    if (up & N) {
+        if (!(accum = ACCUM(row - 1, col)))
+            return 0;
+        sum += accum;
+    }
+    if (up & NE) {
+        if (!(accum = ACCUM(row - 1, col + 1)))
+            return 0;
+        sum += accum;
+    }
+    if (up & W) {
+        if (!(accum = ACCUM(row, col - 1)))
+            return 0;
+        sum += accum;
+    }
+    if (up & E) {
+        if (!(accum = ACCUM(row, col + 1)))
+            return 0;
+        sum += accum;
+    }
+    if (up & SW) {
+        if (!(accum = ACCUM(row + 1, col - 1)))
+            return 0;
+        sum += accum;
+    }
+    if (up & S) {
+        if (!(accum = ACCUM(row + 1, col)))
+            return 0;
+        sum += accum;
+    }
+    if (up & SE) {
+        if (!(accum = ACCUM(row + 1, col + 1)))
+            return 0;
+        sum += accum;
+    }
+
+    return sum;
+}
@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <math.h>
+#include "global.h"
+#include "look_around.h"
+
+#define ELEV(row, col) ctx->dem_map->cells.float32[INDEX(row, col)]
+#define ACCUM(row, col) ctx->accum_map->cells.float64[INDEX(row, col)]
+
+/* headwater cells are marked so that cells whose pending inflows drop to 0
+ * during tracing are not mistaken for them */
+#define HEADWATER 0xff
+
+struct accumulate_context
+{
+    struct raster_map *dem_map, *dir_map, *accum_map;
+    int nrows, ncols;
+    double weights[8], exponent;
+    unsigned char *num_ups;
+};
+
+/* downstream cells waiting to be traced by a thread */
+struct stack
+{
+    size_t *cells;
+    size_t num_cells, max_cells;
+};
+
+static const int dirs[8] = { E, SE, S, SW, W, NW, N, NE };
+static const int drows[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+static const int dcols[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+
+static int count_ups(struct accumulate_context *, int, int);
+static int find_down(struct accumulate_context *, int, int, double *);
+static void trace_down(struct accumulate_context *, int, int,
+                       struct stack *);
+
+/* multiple flow direction (MFD) accumulation from a DEM like MEFA-HP; each
+ * cell spreads its accumulation to all downslope neighbors in proportion to
+ * slope to the power of exponent (Freeman, 1991) and cells without one use
+ * their D8 direction in dir_map from calc_flow_dir() so that flats drain;
+ * pending inflows are counted by looking around with the same rule and
+ * tracing starts from headwater cells; accum_map must be float64 and nulls
+ * in dem_map must be NaN */
+void accumulate_mfd(struct raster_map *dem_map, struct raster_map *dir_map,
+                    struct raster_map *accum_map, double exponent)
+{
+    struct accumulate_context context, *ctx = &context;
+    int nrows = dem_map->nrows, ncols = dem_map->ncols;
+    double dx = dem_map->dx, dy = dem_map->dy, dxy = sqrt(dx * dx + dy * dy);
+    int row, col, i;
+
+    ctx->dem_map = dem_map;
+    ctx->dir_map = dir_map;
+    ctx->accum_map = accum_map;
+    ctx->nrows = nrows;
+    ctx->ncols = ncols;
+    ctx->exponent = exponent;
+    ctx->num_ups = malloc((size_t)nrows * ncols);
+
+    for (i = 0; i < 8; i++)
+        ctx->weights[i] =
+            1 / (drows[i] && dcols[i] ? dxy : drows[i] ? dy : dx);
+
+#pragma omp parallel for schedule(dynamic) private(col)
+    for (row = 0; row < nrows; row++) {
+        for (col = 0; col < ncols; col++) {
+            int n;
+
+            if (isnan(ELEV(row, col)))
+                continue;
+
+            n = count_ups(ctx, row, col);
+            ctx->num_ups[INDEX(row, col)] = n ? n : HEADWATER;
+            ACCUM(row, col) = 1;
+        }
+    }
+
+#pragma omp parallel
+    {
+        struct stack stack = { NULL, 0, 0 };
+
+#pragma omp for schedule(dynamic) private(col)
+        for (row = 0; row < nrows; row++) {
+            for (col = 0; col < ncols; col++)
+                if (!isnan(ELEV(row, col)) &&
+                    ctx->num_ups[INDEX(row, col)] == HEADWATER)
+                    trace_down(ctx, row, col, &stack);
+        }
+
+        free(stack.cells);
+    }
+
+    free(ctx->num_ups);
+}
+
+/* a higher neighbor always drains into the current cell and a neighbor of the
+ * same elevation does only through its D8 direction because it has no
+ * downslope neighbor then; this is the same rule as find_down() */
+static int count_ups(struct accumulate_context *ctx, int row, int col)
+{
+    float elev = ELEV(row, col);
+    int n = 0, i;
+
+    for (i = 0; i < 8; i++) {
+        int nrow = row + drows[i], ncol = col + dcols[i];
+        float nelev;
+
+        if (nrow < 0 || nrow >= ctx->nrows || ncol < 0 || ncol >= ctx->ncols)
+            continue;
+
+        nelev = ELEV(nrow, ncol);
+        if (nelev > elev ||
+            (nelev == elev && DIR(nrow, ncol) == dirs[(i + 4) % 8]))
+            n++;
+    }
+
+    return n;
+}
+
+/* find the downstream cells of the current cell as bits of neighbor indices
+ * and their flow fractions */
+static int find_down(struct accumulate_context *ctx, int row, int col,
+                     double *fracs)
+{
+    float elev = ELEV(row, col);
+    double sum = 0;
+    int down = 0, i;
+
+    /* NaN drops never compare greater */
+    for (i = 0; i < 8; i++) {
+        int nrow = row + drows[i], ncol = col + dcols[i];
+        double slope;
+
+        if (nrow < 0 || nrow >= ctx->nrows || ncol < 0 ||
+            ncol >= ctx->ncols ||
+            !((slope = (elev - ELEV(nrow, ncol)) * ctx->weights[i]) > 0))
+            continue;
+
+        down |= 1 << i;
+        sum += fracs[i] =
+            ctx->exponent == 1 ? slope : pow(slope, ctx->exponent);
+    }
+
+    if (down) {
+        for (i = 0; i < 8; i++)
+            if (down & 1 << i)
+                fracs[i] /= sum;
+    }
+    else {
+        int nrow = row, ncol = col;
+
+        /* flats follow their D8 direction; flows off the raster, into null
+         * cells, and out of closed depressions end here */
+        if (!move_down(DIR(row, col), &nrow, &ncol) || nrow < 0 ||
+            nrow >= ctx->nrows || ncol < 0 || ncol >= ctx->ncols ||
+            isnan(ELEV(nrow, ncol)))
+            return 0;
+
+        for (i = 0; drows[i] != nrow - row || dcols[i] != ncol - col; i++) ;
+        down = 1 << i;
+        fracs[i] = 1;
+    }
+
+    return down;
+}
+
+/* the accumulation of the current cell is final when called; of the
+ * downstream cells whose last inflow is delivered here, one is traced next and
+ * the others are pushed onto stack */
+static void trace_down(struct accumulate_context *ctx, int row, int col,
+                       struct stack *stack)
+{
+    do {
+        double accum = ACCUM(row, col), fracs[8];
+        int down = find_down(ctx, row, col, fracs);
+        int next_row = -1, next_col = -1;
+        int i;
+
+        for (i = 0; down; i++, down >>= 1) {
+            int nrow = row + drows[i], ncol = col + dcols[i];
+            unsigned char num_ups;
+
+            if (!(down & 1))
+                continue;
+
+#pragma omp atomic update
+            ACCUM(nrow, ncol) += accum * fracs[i];
+#pragma omp flush
+#pragma omp atomic capture
+            num_ups = --ctx->num_ups[INDEX(nrow, ncol)];
+
+            /* other inflows are still pending */
+            if (num_ups)
+                continue;
+
+            if (next_row < 0) {
+                next_row = nrow;
+                next_col = ncol;
+            }
+            else {
+                if (stack->num_cells == stack->max_cells) {
+                    stack->max_cells += 1024;
+                    stack->cells = realloc(stack->cells,
+                                           sizeof *stack->cells *
+                                           stack->max_cells);
+                }
+                stack->cells[stack->num_cells++] = INDEX(nrow, ncol);
+            }
+        }
+
+        if (next_row < 0) {
+            size_t idx;
+
+            if (!stack->num_cells)
+                return;
+            idx = stack->cells[--stack->num_cells];
+            next_row = idx / ctx->ncols;
+            next_col = idx % ctx->ncols;
+        }
+        row = next_row;
+        col = next_col;
+#pragma omp flush
+    } while (1);
+}
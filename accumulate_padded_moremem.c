@@ -0,0 +1,2 @@
+#define USE_PADDING
+#include "accumulate_funcs.h"
@@ -0,0 +1,2 @@
+#define USE_PROGRESS
+#include "accumulate_funcs.h"
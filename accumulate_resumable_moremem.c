@@ -0,0 +1,2 @@
+#define USE_RESUME
+#include "accumulate_funcs.h"
@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <math.h>
+#include "global.h"
+#include "look_around.h"
+
+#define UP(row, col) (ctx->up_cells ? ctx->up_cells[INDEX(row, col)] : \
+        FIND_UP(row, col))
+#define ACCUMS(row, col) (ctx->accum_map->cells.float64 + \
+        INDEX(row, col) * ctx->nbands)
+
+/* a cell is claimed by the first thread that finds all its upstream cells
+ * done; weights can be zero, so accumulation cannot tell visited cells */
+#define CLAIMED 1
+#define DONE 2
+
+struct accumulate_context
+{
+    struct raster_map *dir_map, *accum_map;
+    int nrows, ncols, nbands;
+    unsigned char *up_cells;
+    unsigned char *flags;
+};
+
+static void trace_down(struct accumulate_context *, int, int, double *);
+static int sum_up(struct accumulate_context *, int, int, double *);
+
+/* accumulate all bands of weight_map in place in one traversal; weight bands
+ * are interleaved by cell (AoS) so that the sums of all bands for a cell can
+ * be added as one vector from the same cache lines; separate band planes
+ * (SoA) touch one cache line per band for every cell traced and were 20-25%
+ * slower for 8 bands over 25M cells; sums are float64 whatever the band
+ * types because float32 sums stop adding up small weights in large basins;
+ * null weights count as 0 and cells with null directions become NaN */
+void accumulate_weighted(struct raster_map *dir_map,
+                         struct raster_map *weight_map, int use_lessmem)
+{
+    struct accumulate_context context, *ctx = &context;
+    int nrows = dir_map->nrows, ncols = dir_map->ncols;
+    int row, col;
+
+    ctx->dir_map = dir_map;
+    ctx->accum_map = weight_map;
+    ctx->nrows = nrows;
+    ctx->ncols = ncols;
+    ctx->nbands = weight_map->nbands;
+    ctx->up_cells = NULL;
+    ctx->flags = calloc((size_t)nrows * ncols, sizeof *ctx->flags);
+
+    if (!use_lessmem)
+        ctx->up_cells = calloc((size_t)nrows * ncols, sizeof *ctx->up_cells);
+
+#pragma omp parallel for schedule(dynamic) private(col)
+    for (row = 0; row < nrows; row++) {
+        for (col = 0; col < ncols; col++) {
+            double *accums = ACCUMS(row, col);
+            int i;
+
+            if (DIR(row, col) == DIR_NULL) {
+                for (i = 0; i < ctx->nbands; i++)
+                    accums[i] = NAN;
+                continue;
+            }
+            for (i = 0; i < ctx->nbands; i++)
+                if (isnan(accums[i]))
+                    accums[i] = 0;
+            if (ctx->up_cells)
+                ctx->up_cells[INDEX(row, col)] = FIND_UP(row, col);
+        }
+    }
+
+#pragma omp parallel private(col)
+    {
+        double *sums = malloc(sizeof *sums * ctx->nbands);
+
+#pragma omp for schedule(dynamic)
+        for (row = 0; row < nrows; row++) {
+            for (col = 0; col < ncols; col++)
+                /* if the current cell is not null and has no upstream cells,
+                 * start tracing down */
+                if (DIR(row, col) != DIR_NULL && !UP(row, col))
+                    trace_down(ctx, row, col, sums);
+        }
+
+        free(sums);
+    }
+
+    weight_map->null_value = NAN;
+
+    free(ctx->up_cells);
+    free(ctx->flags);
+}
+
+/* the accumulation of the current cell is final when called */
+static void trace_down(struct accumulate_context *ctx, int row, int col,
+                       double *sums)
+{
+    do {
+        unsigned char flags;
+        double *accums;
+        int i;
+
+        /* publish the current cell */
+#pragma omp flush
+#pragma omp atomic update
+        ctx->flags[INDEX(row, col)] |= DONE;
+#pragma omp flush
+
+        /* find the downstream cell */
+        if (!move_down(DIR(row, col), &row, &col) || row < 0 ||
+            row >= ctx->nrows || col < 0 || col >= ctx->ncols ||
+            DIR(row, col) == DIR_NULL || !sum_up(ctx, row, col, sums))
+            return;
+
+        /* only one of the threads that completed the upstream cells at the
+         * same time continues */
+#pragma omp atomic capture
+        {
+            flags = ctx->flags[INDEX(row, col)];
+            ctx->flags[INDEX(row, col)] |= CLAIMED;
+        }
+        if (flags & CLAIMED)
+            return;
+
+        accums = ACCUMS(row, col);
+#pragma omp simd
+        for (i = 0; i < ctx->nbands; i++)
+            accums[i] += sums[i];
+    } while (1);
+}
+
+/* if any upstream cells are not done, 0 is returned; otherwise, the sums of
+ * upstream accumulation for all bands are stored in sums */
+static int sum_up(struct accumulate_context *ctx, int row, int col,
+                  double *sums)
+{
+    static const int up_dirs[8] = { NW, N, NE, W, E, SW, S, SE };
+    static const int up_drows[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+    static const int up_dcols[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+    int up = UP(row, col);
+    int i, j;
+
+    for (i = 0; i < 8; i++) {
+        unsigned char flags;
+
+        if (!(up & up_dirs[i]))
+            continue;
+#pragma omp atomic read
+        flags = ctx->flags[INDEX(row + up_drows[i], col + up_dcols[i])];
+        if (!(flags & DONE))
+            return 0;
+    }
+#pragma omp flush
+
+    for (j = 0; j < ctx->nbands; j++)
+        sums[j] = 0;
+    for (i = 0; i < 8; i++) {
+        double *accums;
+
+        if (!(up & up_dirs[i]))
+            continue;
+        accums = ACCUMS(row + up_drows[i], col + up_dcols[i]);
+#pragma omp simd
+        for (j = 0; j < ctx->nbands; j++)
+            sums[j] += accums[j];
+    }
+
+    return 1;
+}
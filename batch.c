@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "global.h"
+
+struct batch_job
+{
+    char *dir_path, *accum_path;
+    size_t ncells;
+    int status;
+};
+
+static int read_manifest(const char *, struct batch_job **);
+static int compare_jobs(const void *, const void *);
+static int run_job(struct batch_job *, struct raster_map *,
+                   struct raster_map *, const char *,
+                   double (*)(double, void *), void *, int, int);
+
+/* accumulate flows for all dir/accum pairs listed in a manifest in one process;
+ * rasters with at most max_small_cells cells are processed concurrently, one
+ * per thread, and larger ones one at a time using all threads; raster buffers
+ * are reused across jobs; the number of failed jobs is returned */
+int batch_accumulate(const char *manifest_path, const char *dir_opts,
+                     double (*recode)(double, void *), void *recode_data,
+                     int engine, int compress_output,
+                     size_t max_small_cells)
+{
+    struct batch_job *jobs, **order;
+    struct raster_map *dir_map, *accum_map;
+    int num_jobs, num_large = 0, num_failed = 0;
+    int max_active_levels, i;
+
+    if ((num_jobs = read_manifest(manifest_path, &jobs)) < 0) {
+        fprintf(stderr, "%s: Failed to read batch manifest\n",
+                manifest_path);
+        return -1;
+    }
+
+    printf("Scanning %d batch jobs...\n", num_jobs);
+
+    /* only read the raster sizes here to decide how to schedule the jobs */
+#pragma omp parallel for schedule(dynamic)
+    for (i = 0; i < num_jobs; i++) {
+        int nrows, ncols;
+
+        if (get_raster_size(jobs[i].dir_path, dir_opts, &nrows, &ncols))
+            jobs[i].status = 1;
+        else
+            jobs[i].ncells = (size_t)nrows * ncols;
+    }
+
+    /* largest first for better load balancing */
+    order = malloc(sizeof *order * num_jobs);
+    for (i = 0; i < num_jobs; i++)
+        order[i] = &jobs[i];
+    qsort(order, num_jobs, sizeof *order, compare_jobs);
+
+    while (num_large < num_jobs && order[num_large]->ncells > max_small_cells)
+        num_large++;
+
+    printf("Processing %d large jobs sequentially and %d small jobs "
+           "concurrently...\n", num_large, num_jobs - num_large);
+
+    /* large jobs first, each using all threads */
+    dir_map = calloc(1, sizeof *dir_map);
+    accum_map = calloc(1, sizeof *accum_map);
+    for (i = 0; i < num_large; i++)
+        run_job(order[i], dir_map, accum_map, dir_opts, recode,
+                recode_data, engine, compress_output);
+    free_raster(dir_map);
+    free_raster(accum_map);
+    free(dir_map);
+    free(accum_map);
+
+    /* small jobs, one per thread; nested parallel regions in read_raster() and
+     * accumulate() run serially on the calling thread */
+    max_active_levels = omp_get_max_active_levels();
+    omp_set_max_active_levels(1);
+#pragma omp parallel private(dir_map, accum_map)
+    {
+        dir_map = calloc(1, sizeof *dir_map);
+        accum_map = calloc(1, sizeof *accum_map);
+
+#pragma omp for schedule(dynamic)
+        for (i = num_large; i < num_jobs; i++)
+            if (!order[i]->status)
+                run_job(order[i], dir_map, accum_map, dir_opts, recode,
+                        recode_data, engine, compress_output);
+
+        free_raster(dir_map);
+        free_raster(accum_map);
+        free(dir_map);
+        free(accum_map);
+    }
+    omp_set_max_active_levels(max_active_levels);
+
+    for (i = 0; i < num_jobs; i++) {
+        if (jobs[i].status) {
+            fprintf(stderr, "%s: Failed to %s\n", jobs[i].dir_path,
+                    jobs[i].status == 1 ? "read flow direction raster" :
+                    "write flow accumulation raster");
+            num_failed++;
+        }
+        free(jobs[i].dir_path);
+    }
+    free(order);
+    free(jobs);
+
+    printf("Completed %d of %d batch jobs\n", num_jobs - num_failed,
+           num_jobs);
+
+    return num_failed;
+}
+
+/* each non-empty line that does not start with # lists dir and accum paths
+ * separated by whitespace */
+static int read_manifest(const char *path, struct batch_job **jobs)
+{
+    FILE *fp;
+    char line[4096];
+    int num_jobs = 0, max_jobs = 0;
+
+    if (!(fp = fopen(path, "r")))
+        return -1;
+
+    *jobs = NULL;
+    while (fgets(line, sizeof line, fp)) {
+        char *dir_path, *accum_path;
+
+        if (!(dir_path = strtok(line, " \t\r\n")) || *dir_path == '#')
+            continue;
+        if (!(accum_path = strtok(NULL, " \t\r\n"))) {
+            fprintf(stderr, "%s: Missing output path\n", dir_path);
+            continue;
+        }
+
+        if (num_jobs == max_jobs) {
+            max_jobs += 1024;
+            *jobs = realloc(*jobs, sizeof **jobs * max_jobs);
+        }
+        /* one allocation for both paths */
+        (*jobs)[num_jobs].dir_path =
+            malloc(strlen(dir_path) + strlen(accum_path) + 2);
+        strcpy((*jobs)[num_jobs].dir_path, dir_path);
+        (*jobs)[num_jobs].accum_path =
+            strcpy((*jobs)[num_jobs].dir_path + strlen(dir_path) + 1,
+                   accum_path);
+        (*jobs)[num_jobs].ncells = 0;
+        (*jobs)[num_jobs].status = 0;
+        num_jobs++;
+    }
+
+    fclose(fp);
+
+    return num_jobs;
+}
+
+static int compare_jobs(const void *a, const void *b)
+{
+    const struct batch_job *job_a = *(const struct batch_job **)a;
+    const struct batch_job *job_b = *(const struct batch_job **)b;
+
+    return job_a->ncells < job_b->ncells ? 1 :
+        job_a->ncells > job_b->ncells ? -1 : 0;
+}
+
+static int run_job(struct batch_job *job, struct raster_map *dir_map,
+                   struct raster_map *accum_map, const char *dir_opts,
+                   double (*recode)(double, void *), void *recode_data,
+                   int engine, int compress_output)
+{
+    struct timeval start_time, end_time;
+
+    gettimeofday(&start_time, NULL);
+
+    if (reread_raster
+        (dir_map, job->dir_path, dir_opts, RASTER_MAP_TYPE_BYTE, 0, recode,
+         recode_data))
+        return job->status = 1;
+
+    reinit_raster(accum_map, dir_map->nrows, dir_map->ncols,
+                  RASTER_MAP_TYPE_UINT32);
+    copy_raster_metadata(accum_map, dir_map);
+
+    accumulate(dir_map, accum_map, engine);
+
+    accum_map->compress = compress_output;
+    calc_raster_stats(accum_map);
+    if (write_raster(job->accum_path, accum_map, RASTER_MAP_TYPE_AUTO) > 0)
+        return job->status = 2;
+
+    gettimeofday(&end_time, NULL);
+    printf("%s -> %s: %lld microsec\n", job->dir_path, job->accum_path,
+           timeval_diff(NULL, &end_time, &start_time));
+
+    return 0;
+}
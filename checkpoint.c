@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+#include "global.h"
+
+#define CHECKPOINT_MAGIC "MEFACKP1"
+
+/* cells start on a page boundary after the header */
+#define CHECKPOINT_OFFSET 4096
+
+/* seconds between checkpoints; define CHECKPOINT_INTERVAL when compiling to
+ * change it */
+#ifndef CHECKPOINT_INTERVAL
+#define CHECKPOINT_INTERVAL 60
+#endif
+
+struct checkpoint_header
+{
+    char magic[8];
+    int nrows, ncols;
+    unsigned long long dir_hash;
+    int complete;
+};
+
+struct checkpoint
+{
+    const char *path;
+    int fd;
+    struct checkpoint_header header;
+    int resume;
+};
+
+#ifndef _WIN32
+static int write_cells(struct checkpoint *, struct raster_map *);
+static int pwrite_all(int, const void *, size_t, off_t);
+static int pread_all(int, void *, size_t, off_t);
+static unsigned long long hash_dir(struct raster_map *);
+#endif
+
+/* accum_map is accumulated in memory and its cells are written to the file
+ * from time to time, so the file holds cells accumulated so far; a cell is
+ * written only once its accumulation is final and is never changed
+ * afterwards, so whatever cells reach the file form a consistent checkpoint
+ * and the traversal state is recovered from the cells themselves; the file
+ * is created unless resume is set and it exists, in which case its cells are
+ * read into accum_map */
+struct checkpoint *open_checkpoint(const char *path,
+                                   struct raster_map *dir_map,
+                                   struct raster_map *accum_map, int resume)
+{
+#ifdef _WIN32
+    fprintf(stderr, "%s: Checkpoints not supported on Windows\n", path);
+    return NULL;
+#else
+    struct checkpoint *ckpt;
+    struct checkpoint_header header;
+    size_t cells_size = sizeof(unsigned int) * dir_map->nrows * dir_map->ncols;
+    unsigned long long dir_hash = hash_dir(dir_map);
+    struct stat st;
+    int fd = -1;
+
+    if (resume && (fd = open(path, O_RDWR)) < 0) {
+        if (errno != ENOENT)
+            return NULL;
+        printf("No checkpoint to resume from; starting over...\n");
+        resume = 0;
+    }
+    if (resume) {
+        if (fstat(fd, &st) ||
+            (size_t)st.st_size != CHECKPOINT_OFFSET + cells_size ||
+            pread_all(fd, &header, sizeof header, 0)) {
+            fprintf(stderr, "%s: Invalid checkpoint\n", path);
+            close(fd);
+            return NULL;
+        }
+        if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof header.magic) ||
+            header.nrows != dir_map->nrows ||
+            header.ncols != dir_map->ncols || header.dir_hash != dir_hash) {
+            fprintf(stderr,
+                    "%s: Checkpoint does not match flow direction raster\n",
+                    path);
+            close(fd);
+            return NULL;
+        }
+        if (pread_all(fd, accum_map->cells.v, cells_size, CHECKPOINT_OFFSET)) {
+            close(fd);
+            return NULL;
+        }
+    }
+    else {
+        memset(&header, 0, sizeof header);
+        memcpy(header.magic, CHECKPOINT_MAGIC, sizeof header.magic);
+        header.nrows = dir_map->nrows;
+        header.ncols = dir_map->ncols;
+        header.dir_hash = dir_hash;
+        header.complete = 0;
+        if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+            ftruncate(fd, CHECKPOINT_OFFSET + cells_size) ||
+            pwrite_all(fd, &header, sizeof header, 0) || fsync(fd)) {
+            if (fd >= 0)
+                close(fd);
+            return NULL;
+        }
+    }
+
+    ckpt = malloc(sizeof *ckpt);
+    ckpt->path = path;
+    ckpt->fd = fd;
+    ckpt->header = header;
+    ckpt->resume = resume;
+
+    return ckpt;
+#endif
+}
+
+/* accumulate flows while another thread writes the cells to the file every
+ * CHECKPOINT_INTERVAL seconds; when resuming, only cells not accumulated yet
+ * are traced; the checkpoint is marked complete once all cells are written */
+int accumulate_checkpointed(struct checkpoint *ckpt,
+                            struct raster_map *dir_map,
+                            struct raster_map *accum_map, int use_lessmem)
+{
+#ifndef _WIN32
+    int accumulated = 0, status = 0;
+    int max_active_levels;
+
+    if (ckpt->header.complete) {
+        printf("Checkpoint already complete\n");
+        return 0;
+    }
+    if (ckpt->resume)
+        printf("Resuming from checkpoint <%s>...\n", ckpt->path);
+
+    /* one thread for checkpoints and a nested team for accumulation */
+    max_active_levels = omp_get_max_active_levels();
+    omp_set_max_active_levels(2);
+
+#pragma omp parallel sections num_threads(2)
+    {
+#pragma omp section
+        {
+            /* the resumable engines cost about a fifth more, so a new
+             * checkpoint uses the plain ones */
+            if (!ckpt->resume)
+                accumulate(dir_map, accum_map, use_lessmem);
+            else if (use_lessmem)
+                accumulate_resumable_lessmem(dir_map, accum_map, 1);
+            else
+                accumulate_resumable_moremem(dir_map, accum_map, 1);
+#pragma omp atomic write
+            accumulated = 1;
+        }
+#pragma omp section
+        {
+            time_t last_time = time(NULL);
+            int done;
+
+            do {
+                struct timespec ts = { 0, 100000000 };
+
+                nanosleep(&ts, NULL);
+#pragma omp atomic read
+                done = accumulated;
+                if (!done && time(NULL) - last_time >= CHECKPOINT_INTERVAL) {
+                    if (write_cells(ckpt, accum_map))
+                        status = 1;
+                    last_time = time(NULL);
+                }
+            } while (!done);
+        }
+    }
+
+    omp_set_max_active_levels(max_active_levels);
+
+    if (write_cells(ckpt, accum_map))
+        status = 1;
+    else {
+        ckpt->header.complete = 1;
+        if (pwrite_all(ckpt->fd, &ckpt->header, sizeof ckpt->header, 0) ||
+            fsync(ckpt->fd))
+            status = 1;
+    }
+    if (status)
+        fprintf(stderr, "%s: Failed to write checkpoint\n", ckpt->path);
+
+    return status;
+#else
+    return 1;
+#endif
+}
+
+void close_checkpoint(struct checkpoint *ckpt)
+{
+#ifndef _WIN32
+    close(ckpt->fd);
+#endif
+    free(ckpt);
+}
+
+#ifndef _WIN32
+/* cells are copied while other threads accumulate, which is safe because a
+ * cell changes only once from 0 to its final value */
+static int write_cells(struct checkpoint *ckpt, struct raster_map *accum_map)
+{
+    return pwrite_all(ckpt->fd, accum_map->cells.v,
+                      sizeof(unsigned int) * accum_map->nrows *
+                      accum_map->ncols, CHECKPOINT_OFFSET) ||
+        fsync(ckpt->fd);
+}
+
+static int pwrite_all(int fd, const void *buf, size_t size, off_t offset)
+{
+    while (size) {
+        ssize_t n = pwrite(fd, buf, size, offset);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        buf = (const char *)buf + n;
+        size -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+static int pread_all(int fd, void *buf, size_t size, off_t offset)
+{
+    while (size) {
+        ssize_t n = pread(fd, buf, size, offset);
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return 1;
+        }
+        buf = (char *)buf + n;
+        size -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+#endif
+
+#ifndef _WIN32
+/* a checkpoint must not be resumed with other flow directions */
+static unsigned long long hash_dir(struct raster_map *dir_map)
+{
+    size_t num_cells = (size_t)dir_map->nrows * dir_map->ncols, i;
+    unsigned long long hash = 0;
+
+#pragma omp parallel for schedule(static) reduction(+:hash)
+    for (i = 0; i < num_cells; i++)
+        hash += (dir_map->cells.byte[i] + 1ULL) *
+            (i * 0x9e3779b97f4a7c15ULL + 1);
+
+    return hash;
+}
+#endif
@@ -0,0 +1,363 @@
+#include <stdlib.h>
+#include <math.h>
+#include "global.h"
+
+/* tiles are flooded independently and their perimeter cells are
+ * reconciled through a graph of watershed labels */
+#define TILE_SIZE 512
+
+/* labels of cells that drain off the raster or into null cells */
+#define LABEL_OCEAN 1
+/* perimeter cells that are queued but not labeled yet */
+#define LABEL_SEED ((unsigned int)-1)
+
+#define ELEV(idx) ctx->dem_map->cells.float32[idx]
+
+struct heap_item
+{
+    float elev;
+    size_t idx;
+};
+
+struct heap
+{
+    struct heap_item *items;
+    size_t num_items, max_items;
+};
+
+/* the lowest elevation over which label1 spills into label2 */
+struct spill
+{
+    unsigned int label1, label2;
+    float elev;
+};
+
+struct spill_list
+{
+    struct spill *spills;
+    size_t num_spills, max_spills;
+};
+
+struct fill_context
+{
+    struct raster_map *dem_map;
+    int nrows, ncols;
+    int num_tile_rows, num_tile_cols;
+    unsigned int *labels;
+};
+
+static const int drows[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+static const int dcols[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+
+static void push(struct heap *, float, size_t);
+static struct heap_item pop(struct heap *);
+static void add_spill(struct spill_list *, unsigned int, unsigned int, float);
+static void flood_tile(struct fill_context *, int, int,
+                       struct spill_list *);
+static void link_tile(struct fill_context *, int, int, struct spill_list *);
+static float *solve_spills(struct spill_list *, int, unsigned int);
+
+/* fill depressions of a float32 DEM in place with the parallel
+ * priority-flood of Barnes (2016): each tile is flooded from its perimeter
+ * in parallel, labeling the watershed of every perimeter cell and recording
+ * spill elevations between neighboring watersheds; the spill graph across
+ * tiles is then solved for the elevation at which each watershed drains
+ * off the raster and every cell is raised to that of its watershed; nulls
+ * are reset to NaN */
+void fill_depressions(struct raster_map *dem_map)
+{
+    struct fill_context context, *ctx = &context;
+    struct spill_list *spill_lists;
+    int num_tiles, tile;
+    float *spill_elevs;
+    int row;
+
+    reset_null(dem_map, NAN);
+
+    ctx->dem_map = dem_map;
+    ctx->nrows = dem_map->nrows;
+    ctx->ncols = dem_map->ncols;
+    ctx->num_tile_rows = (ctx->nrows + TILE_SIZE - 1) / TILE_SIZE;
+    ctx->num_tile_cols = (ctx->ncols + TILE_SIZE - 1) / TILE_SIZE;
+    ctx->labels =
+        calloc((size_t)ctx->nrows * ctx->ncols, sizeof *ctx->labels);
+
+    num_tiles = ctx->num_tile_rows * ctx->num_tile_cols;
+    spill_lists = calloc(num_tiles, sizeof *spill_lists);
+
+#pragma omp parallel for schedule(dynamic)
+    for (tile = 0; tile < num_tiles; tile++)
+        flood_tile(ctx, tile / ctx->num_tile_cols, tile % ctx->num_tile_cols,
+                   &spill_lists[tile]);
+
+    /* perimeter cells of neighboring tiles spill into each other */
+#pragma omp parallel for schedule(dynamic)
+    for (tile = 0; tile < num_tiles; tile++)
+        link_tile(ctx, tile / ctx->num_tile_cols, tile % ctx->num_tile_cols,
+                  &spill_lists[tile]);
+
+    /* each tile has at most as many labels as perimeter cells */
+    spill_elevs =
+        solve_spills(spill_lists, num_tiles, 2 + num_tiles * 4 * TILE_SIZE);
+
+#pragma omp parallel for schedule(dynamic)
+    for (row = 0; row < ctx->nrows; row++) {
+        size_t idx = (size_t)row * ctx->ncols, end = idx + ctx->ncols;
+
+        for (; idx < end; idx++)
+            if (ctx->labels[idx] && ELEV(idx) < spill_elevs[ctx->labels[idx]])
+                ELEV(idx) = spill_elevs[ctx->labels[idx]];
+    }
+
+    for (tile = 0; tile < num_tiles; tile++)
+        free(spill_lists[tile].spills);
+    free(spill_lists);
+    free(spill_elevs);
+    free(ctx->labels);
+}
+
+static void push(struct heap *heap, float elev, size_t idx)
+{
+    size_t i = heap->num_items++;
+
+    if (heap->num_items > heap->max_items) {
+        heap->max_items = heap->max_items * 2 + 1024;
+        heap->items =
+            realloc(heap->items, sizeof *heap->items * heap->max_items);
+    }
+
+    for (; i > 0 && heap->items[(i - 1) / 2].elev > elev; i = (i - 1) / 2)
+        heap->items[i] = heap->items[(i - 1) / 2];
+    heap->items[i].elev = elev;
+    heap->items[i].idx = idx;
+}
+
+static struct heap_item pop(struct heap *heap)
+{
+    struct heap_item top = heap->items[0];
+    struct heap_item last = heap->items[--heap->num_items];
+    size_t i = 0, child;
+
+    while ((child = 2 * i + 1) < heap->num_items) {
+        if (child + 1 < heap->num_items &&
+            heap->items[child + 1].elev < heap->items[child].elev)
+            child++;
+        if (last.elev <= heap->items[child].elev)
+            break;
+        heap->items[i] = heap->items[child];
+        i = child;
+    }
+    heap->items[i] = last;
+
+    return top;
+}
+
+static void add_spill(struct spill_list *list, unsigned int label1,
+                      unsigned int label2, float elev)
+{
+    if (list->num_spills == list->max_spills) {
+        list->max_spills = list->max_spills * 2 + 1024;
+        list->spills =
+            realloc(list->spills, sizeof *list->spills * list->max_spills);
+    }
+    list->spills[list->num_spills].label1 = label1;
+    list->spills[list->num_spills].label2 = label2;
+    list->spills[list->num_spills++].elev = elev;
+}
+
+/* priority-flood one tile from its perimeter; cells on the raster edge or
+ * next to null cells drain into the ocean */
+static void flood_tile(struct fill_context *ctx, int tile_row, int tile_col,
+                       struct spill_list *list)
+{
+    int row1 = tile_row * TILE_SIZE, col1 = tile_col * TILE_SIZE;
+    int row2 = row1 + TILE_SIZE, col2 = col1 + TILE_SIZE;
+    unsigned int next_label =
+        2 + (tile_row * ctx->num_tile_cols + tile_col) * 4 * TILE_SIZE;
+    struct heap heap = { NULL, 0, 0 };
+    int row, col;
+
+    if (row2 > ctx->nrows)
+        row2 = ctx->nrows;
+    if (col2 > ctx->ncols)
+        col2 = ctx->ncols;
+
+    for (row = row1; row < row2; row++) {
+        for (col = col1; col < col2; col++) {
+            size_t idx = (size_t)row * ctx->ncols + col;
+            int i;
+
+            if (isnan(ELEV(idx)))
+                continue;
+
+            for (i = 0; i < 8; i++) {
+                int nrow = row + drows[i], ncol = col + dcols[i];
+
+                if (nrow < 0 || nrow >= ctx->nrows || ncol < 0 ||
+                    ncol >= ctx->ncols ||
+                    isnan(ELEV((size_t)nrow * ctx->ncols + ncol)))
+                    break;
+            }
+            if (i < 8)
+                ctx->labels[idx] = LABEL_OCEAN;
+            else if (row == row1 || row == row2 - 1 || col == col1 ||
+                     col == col2 - 1)
+                ctx->labels[idx] = LABEL_SEED;
+            else
+                continue;
+            push(&heap, ELEV(idx), idx);
+        }
+    }
+
+    while (heap.num_items) {
+        struct heap_item item = pop(&heap);
+        unsigned int label = ctx->labels[item.idx];
+        int i;
+
+        if (label == LABEL_SEED)
+            label = ctx->labels[item.idx] = next_label++;
+
+        row = item.idx / ctx->ncols;
+        col = item.idx % ctx->ncols;
+        for (i = 0; i < 8; i++) {
+            int nrow = row + drows[i], ncol = col + dcols[i];
+            size_t nidx = (size_t)nrow * ctx->ncols + ncol;
+            unsigned int nlabel;
+
+            if (nrow < row1 || nrow >= row2 || ncol < col1 || ncol >= col2 ||
+                isnan(ELEV(nidx)))
+                continue;
+
+            if (!(nlabel = ctx->labels[nidx])) {
+                /* raise the neighbor to the flood level */
+                ctx->labels[nidx] = label;
+                if (ELEV(nidx) < item.elev)
+                    ELEV(nidx) = item.elev;
+                push(&heap, ELEV(nidx), nidx);
+            }
+            else if (nlabel != LABEL_SEED && nlabel != label)
+                add_spill(list, label, nlabel,
+                          item.elev > ELEV(nidx) ? item.elev : ELEV(nidx));
+        }
+    }
+
+    free(heap.items);
+}
+
+/* add spills from the perimeter cells of a tile into the tiles to its east
+ * and south; other neighboring tiles add theirs into this one */
+static void link_tile(struct fill_context *ctx, int tile_row, int tile_col,
+                      struct spill_list *list)
+{
+    int row1 = tile_row * TILE_SIZE, col1 = tile_col * TILE_SIZE;
+    int row2 = row1 + TILE_SIZE, col2 = col1 + TILE_SIZE;
+    int row, col;
+
+    if (row2 > ctx->nrows)
+        row2 = ctx->nrows;
+    if (col2 > ctx->ncols)
+        col2 = ctx->ncols;
+
+    for (row = row1; row < row2; row++) {
+        for (col = col1; col < col2; col++) {
+            size_t idx = (size_t)row * ctx->ncols + col;
+            int i;
+
+            if (row != row2 - 1 && col != col2 - 1)
+                continue;
+            if (isnan(ELEV(idx)))
+                continue;
+
+            /* E, SE, S, SW, and NE */
+            for (i = 0; i < 8; i++) {
+                int nrow = row + drows[i], ncol = col + dcols[i];
+                size_t nidx = (size_t)nrow * ctx->ncols + ncol;
+
+                if (i > 3 && i < 7)
+                    continue;
+                if (nrow < 0 || nrow >= ctx->nrows || ncol < 0 ||
+                    ncol >= ctx->ncols ||
+                    (nrow >= row1 && nrow < row2 && ncol >= col1 &&
+                     ncol < col2) || isnan(ELEV(nidx)) ||
+                    ctx->labels[idx] == ctx->labels[nidx])
+                    continue;
+
+                add_spill(list, ctx->labels[idx], ctx->labels[nidx],
+                          ELEV(idx) > ELEV(nidx) ? ELEV(idx) : ELEV(nidx));
+            }
+        }
+    }
+}
+
+/* priority-flood the spill graph from the ocean and return the spill
+ * elevation of every label */
+static float *solve_spills(struct spill_list *spill_lists, int num_lists,
+                           unsigned int num_labels)
+{
+    size_t *firsts = calloc((size_t)num_labels + 1, sizeof *firsts);
+    struct spill *links;
+    float *spill_elevs = malloc(sizeof *spill_elevs * num_labels);
+    unsigned char *done = calloc(num_labels, 1);
+    struct heap heap = { NULL, 0, 0 };
+    size_t n;
+    unsigned int label;
+    int i;
+
+    /* links in both directions grouped by their first label */
+    for (i = 0; i < num_lists; i++)
+        for (n = 0; n < spill_lists[i].num_spills; n++) {
+            firsts[spill_lists[i].spills[n].label1 + 1]++;
+            firsts[spill_lists[i].spills[n].label2 + 1]++;
+        }
+    for (label = 0; label < num_labels; label++)
+        firsts[label + 1] += firsts[label];
+    links = malloc(sizeof *links * firsts[num_labels]);
+    for (i = 0; i < num_lists; i++)
+        for (n = 0; n < spill_lists[i].num_spills; n++) {
+            struct spill *spill = &spill_lists[i].spills[n];
+
+            links[firsts[spill->label1]++] = *spill;
+            links[firsts[spill->label2]].label1 = spill->label2;
+            links[firsts[spill->label2]].label2 = spill->label1;
+            links[firsts[spill->label2]++].elev = spill->elev;
+        }
+    /* firsts now point to the end of each group */
+    for (label = num_labels; label > 0; label--)
+        firsts[label] = firsts[label - 1];
+    firsts[0] = 0;
+
+    for (label = 0; label < num_labels; label++)
+        spill_elevs[label] = INFINITY;
+    spill_elevs[LABEL_OCEAN] = -INFINITY;
+    push(&heap, -INFINITY, LABEL_OCEAN);
+
+    while (heap.num_items) {
+        struct heap_item item = pop(&heap);
+
+        if (done[item.idx])
+            continue;
+        done[item.idx] = 1;
+
+        for (n = firsts[item.idx]; n < firsts[item.idx + 1]; n++) {
+            unsigned int label2 = links[n].label2;
+            float elev = item.elev > links[n].elev ? item.elev : links[n].elev;
+
+            if (!done[label2] && elev < spill_elevs[label2]) {
+                spill_elevs[label2] = elev;
+                push(&heap, elev, label2);
+            }
+        }
+    }
+
+    /* labels that never drain keep their own elevations */
+    for (label = 0; label < num_labels; label++)
+        if (!done[label])
+            spill_elevs[label] = -INFINITY;
+
+    free(heap.items);
+    free(done);
+    free(links);
+    free(firsts);
+
+    return spill_elevs;
+}
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "global.h"
+
+#define ELEV(row, col) dem_map->cells.float32[(size_t)(row) * ncols + (col)]
+#define DIR(row, col) dir_map->cells.byte[(size_t)(row) * ncols + (col)]
+
+/* directions are not null, so 0 marks both null and unresolved cells */
+#define DIR_NULL 0
+
+/* flat cells claimed by the current level of the search */
+#define CLAIMED 0xff
+
+static const int dirs[8] = { E, SE, S, SW, W, NW, N, NE };
+static const int drows[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+static const int dcols[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+
+static int compare_cells(const void *, const void *);
+static int resolve_flats(struct raster_map *, struct raster_map *, size_t *,
+                         size_t);
+static unsigned char find_lower(struct raster_map *, struct raster_map *, int,
+                                int);
+
+/* compute power2 D8 flow directions from a hydrologically conditioned DEM;
+ * each cell flows to its steepest downslope neighbor, cells without one flow
+ * off the raster or into a null neighbor if they can, and flats drain to
+ * their nearest outlet; cells in closed depressions become null; dem_map is
+ * read as float32 and its nulls are reset to NaN */
+struct raster_map *calc_flow_dir(struct raster_map *dem_map)
+{
+    struct raster_map *dir_map;
+    int nrows = dem_map->nrows, ncols = dem_map->ncols;
+    double dx = dem_map->dx, dy = dem_map->dy, dxy = sqrt(dx * dx + dy * dy);
+    float weights[8];
+    size_t *flats = NULL, num_flats = 0, max_flats = 0;
+    int num_pits;
+    int row, i;
+
+    reset_null(dem_map, NAN);
+
+    dir_map = init_raster(nrows, ncols, RASTER_MAP_TYPE_BYTE);
+    copy_raster_metadata(dir_map, dem_map);
+    dir_map->null_value = DIR_NULL;
+
+    /* slope is the drop times the weight of each direction */
+    for (i = 0; i < 8; i++)
+        weights[i] = 1 / (drows[i] && dcols[i] ? dxy : drows[i] ? dy : dx);
+
+#pragma omp parallel
+    {
+        float *slopes = malloc(sizeof *slopes * ncols);
+        size_t *row_flats = malloc(sizeof *row_flats * ncols);
+
+#pragma omp for schedule(dynamic)
+        for (row = 0; row < nrows; row++) {
+            const float *elevs = &ELEV(row, 0);
+            unsigned char *row_dirs = &DIR(row, 0);
+            int num_row_flats = 0;
+            int col;
+
+            for (col = 0; col < ncols; col++)
+                slopes[col] = 0;
+
+            /* one direction at a time for the whole row so that the inner
+             * loop vectorizes; NaN drops never compare greater */
+            for (i = 0; i < 8; i++) {
+                int nrow = row + drows[i], dcol = dcols[i];
+                int col1 = dcol < 0, col2 = ncols - (dcol > 0);
+                const float *nelevs;
+                float weight = weights[i];
+                unsigned char dir = dirs[i];
+
+                if (nrow < 0 || nrow >= nrows)
+                    continue;
+                nelevs = &ELEV(nrow, 0);
+
+#pragma omp simd
+                for (col = col1; col < col2; col++) {
+                    float slope = (elevs[col] - nelevs[col + dcol]) * weight;
+
+                    if (slope > slopes[col]) {
+                        slopes[col] = slope;
+                        row_dirs[col] = dir;
+                    }
+                }
+            }
+
+            /* cells without a downslope neighbor */
+            for (col = 0; col < ncols; col++) {
+                int is_flat = 0;
+
+                if (row_dirs[col] != DIR_NULL || isnan(elevs[col]))
+                    continue;
+
+                for (i = 0; i < 8; i++) {
+                    int nrow = row + drows[i], ncol = col + dcols[i];
+
+                    if (nrow < 0 || nrow >= nrows || ncol < 0 ||
+                        ncol >= ncols || isnan(ELEV(nrow, ncol))) {
+                        row_dirs[col] = dirs[i];
+                        break;
+                    }
+                    if (ELEV(nrow, ncol) == elevs[col])
+                        is_flat = 1;
+                }
+                if (row_dirs[col] == DIR_NULL && is_flat)
+                    row_flats[num_row_flats++] = (size_t)row * ncols + col;
+            }
+
+            if (num_row_flats) {
+#pragma omp critical(flow_dir_flats)
+                {
+                    if (num_flats + num_row_flats > max_flats) {
+                        max_flats = 2 * max_flats + num_row_flats;
+                        flats = realloc(flats, sizeof *flats * max_flats);
+                    }
+                    for (col = 0; col < num_row_flats; col++)
+                        flats[num_flats++] = row_flats[col];
+                }
+            }
+        }
+
+        free(slopes);
+        free(row_flats);
+    }
+
+    /* rows are collected in any order; sort them for reproducible flats */
+    qsort(flats, num_flats, sizeof *flats, compare_cells);
+
+    num_pits = resolve_flats(dem_map, dir_map, flats, num_flats);
+    if (num_pits)
+        printf("%d cells in closed depressions set to null\n", num_pits);
+
+    free(flats);
+
+    return dir_map;
+}
+
+static int compare_cells(const void *a, const void *b)
+{
+    size_t idx_a = *(const size_t *)a, idx_b = *(const size_t *)b;
+
+    return idx_a < idx_b ? -1 : idx_a > idx_b;
+}
+
+/* breadth-first search from the cells that already drain out of each flat
+ * so that flat cells flow to their nearest outlet; the search runs one level
+ * at a time: the cells of a level are claimed in parallel from the previous
+ * level and each of them then flows to its first neighbor of the same
+ * elevation in a lower level, so the result does not depend on the number of
+ * threads; resolved cells are moved to the front of flats, which serves as
+ * the queue; the number of cells left unresolved is returned */
+static int resolve_flats(struct raster_map *dem_map,
+                         struct raster_map *dir_map, size_t *flats,
+                         size_t num_flats)
+{
+    int nrows = dem_map->nrows, ncols = dem_map->ncols;
+    unsigned char *new_dirs = malloc(num_flats);
+    size_t head = 0, tail = 0, n;
+
+    /* seed with flat cells next to a resolved cell of the same elevation;
+     * their directions are set only after all seeds are found so that seeds
+     * do not resolve each other */
+#pragma omp parallel for schedule(static)
+    for (n = 0; n < num_flats; n++)
+        new_dirs[n] =
+            find_lower(dem_map, dir_map, flats[n] / ncols, flats[n] % ncols);
+    for (n = 0; n < num_flats; n++) {
+        if (new_dirs[n]) {
+            size_t idx = flats[n];
+
+            flats[n] = flats[tail];
+            new_dirs[tail] = new_dirs[n];
+            flats[tail++] = idx;
+        }
+    }
+
+    while (head < tail) {
+        size_t level_head = tail;
+
+#pragma omp parallel for schedule(static)
+        for (n = head; n < level_head; n++)
+            dir_map->cells.byte[flats[n]] = new_dirs[n];
+
+        /* every cell claimed here is an unresolved flat cell because cells
+         * in closed depressions have no neighbors of the same elevation; the
+         * entry it overwrites at tail need not be kept because unresolved
+         * cells are reached through their neighbors and only counted at the
+         * end */
+#pragma omp parallel
+        {
+            size_t *cells = NULL, num_cells = 0, max_cells = 0, first;
+
+#pragma omp for schedule(dynamic, 1024) nowait
+            for (n = head; n < level_head; n++) {
+                int row = flats[n] / ncols, col = flats[n] % ncols;
+                int i;
+
+                for (i = 0; i < 8; i++) {
+                    int nrow = row + drows[i], ncol = col + dcols[i];
+                    unsigned char dir;
+
+                    if (nrow < 0 || nrow >= nrows || ncol < 0 ||
+                        ncol >= ncols || DIR(nrow, ncol) != DIR_NULL ||
+                        ELEV(nrow, ncol) != ELEV(row, col))
+                        continue;
+
+#pragma omp atomic capture
+                    {
+                        dir = DIR(nrow, ncol);
+                        DIR(nrow, ncol) = CLAIMED;
+                    }
+                    if (dir != DIR_NULL)
+                        continue;
+
+                    if (num_cells == max_cells) {
+                        max_cells = 2 * max_cells + 1024;
+                        cells = realloc(cells, sizeof *cells * max_cells);
+                    }
+                    cells[num_cells++] = (size_t)nrow * ncols + ncol;
+                }
+            }
+
+#pragma omp atomic capture
+            {
+                first = tail;
+                tail += num_cells;
+            }
+            for (n = 0; n < num_cells; n++)
+                flats[first + n] = cells[n];
+            free(cells);
+        }
+
+        /* claimed cells flow to the previous level, not to each other */
+#pragma omp parallel for schedule(static)
+        for (n = level_head; n < tail; n++)
+            new_dirs[n] = find_lower(dem_map, dir_map, flats[n] / ncols,
+                                     flats[n] % ncols);
+
+        head = level_head;
+    }
+
+    free(new_dirs);
+
+    return num_flats - tail;
+}
+
+/* the first neighbor of the same elevation with a direction */
+static unsigned char find_lower(struct raster_map *dem_map,
+                                struct raster_map *dir_map, int row, int col)
+{
+    int nrows = dem_map->nrows, ncols = dem_map->ncols;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        int nrow = row + drows[i], ncol = col + dcols[i];
+
+        if (nrow >= 0 && nrow < nrows && ncol >= 0 && ncol < ncols &&
+            DIR(nrow, ncol) != DIR_NULL && DIR(nrow, ncol) != CLAIMED &&
+            ELEV(nrow, ncol) == ELEV(row, col))
+            return dirs[i];
+    }
+
+    return DIR_NULL;
+}
@@ -19,15 +19,98 @@ int gettimeofday(struct timeval *, struct timezone *);
 #define SE 2
 #define E 1
 
+/* engines for accumulate() */
+#define ENGINE_MOREMEM 0
+#define ENGINE_LESSMEM 1
+#define ENGINE_HP 2
+#define ENGINE_HYBRID 3
+
 /* timeval_diff.c */
 long long timeval_diff(struct timeval *, struct timeval *, struct timeval *);
 
 /* recode.c */
 double recode_encoding(double, void *);
 double recode_degree(double, void *);
+int parse_encoding(const char *, int *, double (**)(double, void *));
 
 /* accumulate.c */
 void accumulate(struct raster_map *, struct raster_map *, int);
+void accumulate_area(struct raster_map *, struct raster_map *, int,
+                     const double *);
+
+/* flow_dir.c */
+struct raster_map *calc_flow_dir(struct raster_map *);
+
+/* fill.c */
+void fill_depressions(struct raster_map *);
+
+/* schedule.c */
+struct schedule;
+struct schedule *get_schedule(const char *, struct raster_map *);
+void free_schedule(struct schedule *);
+void accumulate_scheduled(struct schedule *, struct raster_map *,
+                          struct raster_map *);
+
+/* progressive.c */
+int accumulate_progressive(struct raster_map *, struct raster_map *, int,
+                           const char *);
+
+/* checkpoint.c */
+struct checkpoint;
+struct checkpoint *open_checkpoint(const char *, struct raster_map *,
+                                   struct raster_map *, int);
+int accumulate_checkpointed(struct checkpoint *, struct raster_map *,
+                            struct raster_map *, int);
+void close_checkpoint(struct checkpoint *);
+
+/* sparse.c */
+struct sparse_map;
+struct sparse_map *read_sparse_dir(const char *, const char *,
+                                   double (*)(double, void *), void *);
+void accumulate_sparse(struct sparse_map *);
+int write_sparse_accum(const char *, struct sparse_map *, int);
+void free_sparse_map(struct sparse_map *);
+
+/* memory.c */
+struct memory_opts
+{
+    /* bytes per accumulation cell */
+    int accum_size;
+    int use_frontier, use_padding, use_sparse, use_schedule;
+    /* dir is computed from a DEM, which is filled first and kept for HAND
+     * if requested */
+    int use_dem, fill_dem, keep_dem;
+};
+
+size_t parse_size(const char *);
+size_t get_cgroup_limit(void);
+size_t estimate_memory(int, int, int, const struct memory_opts *);
+int choose_engine(int, int, const struct memory_opts *, int, size_t, int *);
+
+/* batch.c */
+int batch_accumulate(const char *, const char *, double (*)(double, void *),
+                     void *, int, int, size_t);
+
+/* merge.c */
+int merge_tiles(const char *, const char *, double (*)(double, void *),
+                void *, int);
+
+/* server.c */
+int serve(const char *, const char *, const char *, const char *,
+          double (*)(double, void *), void *, int);
+
+/* upstream.c */
+void count_upstream(struct raster_map *, int, const int *, const int *,
+                    unsigned int *, const double *, double *);
+int calc_outlet_areas(struct raster_map *, const char *, const char *);
+
+/* hand.c */
+struct raster_map *calc_hand(struct raster_map *, struct raster_map *,
+                             struct raster_map *, unsigned int);
+
+/* roi.c */
+struct raster_map *accumulate_roi(struct raster_map *, double, double, double,
+                                  double, int);
 
 /* accumulate_lessmem.c */
 void accumulate_lessmem(struct raster_map *, struct raster_map *);
@@ -35,4 +118,50 @@ void accumulate_lessmem(struct raster_map *, struct raster_map *);
 /* accumulate_moremem.c */
 void accumulate_moremem(struct raster_map *, struct raster_map *);
 
+/* accumulate_hp.c */
+void accumulate_hp(struct raster_map *, struct raster_map *);
+
+/* accumulate_hybrid.c */
+void accumulate_hybrid(struct raster_map *, struct raster_map *);
+
+/* accumulate_mfd.c */
+void accumulate_mfd(struct raster_map *, struct raster_map *,
+                    struct raster_map *, double);
+
+/* accumulate_weighted.c */
+void accumulate_weighted(struct raster_map *, struct raster_map *, int);
+
+/* accumulate_area_lessmem.c */
+void accumulate_area_lessmem(struct raster_map *, struct raster_map *,
+                             const double *);
+
+/* accumulate_area_moremem.c */
+void accumulate_area_moremem(struct raster_map *, struct raster_map *,
+                             const double *);
+
+/* accumulate_frontier_moremem.c */
+void accumulate_frontier_moremem(struct raster_map *, struct raster_map *);
+
+/* accumulate_padded_lessmem.c */
+void accumulate_padded_lessmem(struct raster_map *, struct raster_map *);
+
+/* accumulate_padded_moremem.c */
+void accumulate_padded_moremem(struct raster_map *, struct raster_map *);
+
+/* accumulate_resumable_lessmem.c */
+void accumulate_resumable_lessmem(struct raster_map *, struct raster_map *,
+                                  int);
+
+/* accumulate_resumable_moremem.c */
+void accumulate_resumable_moremem(struct raster_map *, struct raster_map *,
+                                  int);
+
+/* accumulate_progressive_lessmem.c */
+void accumulate_progressive_lessmem(struct raster_map *, struct raster_map *,
+                                    int *, int);
+
+/* accumulate_progressive_moremem.c */
+void accumulate_progressive_moremem(struct raster_map *, struct raster_map *,
+                                    int *, int);
+
 #endif
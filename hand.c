@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <math.h>
+#include "global.h"
+#include "look_around.h"
+
+#define ELEV(row, col) ctx->dem_map->cells.float32[INDEX(row, col)]
+#define ACCUM(row, col) ctx->accum_map->cells.uint32[INDEX(row, col)]
+#define DRAIN(row, col) ctx->hand_map->cells.float32[INDEX(row, col)]
+
+struct hand_context
+{
+    struct raster_map *dem_map, *dir_map, *accum_map, *hand_map;
+    int nrows, ncols;
+    unsigned int threshold;
+};
+
+static void find_drain(struct hand_context *, int, int);
+
+/* compute height above nearest drainage (HAND), the drop from each cell to
+ * the stream cell where its flow path first enters the network of cells with
+ * at least threshold upstream cells; the drainage elevation found for a path
+ * is stored in every cell on it so that later paths stop as soon as they join
+ * it; cells not draining into a stream are null; dem_map must have NaN nulls
+ * as left by calc_flow_dir() */
+struct raster_map *calc_hand(struct raster_map *dem_map,
+                             struct raster_map *dir_map,
+                             struct raster_map *accum_map,
+                             unsigned int threshold)
+{
+    struct hand_context context, *ctx = &context;
+    int nrows = dir_map->nrows, ncols = dir_map->ncols;
+    int row, col;
+
+    ctx->dem_map = dem_map;
+    ctx->dir_map = dir_map;
+    ctx->accum_map = accum_map;
+    ctx->nrows = nrows;
+    ctx->ncols = ncols;
+    ctx->threshold = threshold;
+
+    /* drainage elevations first, NaN until found */
+    ctx->hand_map = init_raster(nrows, ncols, RASTER_MAP_TYPE_FLOAT32);
+    copy_raster_metadata(ctx->hand_map, dem_map);
+    ctx->hand_map->null_value = NAN;
+#pragma omp parallel for schedule(static) private(col)
+    for (row = 0; row < nrows; row++)
+        for (col = 0; col < ncols; col++)
+            DRAIN(row, col) = NAN;
+
+#pragma omp parallel for schedule(dynamic) private(col)
+    for (row = 0; row < nrows; row++) {
+        for (col = 0; col < ncols; col++)
+            if (DIR(row, col) != DIR_NULL && isnan(DRAIN(row, col)))
+                find_drain(ctx, row, col);
+    }
+
+    /* paths ending off the raster or in null cells drain nowhere */
+#pragma omp parallel for schedule(static) private(col)
+    for (row = 0; row < nrows; row++) {
+        for (col = 0; col < ncols; col++) {
+            float drain = DRAIN(row, col);
+
+            DRAIN(row, col) = isinf(drain) ? NAN : ELEV(row, col) - drain;
+        }
+    }
+
+    return ctx->hand_map;
+}
+
+/* walk down to a stream cell or a cell whose drainage elevation is already
+ * known and walk the same path again to store it; threads racing on the same
+ * path store the same value */
+static void find_drain(struct hand_context *ctx, int row, int col)
+{
+    int down_row = row, down_col = col;
+    float drain;
+
+    while (isnan(drain = DRAIN(down_row, down_col))) {
+        int next_row = down_row, next_col = down_col;
+
+        if (ACCUM(down_row, down_col) >= ctx->threshold) {
+            drain = ELEV(down_row, down_col);
+            break;
+        }
+        if (!move_down(DIR(down_row, down_col), &next_row, &next_col) ||
+            next_row < 0 || next_row >= ctx->nrows || next_col < 0 ||
+            next_col >= ctx->ncols || DIR(next_row, next_col) == DIR_NULL) {
+            drain = INFINITY;
+            break;
+        }
+        down_row = next_row;
+        down_col = next_col;
+    }
+
+    while (row != down_row || col != down_col) {
+        DRAIN(row, col) = drain;
+        move_down(DIR(row, col), &row, &col);
+    }
+    DRAIN(row, col) = drain;
+}
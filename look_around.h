@@ -0,0 +1,78 @@
+#ifndef _LOOK_AROUND_H_
+#define _LOOK_AROUND_H_
+
+/* these macros expect ctx to point to a structure with dir_map, nrows, and
+ * ncols; INDEX, DIR, and DIR_NULL can be defined first for another cell
+ * layout */
+#ifndef INDEX
+#define INDEX(row, col) ((size_t)(row) * ctx->ncols + (col))
+#endif
+#ifndef DIR
+#define DIR_NULL ctx->dir_map->null_value
+#define DIR(row, col) ctx->dir_map->cells.byte[INDEX(row, col)]
+#endif
+#ifdef USE_PADDING
+/* a border of null cells stands in for the edge checks */
+#define FIND_UP(row, col) ( \
+        (DIR(row - 1, col - 1) == SE ? NW : 0) | \
+        (DIR(row - 1, col) == S ? N : 0) | \
+        (DIR(row - 1, col + 1) == SW ? NE : 0) | \
+        (DIR(row, col - 1) == E ? W : 0) | \
+        (DIR(row, col + 1) == W ? E : 0) | \
+        (DIR(row + 1, col - 1) == NE ? SW : 0) | \
+        (DIR(row + 1, col) == N ? S : 0) | \
+        (DIR(row + 1, col + 1) == NW ? SE : 0))
+#else
+#define FIND_UP(row, col) ( \
+        (row > 0 ? \
+         (col > 0 && DIR(row - 1, col - 1) == SE ? NW : 0) | \
+         (DIR(row - 1, col) == S ? N : 0) | \
+         (col < ctx->ncols - 1 && DIR(row - 1, col + 1) == SW ? NE : 0) : 0) | \
+        (col > 0 && DIR(row, col - 1) == E ? W : 0) | \
+        (col < ctx->ncols - 1 && DIR(row, col + 1) == W ? E : 0) | \
+        (row < ctx->nrows - 1 ? \
+         (col > 0 && DIR(row + 1, col - 1) == NE ? SW : 0) | \
+         (DIR(row + 1, col) == N ? S : 0) | \
+         (col < ctx->ncols - 1 && DIR(row + 1, col + 1) == NW ? SE : 0) : 0))
+#endif
+
+/* move to the downstream cell; 0 is returned for an invalid direction */
+static inline int move_down(int dir, int *row, int *col)
+{
+    switch (dir) {
+    case NW:
+        (*row)--;
+        (*col)--;
+        break;
+    case N:
+        (*row)--;
+        break;
+    case NE:
+        (*row)--;
+        (*col)++;
+        break;
+    case W:
+        (*col)--;
+        break;
+    case E:
+        (*col)++;
+        break;
+    case SW:
+        (*row)++;
+        (*col)--;
+        break;
+    case S:
+        (*row)++;
+        break;
+    case SE:
+        (*row)++;
+        (*col)++;
+        break;
+    default:
+        return 0;
+    }
+
+    return 1;
+}
+
+#endif
@@ -7,72 +7,142 @@
 #include <gdal.h>
 #include "global.h"
 
+static int dump(int, char *[]);
+
 int main(int argc, char *argv[])
 {
     int i;
-    int print_usage = 1, use_lessmem = 1, compress_output = 0;
+    int print_usage = 1, engine = ENGINE_LESSMEM, compress_output = 0;
+    int engine_set = 0;
+    int use_frontier = 0, use_dem = 0, fill_dem = 0, use_sparse = 0;
+    int write_progressively = 0, use_padding = 0;
+    double mfd_exponent = 0;
+    unsigned int stream_threshold = 0;
+    char *hand_path = NULL, *checkpoint_path = NULL;
+    int resume = 0;
+    struct checkpoint *checkpoint = NULL;
     double (*recode)(double, void *) = NULL;
     int *recode_data = NULL, encoding[8];
     char *dir_path = NULL, *dir_opts = NULL, *accum_path = NULL;
+    char *batch_path = NULL, *socket_path = NULL, *outlets_path = NULL;
+    char *weight_path = NULL, *schedule_path = NULL, *merge_path = NULL;
+    struct schedule *schedule = NULL;
+    size_t max_small_cells = 4194304;
+    size_t mem_limit = 0;
+    double roi[4];
+    int use_roi = 0;
+    double area_scale = 0;
     int num_threads = 0;
-    struct raster_map *dir_map, *accum_map;
+    struct raster_map *dem_map = NULL, *dir_map, *accum_map;
     struct timeval first_time, start_time, end_time;
 
     gettimeofday(&first_time, NULL);
 
+    if (argc > 1 && strcmp(argv[1], "dump") == 0)
+        exit(dump(argc - 1, argv + 1));
+
     for (i = 1; i < argc; i++) {
-        if (argv[i][0] == '-') {
+        if (strcmp(argv[i], "--resume") == 0)
+            resume = 1;
+        else if (strncmp(argv[i], "--mem-limit", 11) == 0 &&
+                 (!argv[i][11] || argv[i][11] == '=')) {
+            char *size = argv[i][11] ? argv[i] + 12 : NULL;
+
+            if (!size && i < argc - 1)
+                size = argv[++i];
+            if (!size) {
+                fprintf(stderr, "--mem-limit: Missing memory limit\n");
+                print_usage = 2;
+            }
+            else if (!(mem_limit = parse_size(size))) {
+                fprintf(stderr, "%s: Invalid memory limit\n", size);
+                print_usage = 2;
+            }
+        }
+        else if (argv[i][0] == '-') {
             int j, n = strlen(argv[i]);
             int unknown = 0;
+            char *end;
 
             for (j = 1; j < n && !unknown; j++) {
                 switch (argv[i][j]) {
                 case 'm':
-                    use_lessmem = 0;
+                    engine = ENGINE_MOREMEM;
+                    engine_set = 1;
+                    break;
+                case 'H':
+                    engine = ENGINE_HP;
+                    engine_set = 1;
+                    break;
+                case 'c':
+                    engine = ENGINE_HYBRID;
+                    engine_set = 1;
+                    break;
+                case 'B':
+                    use_padding = 1;
                     break;
                 case 'z':
                     compress_output = 1;
                     break;
-                case 'e':
+                case 'f':
+                    use_frontier = 1;
+                    break;
+                case 'F':
+                    use_dem = 1;
+                    break;
+                case 'P':
+                    fill_dem = 1;
+                    break;
+                case 'X':
                     if (i == argc - 1) {
-                        fprintf(stderr, "-%c: Missing encoding\n",
+                        fprintf(stderr, "-%c: Missing slope exponent\n",
                                 argv[i][j]);
                         print_usage = 2;
                         break;
                     }
-                    if (strcmp(argv[++i], "power2") == 0) {
-                        recode = NULL;
-                        recode_data = NULL;
-                        break;
+                    if ((mfd_exponent = atof(argv[++i])) <= 0) {
+                        fprintf(stderr, "%s: Invalid slope exponent\n",
+                                argv[i]);
+                        print_usage = 2;
                     }
-                    else if (strcmp(argv[i], "taudem") == 0) {
-                        int k;
-
-                        for (k = 1; k < 9; k++)
-                            encoding[k % 8] = 9 - k;
+                    break;
+                case 'R':
+                    if (i == argc - 1) {
+                        fprintf(stderr,
+                                "-%c: Missing stream threshold and HAND "
+                                "output\n", argv[i][j]);
+                        print_usage = 2;
+                        break;
                     }
-                    else if (strcmp(argv[i], "45degree") == 0) {
-                        int k;
-
-                        for (k = 0; k < 8; k++)
-                            encoding[k] = 8 - k;
+                    stream_threshold = strtoul(argv[++i], &hand_path, 10);
+                    if (!stream_threshold || *hand_path++ != ',' ||
+                        !*hand_path) {
+                        fprintf(stderr,
+                                "%s: Invalid stream threshold and HAND "
+                                "output\n", argv[i]);
+                        hand_path = NULL;
+                        print_usage = 2;
                     }
-                    else if (strcmp(argv[i], "degree") == 0) {
-                        recode = recode_degree;
-                        recode_data = NULL;
+                    break;
+                case 'N':
+                    use_sparse = 1;
+                    break;
+                case 'p':
+                    write_progressively = 1;
+                    break;
+                case 'e':
+                    if (i == argc - 1) {
+                        fprintf(stderr, "-%c: Missing encoding\n",
+                                argv[i][j]);
+                        print_usage = 2;
                         break;
                     }
-                    else if (sscanf
-                             (argv[i], "%d,%d,%d,%d,%d,%d,%d,%d",
-                              &encoding[0], &encoding[1], &encoding[2],
-                              &encoding[3], &encoding[4], &encoding[5],
-                              &encoding[6], &encoding[7]) != 8) {
+                    if (parse_encoding(argv[++i], encoding, &recode)) {
                         fprintf(stderr, "%s: Invalid encoding\n", argv[i]);
                         print_usage = 2;
                         break;
                     }
-                    recode = recode_encoding;
-                    recode_data = encoding;
+                    recode_data = recode == recode_encoding ? encoding : NULL;
                     break;
                 case 'D':
                     if (i == argc - 1) {
@@ -93,6 +163,128 @@ int main(int argc, char *argv[])
                     }
                     num_threads = atoi(argv[++i]);
                     break;
+                case 'b':
+                    if (i == argc - 1) {
+                        fprintf(stderr, "-%c: Missing batch manifest\n",
+                                argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    batch_path = argv[++i];
+                    break;
+                case 'j':
+                    if (i == argc - 1) {
+                        fprintf(stderr, "-%c: Missing merge manifest\n",
+                                argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    merge_path = argv[++i];
+                    break;
+                case 's':
+                    if (i == argc - 1) {
+                        fprintf(stderr,
+                                "-%c: Missing maximum number of cells\n",
+                                argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    max_small_cells = strtoull(argv[++i], &end, 10);
+                    if (!max_small_cells || *end) {
+                        fprintf(stderr, "%s: Invalid maximum number of "
+                                "cells\n", argv[i]);
+                        print_usage = 2;
+                    }
+                    break;
+                case 'C':
+                    if (i == argc - 1) {
+                        fprintf(stderr, "-%c: Missing checkpoint path\n",
+                                argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    checkpoint_path = argv[++i];
+                    break;
+                case 'M':
+                    if (i == argc - 1) {
+                        fprintf(stderr, "-%c: Missing memory limit\n",
+                                argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    if (!(mem_limit = parse_size(argv[++i]))) {
+                        fprintf(stderr, "%s: Invalid memory limit\n",
+                                argv[i]);
+                        print_usage = 2;
+                    }
+                    break;
+                case 'T':
+                    if (i == argc - 1) {
+                        fprintf(stderr, "-%c: Missing schedule path\n",
+                                argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    schedule_path = argv[++i];
+                    break;
+                case 'a':
+                    if (i == argc - 1) {
+                        fprintf(stderr, "-%c: Missing area unit\n",
+                                argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    if (strcmp(argv[++i], "m2") == 0)
+                        area_scale = 1;
+                    else if (strcmp(argv[i], "km2") == 0)
+                        area_scale = 1e-6;
+                    else {
+                        fprintf(stderr, "%s: Invalid area unit\n", argv[i]);
+                        print_usage = 2;
+                    }
+                    break;
+                case 'W':
+                    if (i == argc - 1) {
+                        fprintf(stderr, "-%c: Missing weight raster\n",
+                                argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    weight_path = argv[++i];
+                    break;
+                case 'w':
+                    if (i == argc - 1) {
+                        fprintf(stderr, "-%c: Missing window\n", argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    if (sscanf(argv[++i], "%lf,%lf,%lf,%lf", &roi[0], &roi[1],
+                               &roi[2], &roi[3]) != 4) {
+                        fprintf(stderr, "%s: Invalid window\n", argv[i]);
+                        print_usage = 2;
+                        break;
+                    }
+                    use_roi = 1;
+                    break;
+                case 'o':
+                    if (i == argc - 1) {
+                        fprintf(stderr, "-%c: Missing outlets\n", argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    outlets_path = argv[++i];
+                    break;
+#ifndef _WIN32
+                case 'S':
+                    if (i == argc - 1) {
+                        fprintf(stderr, "-%c: Missing socket path\n",
+                                argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    socket_path = argv[++i];
+                    break;
+#endif
                 default:
                     unknown = 1;
                     break;
@@ -108,7 +300,9 @@ int main(int argc, char *argv[])
             dir_path = argv[i];
         else if (!accum_path) {
             accum_path = argv[i];
-            print_usage = 0;
+            /* keep errors from invalid option values */
+            if (print_usage == 1)
+                print_usage = 0;
         }
         else {
             fprintf(stderr, "%s: Unable to process extra arguments\n",
@@ -118,14 +312,166 @@ int main(int argc, char *argv[])
         }
     }
 
+    if ((batch_path || merge_path) && print_usage == 1) {
+        if (dir_path) {
+            fprintf(stderr, "%s: Unable to process extra arguments\n",
+                    dir_path);
+            print_usage = 2;
+        }
+        else
+            print_usage = 0;
+    }
+
+    if ((area_scale || weight_path) &&
+        (use_roi || outlets_path || batch_path || socket_path)) {
+        fprintf(stderr, "-%c: Not supported with -w, -o, -b, or -S\n",
+                area_scale ? 'a' : 'W');
+        print_usage = 2;
+    }
+    else if (area_scale && weight_path) {
+        fprintf(stderr, "-a: Not supported with -W\n");
+        print_usage = 2;
+    }
+    else if (fill_dem && !use_dem) {
+        fprintf(stderr, "-P: Requires -F\n");
+        print_usage = 2;
+    }
+    else if (use_dem && (recode || batch_path || socket_path)) {
+        fprintf(stderr, "-F: Not supported with -e, -b, or -S\n");
+        print_usage = 2;
+    }
+    else if (hand_path && !use_dem) {
+        fprintf(stderr, "-R: Requires -F\n");
+        print_usage = 2;
+    }
+    else if (hand_path &&
+             (use_sparse || write_progressively || mfd_exponent ||
+              area_scale || weight_path || use_roi || outlets_path)) {
+        fprintf(stderr, "-R: Not supported with -N, -p, -X, -a, -W, -w, or "
+                "-o\n");
+        print_usage = 2;
+    }
+    else if (mfd_exponent && !use_dem) {
+        fprintf(stderr, "-X: Requires -F\n");
+        print_usage = 2;
+    }
+    else if (mfd_exponent &&
+             (engine != ENGINE_LESSMEM || use_frontier || use_sparse ||
+              write_progressively || mem_limit || schedule_path ||
+              area_scale || weight_path || use_roi || outlets_path)) {
+        fprintf(stderr, "-X: Not supported with -m, -H, -c, -f, -N, -p, "
+                "-M, -T, -a, -W, -w, or -o\n");
+        print_usage = 2;
+    }
+    else if (engine >= ENGINE_HP && (area_scale || weight_path)) {
+        fprintf(stderr, "-%c: Not supported with -a or -W\n",
+                engine == ENGINE_HP ? 'H' : 'c');
+        print_usage = 2;
+    }
+    /* the frontier costs more than lessmem saves */
+    else if (use_frontier && engine != ENGINE_MOREMEM &&
+             (engine_set || !mem_limit)) {
+        fprintf(stderr, "-f: Requires -m\n");
+        print_usage = 2;
+    }
+    else if (use_frontier && (area_scale || weight_path)) {
+        fprintf(stderr, "-f: Not supported with -a or -W\n");
+        print_usage = 2;
+    }
+    else if (use_sparse &&
+             (engine != ENGINE_LESSMEM || use_frontier || use_dem ||
+              area_scale || weight_path || use_roi || outlets_path ||
+              batch_path || socket_path)) {
+        fprintf(stderr, "-N: Not supported with -m, -H, -c, -f, -F, -a, "
+                "-W, -w, -o, -b, or -S\n");
+        print_usage = 2;
+    }
+    else if (write_progressively &&
+             (engine >= ENGINE_HP || use_frontier || use_sparse ||
+              area_scale || weight_path || use_roi || outlets_path ||
+              batch_path || socket_path)) {
+        fprintf(stderr, "-p: Not supported with -H, -c, -f, -N, -a, -W, "
+                "-w, -o, -b, or -S\n");
+        print_usage = 2;
+    }
+    else if (schedule_path &&
+             (engine != ENGINE_LESSMEM || use_frontier || use_sparse ||
+              write_progressively || area_scale || use_roi || outlets_path ||
+              batch_path || socket_path)) {
+        fprintf(stderr, "-T: Not supported with -m, -H, -c, -f, -N, -p, "
+                "-a, -w, -o, -b, or -S\n");
+        print_usage = 2;
+    }
+    else if (use_padding &&
+             (engine >= ENGINE_HP || use_frontier || use_sparse ||
+              write_progressively || use_dem || schedule_path ||
+              area_scale || weight_path || use_roi || outlets_path ||
+              batch_path || merge_path || socket_path)) {
+        fprintf(stderr, "-B: Not supported with -H, -c, -f, -N, -p, -F, "
+                "-T, -a, -W, -w, -o, -b, -j, or -S\n");
+        print_usage = 2;
+    }
+    else if (merge_path &&
+             (engine != ENGINE_LESSMEM || use_frontier || use_sparse ||
+              write_progressively || use_dem || mem_limit || schedule_path ||
+              area_scale || weight_path || use_roi || outlets_path ||
+              batch_path || socket_path)) {
+        fprintf(stderr, "-j: Not supported with -m, -H, -c, -f, -N, -p, "
+                "-F, -M, -T, -a, -W, -w, -o, -b, or -S\n");
+        print_usage = 2;
+    }
+    else if (resume && !checkpoint_path) {
+        fprintf(stderr, "--resume: Requires -C\n");
+        print_usage = 2;
+    }
+    else if (checkpoint_path &&
+             (engine >= ENGINE_HP || use_frontier || use_sparse ||
+              write_progressively || use_padding || mfd_exponent ||
+              mem_limit || schedule_path || area_scale || weight_path ||
+              use_roi || outlets_path || batch_path || merge_path ||
+              socket_path)) {
+        fprintf(stderr, "-C: Not supported with -H, -c, -f, -N, -p, -B, "
+                "-X, -M, -T, -a, -W, -w, -o, -b, -j, or -S\n");
+        print_usage = 2;
+    }
+    else if (mem_limit &&
+             (use_roi || outlets_path || batch_path || socket_path ||
+              weight_path)) {
+        fprintf(stderr, "-M: Not supported with -w, -o, -b, -S, or -W\n");
+        print_usage = 2;
+    }
+
+    /* accum is optional in server mode */
+    if (socket_path && dir_path && print_usage == 1)
+        print_usage = 0;
+
     if (print_usage) {
         if (print_usage == 2)
             printf("\n");
-        printf("Usage: mefa OPTIONS dir accum\n\n"
+        printf("Usage: mefa OPTIONS dir accum\n"
+               "       mefa OPTIONS -b manifest\n"
+               "       mefa OPTIONS -j manifest\n"
+               "       mefa dump OPTIONS input [output]\n"
+#ifndef _WIN32
+               "       mefa OPTIONS -S socket dir [accum]\n"
+#endif
+               "\n"
                "  dir\t\tInput flow direction raster (e.g., gpkg:file.gpkg:layer)\n"
                "  accum\t\tOutput GeoTIFF\n"
                "  -m\t\tUse more memory\n"
+               "  -H\t\tUse the MEFA-HP engine counting pending inflows\n"
+               "  -c\t\tStore upstream cells only for confluence cells (memory\n"
+               "\t\tclose to lessmem, speed close to -m)\n"
+               "  -B\t\tSurround dir with a border of null cells in memory so\n"
+               "\t\tthat lessmem and -m skip edge checks (pays off with\n"
+               "\t\tlessmem, which looks around cells on every visit)\n"
                "  -z\t\tCompress output GeoTIFF\n"
+               "  -f\t\tWith -m, collect headwater cells first instead of\n"
+               "\t\tscanning for them (faster for sparse rasters)\n"
+               "  -p\t\tWrite each band of rows as soon as it is final while\n"
+               "\t\taccumulating and release its memory\n"
+               "  -N\t\tStore only blocks with non-null cells and scan only\n"
+               "\t\tnon-null spans (less memory for mostly-null rasters)\n"
                "  -e encoding\tInput flow direction encoding\n"
                "\t\tpower2 (default): 2^0-7 CW from E (e.g., r.terraflow, ArcGIS)\n"
                "\t\ttaudem: 1-8 (E-SE CCW) (e.g., d8flowdir)\n"
@@ -133,7 +479,52 @@ int main(int argc, char *argv[])
                "\t\tdegree: (0,360] (E-E CCW)\n"
                "\t\tE,SE,S,SW,W,NW,N,NE: custom (e.g., 1,8,7,6,5,4,3,2 for taudem)\n"
                "  -D opts\tComma-separated list of GDAL options for dir\n"
-               "  -t threads\tNumber of threads (default OMP_NUM_THREADS)\n");
+               "  -F\t\tdir is a hydrologically conditioned DEM from which D8\n"
+               "\t\tflow directions are computed\n"
+               "  -P\t\tFill depressions in the DEM before computing flow\n"
+               "\t\tdirections\n"
+               "  -X exponent\tAccumulate multiple flow directions from the DEM\n"
+               "\t\tin proportion to slope^exponent (e.g., 1.1) as float64;\n"
+               "\t\tflats follow D8 directions\n"
+               "  -R cells,hand\tAlso write height above nearest drainage to\n"
+               "\t\tGeoTIFF hand for streams of at least cells upstream\n"
+               "\t\tcells; requires -F\n"
+               "  -t threads\tNumber of threads (default OMP_NUM_THREADS)\n"
+               "  -C checkpoint\tWrite accumulated cells to a checkpoint file\n"
+               "\t\tevery minute so that an interrupted run can be\n"
+               "\t\tcontinued\n"
+               "  --resume\tContinue from the checkpoint given by -C if it\n"
+               "\t\texists\n"
+               "  -M size, --mem-limit size\n"
+               "\t\tChoose the fastest engine whose estimated memory fits\n"
+               "\t\tin size bytes (K, M, G, or T suffix) and the cgroup\n"
+               "\t\tlimit; with -m, -H, or -c, only check that engine\n"
+               "  -T schedule\tTraversal schedule of dir; built and saved if it\n"
+               "\t\tdoes not exist or does not match dir, read otherwise\n"
+               "  -a unit\tAccumulate cell areas in m2 or km2 instead of cells;\n"
+               "\t\tgeographic rasters use per-row ellipsoidal areas and\n"
+               "\t\tprojected rasters use dx*dy assuming meters\n"
+               "  -W weights\tAccumulate all bands of the weight raster in one pass\n"
+               "\t\tand write them as bands of accum\n"
+               "  -w xmin,ymin,xmax,ymax\n"
+               "\t\tAccumulate flows only for cells draining into the window\n"
+               "\t\tand write accum clipped to it\n"
+               "  -o outlets\tCount upstream cells only for outlets listed as x,y\n"
+               "\t\tper line in outlets and write them with their areas as\n"
+               "\t\t-a 1 computes as CSV to accum\n"
+               "  -b manifest\tBatch mode; each line of manifest lists dir and accum\n"
+               "  -s cells\tMaximum number of cells for running batch jobs\n"
+               "\t\tconcurrently, one per thread (default 4194304)\n"
+               "  -j manifest\tMerge tiles accumulated separately; each line of\n"
+               "\t\tmanifest lists dir, accum, and merged of an aligned tile\n"
+               "\t\tand merged is written as accum plus flows from other\n"
+               "\t\ttiles\n"
+#ifndef _WIN32
+               "  -S socket\tServe point and window queries on a Unix socket;\n"
+               "\t\taccum is read if given, otherwise computed; point\n"
+               "\t\tqueries also return upstream areas as -a 1 does\n"
+#endif
+               );
         exit(EXIT_SUCCESS);
     }
 
@@ -152,47 +543,344 @@ int main(int argc, char *argv[])
 
     GDALAllRegister();
 
-    printf("Reading flow direction raster <%s>...\n", dir_path);
-    gettimeofday(&start_time, NULL);
-    if (recode) {
-        printf("Converting flow direction encoding...\n");
-        if (!(dir_map =
-              read_raster(dir_path, dir_opts, RASTER_MAP_TYPE_BYTE, 0, recode,
-                          recode_data))) {
+#ifndef _WIN32
+    if (socket_path)
+        exit(serve(socket_path, dir_path, dir_opts, accum_path, recode,
+                   recode_data, engine) ? EXIT_FAILURE : EXIT_SUCCESS);
+#endif
+
+    if (batch_path) {
+        int num_failed = batch_accumulate(batch_path, dir_opts, recode,
+                                          recode_data, engine,
+                                          compress_output, max_small_cells);
+
+        gettimeofday(&end_time, NULL);
+        printf("Total elapsed time: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &first_time));
+
+        exit(num_failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    if (merge_path) {
+        int num_failed;
+
+        gettimeofday(&start_time, NULL);
+        num_failed = merge_tiles(merge_path, dir_opts, recode, recode_data,
+                                 compress_output);
+        gettimeofday(&end_time, NULL);
+        printf("Merge time for flow accumulation: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &start_time));
+        printf("Total elapsed time: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &first_time));
+
+        exit(num_failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    if (mem_limit) {
+        struct memory_opts mem_opts;
+        int nrows, ncols;
+
+        if (get_raster_size(dir_path, dir_opts, &nrows, &ncols)) {
             fprintf(stderr, "%s: Failed to read flow direction raster\n",
                     dir_path);
             exit(EXIT_FAILURE);
         }
+        mem_opts.accum_size =
+            area_scale ? sizeof(double) : sizeof(unsigned int);
+        mem_opts.use_frontier = use_frontier;
+        mem_opts.use_padding = use_padding;
+        mem_opts.use_sparse = use_sparse;
+        mem_opts.use_schedule = schedule_path != NULL;
+        mem_opts.use_dem = use_dem;
+        mem_opts.fill_dem = fill_dem;
+        mem_opts.keep_dem = hand_path != NULL;
+        if (choose_engine(nrows, ncols, &mem_opts, engine_set, mem_limit,
+                          &engine)) {
+            fprintf(stderr, "%s: Not enough memory for %s\n", dir_path,
+                    engine_set ? "the engine" : "any engine");
+            exit(EXIT_FAILURE);
+        }
     }
-    else if (!(dir_map =
-               read_raster(dir_path, dir_opts, RASTER_MAP_TYPE_BYTE, 0, NULL,
-                           NULL))) {
-        fprintf(stderr, "%s: Failed to read flow direction raster\n",
-                dir_path);
-        exit(EXIT_FAILURE);
+
+    if (use_sparse) {
+        struct sparse_map *sparse_map;
+
+        printf("Reading flow direction raster <%s> sparsely...\n", dir_path);
+        gettimeofday(&start_time, NULL);
+        if (!(sparse_map =
+              read_sparse_dir(dir_path, dir_opts, recode, recode_data))) {
+            fprintf(stderr, "%s: Failed to read flow direction raster\n",
+                    dir_path);
+            exit(EXIT_FAILURE);
+        }
+        gettimeofday(&end_time, NULL);
+        printf("Input time for flow direction: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &start_time));
+
+        printf("Accumulating flows...\n");
+        gettimeofday(&start_time, NULL);
+        accumulate_sparse(sparse_map);
+        gettimeofday(&end_time, NULL);
+        printf("Computation time for flow accumulation: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &start_time));
+
+        printf("Writing flow accumulation raster <%s>...\n", accum_path);
+        gettimeofday(&start_time, NULL);
+        if (write_sparse_accum(accum_path, sparse_map, compress_output) > 0) {
+            fprintf(stderr, "%s: Failed to write flow accumulation raster\n",
+                    accum_path);
+            free_sparse_map(sparse_map);
+            exit(EXIT_FAILURE);
+        }
+        gettimeofday(&end_time, NULL);
+        printf("Output time for flow accumulation: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &start_time));
+
+        free_sparse_map(sparse_map);
+
+        gettimeofday(&end_time, NULL);
+        printf("Total elapsed time: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &first_time));
+
+        exit(EXIT_SUCCESS);
     }
-    gettimeofday(&end_time, NULL);
-    printf("Input time for flow direction: %lld microsec\n",
-           timeval_diff(NULL, &end_time, &start_time));
 
-    accum_map =
-        init_raster(dir_map->nrows, dir_map->ncols, RASTER_MAP_TYPE_UINT32);
-    copy_raster_metadata(accum_map, dir_map);
+    if (use_dem) {
+        printf("Reading DEM <%s>...\n", dir_path);
+        gettimeofday(&start_time, NULL);
+        if (!(dem_map =
+              read_raster(dir_path, dir_opts, RASTER_MAP_TYPE_FLOAT32, 0,
+                          NULL, NULL))) {
+            fprintf(stderr, "%s: Failed to read DEM\n", dir_path);
+            exit(EXIT_FAILURE);
+        }
+        gettimeofday(&end_time, NULL);
+        printf("Input time for DEM: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &start_time));
+
+        if (fill_dem) {
+            printf("Filling depressions...\n");
+            gettimeofday(&start_time, NULL);
+            fill_depressions(dem_map);
+            gettimeofday(&end_time, NULL);
+            printf("Computation time for depression filling: %lld "
+                   "microsec\n", timeval_diff(NULL, &end_time, &start_time));
+        }
 
-    printf("Accumulating flows...\n");
-    gettimeofday(&start_time, NULL);
-    accumulate(dir_map, accum_map, use_lessmem);
+        printf("Computing flow directions...\n");
+        gettimeofday(&start_time, NULL);
+        dir_map = calc_flow_dir(dem_map);
+        /* MFD needs the DEM for flow fractions and HAND for drops */
+        if (!mfd_exponent && !hand_path) {
+            free_raster(dem_map);
+            free(dem_map);
+        }
+        gettimeofday(&end_time, NULL);
+        printf("Computation time for flow direction: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &start_time));
+    }
+    else {
+        printf("Reading flow direction raster <%s>...\n", dir_path);
+        gettimeofday(&start_time, NULL);
+        if (recode)
+            printf("Converting flow direction encoding...\n");
+        dir_map = calloc(1, sizeof *dir_map);
+        dir_map->padding = use_padding;
+        if (reread_raster
+            (dir_map, dir_path, dir_opts, RASTER_MAP_TYPE_BYTE, 0, recode,
+             recode_data)) {
+            fprintf(stderr, "%s: Failed to read flow direction raster\n",
+                    dir_path);
+            exit(EXIT_FAILURE);
+        }
+        gettimeofday(&end_time, NULL);
+        printf("Input time for flow direction: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &start_time));
+    }
+
+    if (outlets_path) {
+        if (calc_outlet_areas(dir_map, outlets_path, accum_path))
+            exit(EXIT_FAILURE);
+        free_raster(dir_map);
+
+        gettimeofday(&end_time, NULL);
+        printf("Total elapsed time: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &first_time));
+
+        exit(EXIT_SUCCESS);
+    }
+
+    if (schedule_path) {
+        gettimeofday(&start_time, NULL);
+        schedule = get_schedule(schedule_path, dir_map);
+        gettimeofday(&end_time, NULL);
+        printf("Schedule time: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &start_time));
+    }
+
+    if (use_roi) {
+        printf("Accumulating flows in region of interest...\n");
+        gettimeofday(&start_time, NULL);
+        if (!(accum_map =
+              accumulate_roi(dir_map, roi[0], roi[1], roi[2], roi[3],
+                             engine))) {
+            fprintf(stderr, "Window outside flow direction raster\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (weight_path) {
+        printf("Reading weight raster <%s>...\n", weight_path);
+        if (!(accum_map = read_raster_bands(weight_path, NULL))) {
+            fprintf(stderr, "%s: Failed to read weight raster\n",
+                    weight_path);
+            exit(EXIT_FAILURE);
+        }
+        if (accum_map->nrows != dir_map->nrows ||
+            accum_map->ncols != dir_map->ncols) {
+            fprintf(stderr, "%s: Inconsistent dimensions\n", weight_path);
+            exit(EXIT_FAILURE);
+        }
+
+        printf("Accumulating %d weights...\n", accum_map->nbands);
+        gettimeofday(&start_time, NULL);
+        if (schedule)
+            accumulate_scheduled(schedule, dir_map, accum_map);
+        else
+            accumulate_weighted(dir_map, accum_map,
+                                engine == ENGINE_LESSMEM);
+    }
+    else if (mfd_exponent) {
+        accum_map =
+            init_raster(dir_map->nrows, dir_map->ncols,
+                        RASTER_MAP_TYPE_FLOAT64);
+        copy_raster_metadata(accum_map, dir_map);
+
+        printf("Accumulating multiple flow directions...\n");
+        gettimeofday(&start_time, NULL);
+        accumulate_mfd(dem_map, dir_map, accum_map, mfd_exponent);
+        free_raster(dem_map);
+        free(dem_map);
+    }
+    else if (area_scale) {
+        double *cell_areas = calc_cell_areas(dir_map);
+
+        for (i = 0; i < dir_map->nrows; i++)
+            cell_areas[i] *= area_scale;
+
+        accum_map =
+            init_raster(dir_map->nrows, dir_map->ncols,
+                        RASTER_MAP_TYPE_FLOAT64);
+        copy_raster_metadata(accum_map, dir_map);
+
+        printf("Accumulating cell areas...\n");
+        gettimeofday(&start_time, NULL);
+        accumulate_area(dir_map, accum_map, engine == ENGINE_LESSMEM,
+                        cell_areas);
+        free(cell_areas);
+    }
+    else {
+        /* padded like dir_map */
+        accum_map = calloc(1, sizeof *accum_map);
+        accum_map->padding = dir_map->padding;
+        reinit_raster(accum_map, dir_map->nrows, dir_map->ncols,
+                      RASTER_MAP_TYPE_UINT32);
+        copy_raster_metadata(accum_map, dir_map);
+
+        if (write_progressively) {
+            accum_map->compress = compress_output;
+            printf("Accumulating flows and writing flow accumulation raster "
+                   "<%s>...\n", accum_path);
+            gettimeofday(&start_time, NULL);
+            if (accumulate_progressive(dir_map, accum_map,
+                                       engine == ENGINE_LESSMEM,
+                                       accum_path) > 0) {
+                fprintf(stderr,
+                        "%s: Failed to write flow accumulation raster\n",
+                        accum_path);
+                exit(EXIT_FAILURE);
+            }
+            gettimeofday(&end_time, NULL);
+            printf("Computation and output time for flow accumulation: %lld "
+                   "microsec\n", timeval_diff(NULL, &end_time, &start_time));
+            free_raster(dir_map);
+            free_raster(accum_map);
+
+            gettimeofday(&end_time, NULL);
+            printf("Total elapsed time: %lld microsec\n",
+                   timeval_diff(NULL, &end_time, &first_time));
+
+            exit(EXIT_SUCCESS);
+        }
+
+        if (checkpoint_path &&
+            !(checkpoint =
+              open_checkpoint(checkpoint_path, dir_map, accum_map, resume))) {
+            fprintf(stderr, "%s: Failed to open checkpoint\n",
+                    checkpoint_path);
+            exit(EXIT_FAILURE);
+        }
+
+        printf("Accumulating flows...\n");
+        gettimeofday(&start_time, NULL);
+        if (schedule)
+            accumulate_scheduled(schedule, dir_map, accum_map);
+        else if (checkpoint) {
+            if (accumulate_checkpointed(checkpoint, dir_map, accum_map,
+                                        engine == ENGINE_LESSMEM))
+                exit(EXIT_FAILURE);
+        }
+        else if (use_frontier)
+            accumulate_frontier_moremem(dir_map, accum_map);
+        else
+            accumulate(dir_map, accum_map, engine);
+    }
     gettimeofday(&end_time, NULL);
     printf("Computation time for flow accumulation: %lld microsec\n",
            timeval_diff(NULL, &end_time, &start_time));
+
+    if (hand_path) {
+        struct raster_map *hand_map;
+
+        printf("Computing height above nearest drainage...\n");
+        gettimeofday(&start_time, NULL);
+        hand_map = calc_hand(dem_map, dir_map, accum_map, stream_threshold);
+        free_raster(dem_map);
+        free(dem_map);
+        gettimeofday(&end_time, NULL);
+        printf("Computation time for HAND: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &start_time));
+
+        hand_map->compress = compress_output;
+        printf("Writing HAND raster <%s>...\n", hand_path);
+        gettimeofday(&start_time, NULL);
+        calc_raster_stats(hand_map);
+        if (write_raster(hand_path, hand_map, RASTER_MAP_TYPE_AUTO) > 0) {
+            fprintf(stderr, "%s: Failed to write HAND raster\n",
+                    hand_path);
+            exit(EXIT_FAILURE);
+        }
+        gettimeofday(&end_time, NULL);
+        printf("Output time for HAND: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &start_time));
+        free_raster(hand_map);
+        free(hand_map);
+    }
+
     free_raster(dir_map);
+    if (schedule)
+        free_schedule(schedule);
 
     accum_map->compress = compress_output;
     printf("Writing flow accumulation raster <%s>...\n", accum_path);
     gettimeofday(&start_time, NULL);
+    /* statistics for the output metadata so that nobody rescans it */
+    if (accum_map->nbands == 1)
+        calc_raster_stats(accum_map);
     if (write_raster(accum_path, accum_map, RASTER_MAP_TYPE_AUTO) > 0) {
         fprintf(stderr, "%s: Failed to write flow accumulation raster\n",
                 accum_path);
+        if (checkpoint)
+            close_checkpoint(checkpoint);
         free_raster(accum_map);
         exit(EXIT_FAILURE);
     }
@@ -200,6 +888,8 @@ int main(int argc, char *argv[])
     printf("Output time for flow accumulation: %lld microsec\n",
            timeval_diff(NULL, &end_time, &start_time));
 
+    if (checkpoint)
+        close_checkpoint(checkpoint);
     free_raster(accum_map);
 
     gettimeofday(&end_time, NULL);
@@ -208,3 +898,145 @@ int main(int argc, char *argv[])
 
     exit(EXIT_SUCCESS);
 }
+
+/* mefa dump: write a raster as text; progress goes to standard output only
+ * when the text does not */
+static int dump(int argc, char *argv[])
+{
+    int i;
+    int print_usage = 1, format = RASTER_DUMP_ASC;
+    char *input_path = NULL, *input_opts = NULL, *output_path = NULL;
+    char *null_str = NULL;
+    int num_threads = 0;
+    struct timeval start_time, end_time;
+
+    for (i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1]) {
+            int j, n = strlen(argv[i]);
+            int unknown = 0;
+
+            for (j = 1; j < n && !unknown; j++) {
+                switch (argv[i][j]) {
+                case 'f':
+                    if (i == argc - 1) {
+                        fprintf(stderr, "-%c: Missing format\n", argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    if (strcmp(argv[++i], "asc") == 0)
+                        format = RASTER_DUMP_ASC;
+                    else if (strcmp(argv[i], "csv") == 0)
+                        format = RASTER_DUMP_CSV;
+                    else if (strcmp(argv[i], "xyz") == 0)
+                        format = RASTER_DUMP_XYZ;
+                    else {
+                        fprintf(stderr, "%s: Invalid format\n", argv[i]);
+                        print_usage = 2;
+                    }
+                    break;
+                case 'n':
+                    if (i == argc - 1) {
+                        fprintf(stderr, "-%c: Missing null text\n",
+                                argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    null_str = argv[++i];
+                    break;
+                case 'D':
+                    if (i == argc - 1) {
+                        fprintf(stderr,
+                                "-%c: Missing GDAL options for input\n",
+                                argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    input_opts = argv[++i];
+                    break;
+                case 't':
+                    if (i == argc - 1) {
+                        fprintf(stderr, "-%c: Missing number of threads\n",
+                                argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    num_threads = atoi(argv[++i]);
+                    break;
+                default:
+                    unknown = 1;
+                    break;
+                }
+            }
+            if (unknown) {
+                fprintf(stderr, "%c: Unknown flag\n", argv[i][--j]);
+                print_usage = 2;
+                break;
+            }
+        }
+        else if (!input_path) {
+            input_path = argv[i];
+            /* keep errors from invalid option values */
+            if (print_usage == 1)
+                print_usage = 0;
+        }
+        else if (!output_path)
+            output_path = argv[i];
+        else {
+            fprintf(stderr, "%s: Unable to process extra arguments\n",
+                    argv[i]);
+            print_usage = 2;
+            break;
+        }
+    }
+
+    if (print_usage) {
+        if (print_usage == 2)
+            printf("\n");
+        printf("Usage: mefa dump OPTIONS input [output]\n"
+               "\n"
+               "  input\t\tInput raster (e.g., gpkg:file.gpkg:layer)\n"
+               "  output\tOutput text file (default: standard output)\n"
+               "  -f format\tOutput format\n"
+               "\t\tasc (default): ASCII grid\n"
+               "\t\tcsv: comma-separated rows\n"
+               "\t\txyz: x y value of each cell center\n"
+               "  -n null\tText for null cells (default: nodata value for asc,\n"
+               "\t\tempty for csv, skipped for xyz)\n"
+               "  -D opts\tComma-separated list of GDAL options for input\n"
+               "  -t threads\tNumber of threads (default OMP_NUM_THREADS)\n");
+        return print_usage == 2 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    /* "-" is standard output */
+    if (output_path && strcmp(output_path, "-") == 0)
+        output_path = NULL;
+
+    if (num_threads == 0)
+        num_threads = omp_get_max_threads();
+    else {
+        if (num_threads < 0) {
+            num_threads += omp_get_num_procs();
+            if (num_threads < 1)
+                num_threads = 1;
+        }
+        omp_set_num_threads(num_threads);
+    }
+
+    GDALAllRegister();
+
+    if (output_path) {
+        printf("Using %d threads...\n", num_threads);
+        printf("Dumping raster <%s> to <%s>...\n", input_path, output_path);
+    }
+    gettimeofday(&start_time, NULL);
+    if (dump_raster(input_path, input_opts, format, null_str, output_path)) {
+        fprintf(stderr, "%s: Failed to dump raster\n", input_path);
+        return EXIT_FAILURE;
+    }
+    gettimeofday(&end_time, NULL);
+    if (output_path)
+        printf("Dump time: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &start_time));
+
+    return EXIT_SUCCESS;
+}
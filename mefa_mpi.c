@@ -0,0 +1,599 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <mpi.h>
+#include <omp.h>
+#include <gdal.h>
+#include "global.h"
+#include "look_around.h"
+
+#define NO_EXIT ((size_t)-1)
+
+/* a band cell that flows into a cell of another band; indices are global */
+struct band_exit
+{
+    size_t idx, target;
+    unsigned int accum;
+};
+
+/* a band cell that receives flows from another band and the exit through
+ * which its flows leave the band, if any */
+struct band_entry
+{
+    size_t idx, exit;
+};
+
+struct band_context
+{
+    struct raster_map *dir_map;
+    int nrows, ncols;
+    int first_row;
+    /* one row above and below the band, if any */
+    struct raster_map *halo_maps[2];
+};
+
+static struct raster_map *get_halo(struct band_context *, int);
+static size_t find_exit(struct band_context *, int, int);
+static void add_inflow(struct band_context *, struct raster_map *, int, int,
+                       unsigned int);
+static int compare_exits(const void *, const void *);
+static int compare_entries(const void *, const void *);
+static void solve_boundary(struct band_exit *, int, struct band_entry *, int);
+static char *get_band_path(const char *, int);
+static void create_types(MPI_Datatype *, MPI_Datatype *);
+
+int main(int argc, char *argv[])
+{
+    int i;
+    int print_usage = 1, use_lessmem = 1, compress_output = 0;
+    int write_bands = 0;
+    double (*recode)(double, void *) = NULL;
+    int *recode_data = NULL, encoding[8];
+    char *dir_path = NULL, *dir_opts = NULL, *accum_path = NULL;
+    int num_threads = 0;
+    int provided, rank, num_ranks, total_nrows, ncols, nrows, first_row;
+    struct band_context context, *ctx = &context;
+    struct raster_map *dir_map, *accum_map;
+    struct band_exit *exits, *all_exits = NULL;
+    struct band_entry *entries, *all_entries = NULL;
+    int num_exits = 0, num_entries = 0;
+    int num_all_exits = 0, num_all_entries = 0;
+    int *counts = NULL, *displs = NULL;
+    MPI_Datatype exit_type, entry_type;
+    int status = 0, any_status;
+    struct timeval first_time, start_time, end_time;
+
+    gettimeofday(&first_time, NULL);
+
+    /* only the main thread of each rank calls MPI */
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+    if (provided < MPI_THREAD_FUNNELED) {
+        if (rank == 0)
+            fprintf(stderr, "MPI: Funneled thread support required\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            int j, n = strlen(argv[i]);
+            int unknown = 0;
+
+            for (j = 1; j < n && !unknown; j++) {
+                switch (argv[i][j]) {
+                case 'm':
+                    use_lessmem = 0;
+                    break;
+                case 'z':
+                    compress_output = 1;
+                    break;
+                case 'p':
+                    write_bands = 1;
+                    break;
+                case 'e':
+                    if (i == argc - 1) {
+                        fprintf(stderr, "-%c: Missing encoding\n",
+                                argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    if (parse_encoding(argv[++i], encoding, &recode)) {
+                        fprintf(stderr, "%s: Invalid encoding\n", argv[i]);
+                        print_usage = 2;
+                        break;
+                    }
+                    recode_data = recode == recode_encoding ? encoding : NULL;
+                    break;
+                case 'D':
+                    if (i == argc - 1) {
+                        fprintf(stderr,
+                                "-%c: Missing GDAL options for input direction\n",
+                                argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    dir_opts = argv[++i];
+                    break;
+                case 't':
+                    if (i == argc - 1) {
+                        fprintf(stderr, "-%c: Missing number of threads\n",
+                                argv[i][j]);
+                        print_usage = 2;
+                        break;
+                    }
+                    num_threads = atoi(argv[++i]);
+                    break;
+                default:
+                    unknown = 1;
+                    break;
+                }
+            }
+            if (unknown) {
+                fprintf(stderr, "%c: Unknown flag\n", argv[i][--j]);
+                print_usage = 2;
+                break;
+            }
+        }
+        else if (!dir_path)
+            dir_path = argv[i];
+        else if (!accum_path) {
+            accum_path = argv[i];
+            print_usage = 0;
+        }
+        else {
+            fprintf(stderr, "%s: Unable to process extra arguments\n",
+                    argv[i]);
+            print_usage = 2;
+            break;
+        }
+    }
+
+    if (print_usage) {
+        if (rank == 0) {
+            if (print_usage == 2)
+                printf("\n");
+            printf("Usage: mpirun -np ranks mefa-mpi OPTIONS dir accum\n"
+                   "\n"
+                   "  dir\t\tInput flow direction raster (e.g., gpkg:file.gpkg:layer)\n"
+                   "  accum\t\tOutput GeoTIFF\n"
+                   "  -m\t\tUse more memory\n"
+                   "  -z\t\tCompress output GeoTIFF\n"
+                   "  -p\t\tWrite each row band to its own GeoTIFF named\n"
+                   "\t\taccum with _rank before the extension\n"
+                   "  -e encoding\tInput flow direction encoding\n"
+                   "\t\tpower2 (default): 2^0-7 CW from E (e.g., r.terraflow, ArcGIS)\n"
+                   "\t\ttaudem: 1-8 (E-SE CCW) (e.g., d8flowdir)\n"
+                   "\t\t45degree: 1-8 (NE-E CCW) (e.g., r.watershed)\n"
+                   "\t\tdegree: (0,360] (E-E CCW)\n"
+                   "\t\tE,SE,S,SW,W,NW,N,NE: custom (e.g., 1,8,7,6,5,4,3,2 for taudem)\n"
+                   "  -D opts\tComma-separated list of GDAL options for dir\n"
+                   "  -t threads\tNumber of threads per rank (default OMP_NUM_THREADS)\n");
+        }
+        MPI_Finalize();
+        exit(EXIT_SUCCESS);
+    }
+
+    if (num_threads == 0)
+        num_threads = omp_get_max_threads();
+    else {
+        if (num_threads < 0) {
+            num_threads += omp_get_num_procs();
+            if (num_threads < 1)
+                num_threads = 1;
+        }
+        omp_set_num_threads(num_threads);
+    }
+
+    if (rank == 0)
+        printf("Using %d ranks with %d threads each...\n", num_ranks,
+               num_threads);
+
+    GDALAllRegister();
+
+    if (get_raster_size(dir_path, dir_opts, &total_nrows, &ncols)) {
+        if (rank == 0)
+            fprintf(stderr, "%s: Failed to read flow direction raster\n",
+                    dir_path);
+        MPI_Finalize();
+        exit(EXIT_FAILURE);
+    }
+    if (total_nrows < num_ranks) {
+        if (rank == 0)
+            fprintf(stderr, "%s: Fewer rows than ranks\n", dir_path);
+        MPI_Finalize();
+        exit(EXIT_FAILURE);
+    }
+
+    /* each rank owns one band of rows and reads one more row above and below
+     * it to find flows across band edges */
+    first_row = (long long)total_nrows * rank / num_ranks;
+    nrows = (long long)total_nrows * (rank + 1) / num_ranks - first_row;
+
+    if (rank == 0)
+        printf("Reading flow direction raster <%s> in %d bands...\n",
+               dir_path, num_ranks);
+    gettimeofday(&start_time, NULL);
+    ctx->halo_maps[0] = ctx->halo_maps[1] = NULL;
+    if (!(dir_map =
+          read_raster_rows(dir_path, dir_opts, RASTER_MAP_TYPE_BYTE,
+                           first_row, nrows, recode, recode_data)) ||
+        (first_row > 0 &&
+         !(ctx->halo_maps[0] =
+           read_raster_rows(dir_path, dir_opts, RASTER_MAP_TYPE_BYTE,
+                            first_row - 1, 1, recode, recode_data))) ||
+        (first_row + nrows < total_nrows &&
+         !(ctx->halo_maps[1] =
+           read_raster_rows(dir_path, dir_opts, RASTER_MAP_TYPE_BYTE,
+                            first_row + nrows, 1, recode, recode_data)))) {
+        fprintf(stderr, "%s: Failed to read flow direction raster\n",
+                dir_path);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    gettimeofday(&end_time, NULL);
+    if (rank == 0)
+        printf("Input time for flow direction: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &start_time));
+
+    ctx->dir_map = dir_map;
+    ctx->nrows = nrows;
+    ctx->ncols = ncols;
+    ctx->first_row = first_row;
+
+    accum_map = init_raster(nrows, ncols, RASTER_MAP_TYPE_UINT32);
+    copy_raster_metadata(accum_map, dir_map);
+
+    if (rank == 0)
+        printf("Accumulating flows in bands...\n");
+    gettimeofday(&start_time, NULL);
+    accumulate(dir_map, accum_map, use_lessmem);
+
+    /* cells in the first and last rows of the band that flow into the other
+     * bands */
+    exits = malloc(sizeof *exits * 2 * ncols);
+    for (i = 0; i < (nrows > 1 ? 2 : 1); i++) {
+        int row = i ? nrows - 1 : 0, col;
+
+        for (col = 0; col < ncols; col++) {
+            int down_row = row, down_col = col;
+            struct raster_map *halo_map;
+
+            if (DIR(row, col) == DIR_NULL ||
+                !move_down(DIR(row, col), &down_row, &down_col) ||
+                down_col < 0 || down_col >= ncols ||
+                !(halo_map = get_halo(ctx, down_row)) ||
+                halo_map->cells.byte[down_col] == halo_map->null_value)
+                continue;
+
+            exits[num_exits].idx = (size_t)(first_row + row) * ncols + col;
+            exits[num_exits].target =
+                (size_t)(first_row + down_row) * ncols + down_col;
+            exits[num_exits++].accum =
+                accum_map->cells.uint32[INDEX(row, col)];
+        }
+    }
+
+    /* cells in the first and last rows of the band that receive flows from
+     * the other bands */
+    entries = malloc(sizeof *entries * 2 * ncols);
+    for (i = 0; i < 2; i++) {
+        int halo_row = i ? nrows : -1, col;
+        struct raster_map *halo_map = ctx->halo_maps[i];
+
+        if (!halo_map)
+            continue;
+
+        for (col = 0; col < ncols; col++) {
+            int row = halo_row, up_col = col;
+
+            if (halo_map->cells.byte[col] == halo_map->null_value ||
+                !move_down(halo_map->cells.byte[col], &row, &up_col) ||
+                row < 0 || row >= nrows || up_col < 0 || up_col >= ncols ||
+                DIR(row, up_col) == DIR_NULL)
+                continue;
+
+            entries[num_entries++].idx =
+                (size_t)(first_row + row) * ncols + up_col;
+        }
+    }
+
+    /* a cell can receive flows from up to three cells across the edge */
+    qsort(entries, num_entries, sizeof *entries, compare_entries);
+    for (i = 0, num_all_entries = 0; i < num_entries; i++)
+        if (!num_all_entries ||
+            entries[i].idx != entries[num_all_entries - 1].idx)
+            entries[num_all_entries++].idx = entries[i].idx;
+    num_entries = num_all_entries;
+
+#pragma omp parallel for schedule(dynamic)
+    for (i = 0; i < num_entries; i++)
+        entries[i].exit =
+            find_exit(ctx, entries[i].idx / ncols - first_row,
+                      entries[i].idx % ncols);
+
+    /* collect the boundary graph on rank 0; counts are in elements because
+     * byte counts overflow int for wide rasters and many ranks */
+    create_types(&exit_type, &entry_type);
+    if (rank == 0) {
+        counts = malloc(sizeof *counts * num_ranks);
+        displs = malloc(sizeof *displs * num_ranks);
+    }
+
+    MPI_Gather(&num_exits, 1, MPI_INT, counts, 1, MPI_INT, 0,
+               MPI_COMM_WORLD);
+    if (rank == 0) {
+        for (i = 0, num_all_exits = 0; i < num_ranks; i++) {
+            displs[i] = num_all_exits;
+            num_all_exits += counts[i];
+        }
+        all_exits = malloc(sizeof *all_exits * num_all_exits);
+    }
+    MPI_Gatherv(exits, num_exits, exit_type, all_exits, counts, displs,
+                exit_type, 0, MPI_COMM_WORLD);
+
+    MPI_Gather(&num_entries, 1, MPI_INT, counts, 1, MPI_INT, 0,
+               MPI_COMM_WORLD);
+    if (rank == 0) {
+        for (i = 0, num_all_entries = 0; i < num_ranks; i++) {
+            displs[i] = num_all_entries;
+            num_all_entries += counts[i];
+        }
+        all_entries = malloc(sizeof *all_entries * num_all_entries);
+    }
+    MPI_Gatherv(entries, num_entries, entry_type, all_entries, counts, displs,
+                entry_type, 0, MPI_COMM_WORLD);
+
+    if (rank == 0) {
+        printf("Solving boundary flows for %d exits and %d entries...\n",
+               num_all_exits, num_all_entries);
+        solve_boundary(all_exits, num_all_exits, all_entries,
+                       num_all_entries);
+        free(all_entries);
+        free(counts);
+        free(displs);
+    }
+    free(exits);
+    free(entries);
+
+    /* every rank takes the final exit accumulations that flow into its band */
+    MPI_Bcast(&num_all_exits, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (rank != 0)
+        all_exits = malloc(sizeof *all_exits * num_all_exits);
+    MPI_Bcast(all_exits, num_all_exits, exit_type, 0, MPI_COMM_WORLD);
+    MPI_Type_free(&exit_type);
+    MPI_Type_free(&entry_type);
+
+#pragma omp parallel for schedule(dynamic)
+    for (i = 0; i < num_all_exits; i++) {
+        int row = all_exits[i].target / ncols - first_row;
+
+        if (row >= 0 && row < nrows)
+            add_inflow(ctx, accum_map, row, all_exits[i].target % ncols,
+                       all_exits[i].accum);
+    }
+    free(all_exits);
+
+    gettimeofday(&end_time, NULL);
+    if (rank == 0)
+        printf("Computation time for flow accumulation: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &start_time));
+
+    free_raster(dir_map);
+    free(dir_map);
+    for (i = 0; i < 2; i++) {
+        if (ctx->halo_maps[i]) {
+            free_raster(ctx->halo_maps[i]);
+            free(ctx->halo_maps[i]);
+        }
+    }
+
+    accum_map->compress = compress_output;
+    gettimeofday(&start_time, NULL);
+    if (write_bands) {
+        char *band_path = get_band_path(accum_path, rank);
+
+        if (rank == 0)
+            printf("Writing flow accumulation raster in %d bands...\n",
+                   num_ranks);
+        if (write_raster(band_path, accum_map, RASTER_MAP_TYPE_AUTO) > 0) {
+            fprintf(stderr, "%s: Failed to write flow accumulation raster\n",
+                    band_path);
+            status = 1;
+        }
+        free(band_path);
+    }
+    else {
+        /* rank 0 creates the raster and the others write their bands into it
+         * in turn */
+        if (rank == 0)
+            printf("Writing flow accumulation raster <%s>...\n", accum_path);
+        else
+            MPI_Recv(&status, 1, MPI_INT, rank - 1, 0, MPI_COMM_WORLD,
+                     MPI_STATUS_IGNORE);
+        if (!status &&
+            write_raster_rows(accum_path, accum_map, RASTER_MAP_TYPE_AUTO,
+                              first_row, rank ? 0 : total_nrows) > 0) {
+            fprintf(stderr, "%s: Failed to write flow accumulation raster\n",
+                    accum_path);
+            status = 1;
+        }
+        if (rank < num_ranks - 1)
+            MPI_Send(&status, 1, MPI_INT, rank + 1, 0, MPI_COMM_WORLD);
+    }
+    MPI_Allreduce(&status, &any_status, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    gettimeofday(&end_time, NULL);
+    if (rank == 0)
+        printf("Output time for flow accumulation: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &start_time));
+
+    free_raster(accum_map);
+    free(accum_map);
+
+    gettimeofday(&end_time, NULL);
+    if (rank == 0)
+        printf("Total elapsed time: %lld microsec\n",
+               timeval_diff(NULL, &end_time, &first_time));
+
+    MPI_Finalize();
+
+    exit(any_status ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/* return the halo row for a row just outside the band */
+static struct raster_map *get_halo(struct band_context *ctx, int row)
+{
+    return row == -1 ? ctx->halo_maps[0] :
+        row == ctx->nrows ? ctx->halo_maps[1] : NULL;
+}
+
+/* follow flows from a band cell and return the global index of the cell
+ * through which they leave the band or NO_EXIT if they end within it */
+static size_t find_exit(struct band_context *ctx, int row, int col)
+{
+    do {
+        int down_row = row, down_col = col;
+        struct raster_map *halo_map;
+
+        if (!move_down(DIR(row, col), &down_row, &down_col) ||
+            down_col < 0 || down_col >= ctx->ncols)
+            return NO_EXIT;
+
+        if (down_row < 0 || down_row >= ctx->nrows) {
+            if (!(halo_map = get_halo(ctx, down_row)) ||
+                halo_map->cells.byte[down_col] == halo_map->null_value)
+                return NO_EXIT;
+            return (size_t)(ctx->first_row + row) * ctx->ncols + col;
+        }
+
+        if (DIR(down_row, down_col) == DIR_NULL)
+            return NO_EXIT;
+
+        row = down_row;
+        col = down_col;
+    } while (1);
+}
+
+/* add inflow to all band cells downstream of and including a band cell */
+static void add_inflow(struct band_context *ctx, struct raster_map *accum_map,
+                       int row, int col, unsigned int inflow)
+{
+    do {
+#pragma omp atomic
+        accum_map->cells.uint32[INDEX(row, col)] += inflow;
+    } while (move_down(DIR(row, col), &row, &col) && row >= 0 &&
+             row < ctx->nrows && col >= 0 && col < ctx->ncols &&
+             DIR(row, col) != DIR_NULL);
+}
+
+static int compare_exits(const void *a, const void *b)
+{
+    const struct band_exit *exit_a = a, *exit_b = b;
+
+    return exit_a->idx < exit_b->idx ? -1 : exit_a->idx > exit_b->idx;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const struct band_entry *entry_a = a, *entry_b = b;
+
+    return entry_a->idx < entry_b->idx ? -1 : entry_a->idx > entry_b->idx;
+}
+
+/* exits form a DAG in which an exit drains into the exit its target entry
+ * leads to; the accumulation of each exit becomes final by adding those of
+ * its upstream exits in topological order */
+static void solve_boundary(struct band_exit *exits, int num_exits,
+                           struct band_entry *entries, int num_entries)
+{
+    int *downs = malloc(sizeof *downs * num_exits);
+    int *num_ups = calloc(num_exits, sizeof *num_ups);
+    int *queue = malloc(sizeof *queue * num_exits);
+    int num_queued = 0;
+    int i;
+
+    qsort(exits, num_exits, sizeof *exits, compare_exits);
+    qsort(entries, num_entries, sizeof *entries, compare_entries);
+
+    for (i = 0; i < num_exits; i++) {
+        struct band_entry entry_key, *entry;
+        struct band_exit exit_key, *exit;
+
+        downs[i] = -1;
+        entry_key.idx = exits[i].target;
+        if (!(entry = bsearch(&entry_key, entries, num_entries,
+                              sizeof *entries, compare_entries)) ||
+            entry->exit == NO_EXIT)
+            continue;
+
+        exit_key.idx = entry->exit;
+        if ((exit = bsearch(&exit_key, exits, num_exits, sizeof *exits,
+                            compare_exits))) {
+            downs[i] = exit - exits;
+            num_ups[downs[i]]++;
+        }
+    }
+
+    for (i = 0; i < num_exits; i++)
+        if (!num_ups[i])
+            queue[num_queued++] = i;
+
+    for (i = 0; i < num_queued; i++) {
+        int down = downs[queue[i]];
+
+        if (down < 0)
+            continue;
+        exits[down].accum += exits[queue[i]].accum;
+        if (!--num_ups[down])
+            queue[num_queued++] = down;
+    }
+
+    free(downs);
+    free(num_ups);
+    free(queue);
+}
+
+/* insert _rank before the extension of path */
+static char *get_band_path(const char *path, int rank)
+{
+    const char *ext = strrchr(path, '.');
+    char *band_path = malloc(strlen(path) + 16);
+    int len;
+
+    if (!ext || strchr(ext, '/'))
+        ext = path + strlen(path);
+    len = ext - path;
+    sprintf(band_path, "%.*s_%d%s", len, path, rank, ext);
+
+    return band_path;
+}
+
+/* struct band_exit and struct band_entry with their padding so that arrays of
+ * them can be sent */
+static void create_types(MPI_Datatype *exit_type, MPI_Datatype *entry_type)
+{
+    MPI_Datatype size_type =
+        sizeof(size_t) == 8 ? MPI_UINT64_T : MPI_UINT32_T;
+    int exit_lens[3] = { 1, 1, 1 }, entry_lens[2] = { 1, 1 };
+    MPI_Aint exit_displs[3] = {
+        offsetof(struct band_exit, idx),
+        offsetof(struct band_exit, target),
+        offsetof(struct band_exit, accum)
+    }, entry_displs[2] = {
+        offsetof(struct band_entry, idx),
+        offsetof(struct band_entry, exit)
+    };
+    MPI_Datatype exit_types[3] = { size_type, size_type, MPI_UNSIGNED },
+        entry_types[2] = { size_type, size_type };
+    MPI_Datatype type;
+
+    MPI_Type_create_struct(3, exit_lens, exit_displs, exit_types, &type);
+    MPI_Type_create_resized(type, 0, sizeof(struct band_exit), exit_type);
+    MPI_Type_free(&type);
+    MPI_Type_commit(exit_type);
+
+    MPI_Type_create_struct(2, entry_lens, entry_displs, entry_types, &type);
+    MPI_Type_create_resized(type, 0, sizeof(struct band_entry), entry_type);
+    MPI_Type_free(&type);
+    MPI_Type_commit(entry_type);
+}
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "global.h"
+
+#define MiB (1024.0 * 1024.0)
+
+/* frontier mode stores one 32-bit offset per headwater cell; about half the
+ * cells of a D8 raster are headwater cells at most */
+#define FRONTIER_BYTES_PER_CELL (sizeof(unsigned int) / 2.0)
+
+/* the hybrid engine stores 2.5 bits per cell for ranking confluences and one
+ * byte per confluence; about a quarter of the cells are confluences */
+#define HYBRID_BYTES_PER_CELL (2.5 / 8 + 0.25)
+
+/* building a schedule counts inflows in a byte per cell, marks chain ends
+ * in a bit per cell, and stores a head, a length, and a stopping confluence
+ * for each chain before encoding the heads; at most about half the cells
+ * start a chain */
+#define SCHEDULE_BYTES_PER_CELL \
+    (1 + 1 / 8.0 + (2 * sizeof(size_t) + sizeof(unsigned int)) / 2.0)
+
+/* float32 elevations and fill labels */
+#define DEM_BYTES_PER_CELL sizeof(float)
+#define FILL_BYTES_PER_CELL sizeof(unsigned int)
+
+static const char *engine_names[] = {
+    "moremem", "lessmem", "hp", "hybrid"
+};
+
+static int has_controller(const char *, const char *);
+static size_t read_cgroup_limit(const char *);
+
+/* parse a size in bytes with an optional K, M, G, or T suffix (powers of
+ * 1024); 0 is returned for an invalid size */
+size_t parse_size(const char *str)
+{
+    char *end;
+    double size = strtod(str, &end);
+
+    if (end == str || size <= 0)
+        return 0;
+
+    switch (toupper(*end)) {
+    case 'T':
+        size *= 1024;
+        /* fall through */
+    case 'G':
+        size *= 1024;
+        /* fall through */
+    case 'M':
+        size *= 1024;
+        /* fall through */
+    case 'K':
+        size *= 1024;
+        end++;
+        break;
+    }
+    if (*end && strcmp(end, "B") && strcmp(end, "iB"))
+        return 0;
+
+    return size;
+}
+
+/* return the lowest memory limit of the cgroup of this process and its
+ * ancestors or 0 if there is none */
+size_t get_cgroup_limit(void)
+{
+    FILE *fp;
+    char line[4096], path[sizeof line + 64];
+    size_t limit = 0;
+
+    if (!(fp = fopen("/proc/self/cgroup", "r")))
+        return 0;
+
+    /* each line is id:controllers:path; cgroup v2 has id 0 and no
+     * controllers and cgroup v1 lists memory among its controllers */
+    while (fgets(line, sizeof line, fp)) {
+        char *controllers, *cgroup, *p;
+        const char *root, *file;
+        size_t root_len;
+
+        if (!(controllers = strchr(line, ':')) ||
+            !(cgroup = strchr(++controllers, ':')))
+            continue;
+        *cgroup++ = 0;
+        cgroup[strcspn(cgroup, "\n")] = 0;
+
+        if (strncmp(line, "0:", 2) == 0 && !*controllers) {
+            root = "/sys/fs/cgroup";
+            file = "memory.max";
+        }
+        else if (has_controller(controllers, "memory")) {
+            root = "/sys/fs/cgroup/memory";
+            file = "memory.limit_in_bytes";
+        }
+        else
+            continue;
+
+        root_len = strlen(root);
+        sprintf(path, "%s%s", root, cgroup);
+        if (path[strlen(path) - 1] == '/')
+            path[strlen(path) - 1] = 0;
+
+        /* a namespaced path may not exist below root, but its ancestors do */
+        while (1) {
+            size_t cgroup_limit;
+
+            p = path + strlen(path);
+            sprintf(p, "/%s", file);
+            cgroup_limit = read_cgroup_limit(path);
+            *p = 0;
+            if (cgroup_limit && (!limit || cgroup_limit < limit))
+                limit = cgroup_limit;
+
+            if (!(p = strrchr(path, '/')) || (size_t)(p - path) < root_len)
+                break;
+            *p = 0;
+        }
+    }
+    fclose(fp);
+
+    return limit;
+}
+
+/* estimate the peak memory of engine for accumulating flows from the size of
+ * the flow direction raster alone; with a DEM, the peak can also be while
+ * filling it or computing flow directions from it; sparse storage is
+ * estimated as if no block was null */
+size_t estimate_memory(int nrows, int ncols, int engine,
+                       const struct memory_opts *opts)
+{
+    size_t ncells = (size_t)nrows * ncols;
+    double bytes_per_cell = 1 + opts->accum_size;
+    size_t peak;
+
+    switch (engine) {
+    case ENGINE_MOREMEM:
+    case ENGINE_HP:
+        /* upstream cells or pending inflows */
+        bytes_per_cell += 1;
+        break;
+    case ENGINE_HYBRID:
+        bytes_per_cell += HYBRID_BYTES_PER_CELL;
+        break;
+    }
+    if (opts->use_frontier)
+        bytes_per_cell += FRONTIER_BYTES_PER_CELL;
+    if (opts->use_schedule)
+        bytes_per_cell += SCHEDULE_BYTES_PER_CELL;
+    if (opts->use_padding)
+        peak = (size_t)(nrows + 2) * (ncols + 2) * bytes_per_cell;
+    else
+        peak = ncells * bytes_per_cell;
+
+    if (opts->use_dem) {
+        size_t dem_peak = ncells * (DEM_BYTES_PER_CELL + 1);
+
+        /* the DEM stays for HAND, which adds its own float32 raster */
+        if (opts->keep_dem)
+            peak += ncells * (DEM_BYTES_PER_CELL + sizeof(float));
+        if (opts->fill_dem &&
+            dem_peak < ncells * (DEM_BYTES_PER_CELL + FILL_BYTES_PER_CELL))
+            dem_peak = ncells * (DEM_BYTES_PER_CELL + FILL_BYTES_PER_CELL);
+        if (peak < dem_peak)
+            peak = dem_peak;
+    }
+
+    return peak;
+}
+
+/* choose the fastest engine whose estimated peak memory fits in mem_limit
+ * and the cgroup limit, if any; if engine_set is set, only *engine is
+ * checked; modes that work with one engine only check that one; 1 is
+ * returned if none fits */
+int choose_engine(int nrows, int ncols, const struct memory_opts *opts,
+                  int engine_set, size_t mem_limit, int *engine)
+{
+    size_t cgroup_limit = get_cgroup_limit();
+    /* in order of speed */
+    int engines[2] = { ENGINE_MOREMEM, ENGINE_LESSMEM };
+    int num_engines = 2, i;
+
+    if (engine_set) {
+        engines[0] = *engine;
+        num_engines = 1;
+    }
+    else if (opts->use_frontier)
+        num_engines = 1;
+    else if (opts->use_sparse || opts->use_schedule) {
+        engines[0] = ENGINE_LESSMEM;
+        num_engines = 1;
+    }
+
+    if (cgroup_limit && cgroup_limit < mem_limit) {
+        printf("Lowering memory limit to cgroup limit of %.1f MiB...\n",
+               cgroup_limit / MiB);
+        mem_limit = cgroup_limit;
+    }
+
+    printf("Memory limit: %.1f MiB\n", mem_limit / MiB);
+    for (i = 0; i < num_engines; i++) {
+        size_t size = estimate_memory(nrows, ncols, engines[i], opts);
+        const char *name = opts->use_sparse ? "sparse" :
+            opts->use_schedule ? "scheduled" : engine_names[engines[i]];
+
+        printf("Estimated memory for %s: %.1f MiB\n", name, size / MiB);
+        if (size <= mem_limit) {
+            *engine = engines[i];
+            printf("Selected %s engine\n", name);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* controllers is a comma-separated list */
+static int has_controller(const char *controllers, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p;
+
+    for (p = controllers; (p = strstr(p, name)); p += len)
+        if ((p == controllers || p[-1] == ',') &&
+            (!p[len] || p[len] == ','))
+            return 1;
+
+    return 0;
+}
+
+static size_t read_cgroup_limit(const char *path)
+{
+    FILE *fp;
+    unsigned long long limit;
+
+    if (!(fp = fopen(path, "r")))
+        return 0;
+    /* "max" in cgroup v2 fails to scan */
+    if (fscanf(fp, "%llu", &limit) != 1)
+        limit = 0;
+    fclose(fp);
+
+    /* cgroup v1 reports a huge number for no limit */
+    if (limit >= (unsigned long long)1 << 60)
+        limit = 0;
+
+    return limit;
+}
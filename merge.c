@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "global.h"
+#include "look_around.h"
+
+#define ACCUM(row, col) ctx->accum_map->cells.uint32[INDEX(row, col)]
+
+/* a tile and its offset in the mosaic of all tiles */
+struct tile
+{
+    char *dir_path, *accum_path, *merged_path;
+    struct raster_map *dir_map, *accum_map;
+    int nrows, ncols;
+    int row_offset, col_offset;
+    /* for tiles receiving flows, pending inflows and the sum of inflows
+     * from other tiles of cells downstream of them */
+    unsigned char *num_ups;
+    unsigned int *adds;
+};
+
+/* flow from the edge of one tile into a cell of another tile */
+struct edge_flow
+{
+    struct tile *tile, *up_tile;
+    int row, col;
+    size_t up_idx;
+    unsigned int accum;
+};
+
+static int read_manifest(const char *, struct tile **);
+static struct tile *find_tile(struct tile *, int, int, int, int *, int *);
+static void add_inflow(struct tile *, int, struct tile *, int, int,
+                       unsigned int);
+
+/* add flows crossing the edges of tiles accumulated separately to the
+ * accumulation of the tiles they flow into; only cells downstream of tile
+ * edges are visited, each once, so this is much cheaper than accumulating
+ * the whole mosaic; tiles must share the same resolution and grid alignment
+ * and must not overlap; accum rasters are only read and merged accumulation
+ * is written to separate rasters so that merging twice cannot count flows
+ * twice; the number of failed tiles is returned */
+int merge_tiles(const char *manifest_path, const char *dir_opts,
+                double (*recode)(double, void *), void *recode_data,
+                int compress_output)
+{
+    struct tile *tiles;
+    struct edge_flow *edge_flows = NULL;
+    size_t num_edge_flows = 0, max_edge_flows = 0;
+    int num_tiles, num_failed = 0, num_written = 0;
+    int i;
+
+    if ((num_tiles = read_manifest(manifest_path, &tiles)) < 0) {
+        fprintf(stderr, "%s: Failed to read merge manifest\n",
+                manifest_path);
+        return -1;
+    }
+
+    printf("Reading %d tiles...\n", num_tiles);
+    for (i = 0; i < num_tiles; i++) {
+        struct tile *tile = &tiles[i];
+
+        if (!(tile->dir_map =
+              read_raster(tile->dir_path, dir_opts, RASTER_MAP_TYPE_BYTE, 0,
+                          recode, recode_data))) {
+            fprintf(stderr, "%s: Failed to read flow direction raster\n",
+                    tile->dir_path);
+            num_failed++;
+            continue;
+        }
+        if (!(tile->accum_map =
+              read_raster(tile->accum_path, NULL, RASTER_MAP_TYPE_UINT32, 0,
+                          NULL, NULL))) {
+            fprintf(stderr, "%s: Failed to read flow accumulation raster\n",
+                    tile->accum_path);
+            num_failed++;
+            continue;
+        }
+        if (tile->accum_map->nrows != tile->dir_map->nrows ||
+            tile->accum_map->ncols != tile->dir_map->ncols) {
+            fprintf(stderr, "%s: Inconsistent dimensions\n",
+                    tile->accum_path);
+            num_failed++;
+            continue;
+        }
+        tile->nrows = tile->dir_map->nrows;
+        tile->ncols = tile->dir_map->ncols;
+    }
+
+    /* offsets in the grid of the first tile */
+    for (i = 0; i < num_tiles && !num_failed; i++) {
+        struct tile *tile = &tiles[i];
+        double *gt = tiles[0].dir_map->geotransform;
+        double *tile_gt = tile->dir_map->geotransform;
+        double col_offset = (tile_gt[0] - gt[0]) / gt[1];
+        double row_offset = (tile_gt[3] - gt[3]) / gt[5];
+
+        tile->col_offset = floor(col_offset + 0.5);
+        tile->row_offset = floor(row_offset + 0.5);
+        if (tile_gt[1] != gt[1] || tile_gt[5] != gt[5] || tile_gt[2] ||
+            tile_gt[4] || fabs(col_offset - tile->col_offset) > 1e-6 ||
+            fabs(row_offset - tile->row_offset) > 1e-6) {
+            fprintf(stderr, "%s: Misaligned tile\n", tile->dir_path);
+            num_failed++;
+        }
+    }
+
+    if (num_failed) {
+        for (i = 0; i < num_tiles; i++) {
+            if (tiles[i].dir_map) {
+                free_raster(tiles[i].dir_map);
+                free(tiles[i].dir_map);
+            }
+            if (tiles[i].accum_map) {
+                free_raster(tiles[i].accum_map);
+                free(tiles[i].accum_map);
+            }
+            free(tiles[i].dir_path);
+        }
+        free(tiles);
+        return num_failed;
+    }
+
+    printf("Finding flows across tile edges...\n");
+    for (i = 0; i < num_tiles; i++) {
+        struct tile *ctx = &tiles[i];
+        int row, col;
+
+        for (row = 0; row < ctx->nrows; row++) {
+            /* only the first and last columns of inner rows */
+            for (col = 0; col < ctx->ncols;
+                 col += row == 0 || row == ctx->nrows - 1 ||
+                 col == ctx->ncols - 1 ? 1 : ctx->ncols - 1) {
+                struct tile *down_tile;
+                int down_row = row, down_col = col;
+
+                if (DIR(row, col) == DIR_NULL ||
+                    !move_down(DIR(row, col), &down_row, &down_col) ||
+                    (down_row >= 0 && down_row < ctx->nrows &&
+                     down_col >= 0 && down_col < ctx->ncols) ||
+                    !(down_tile =
+                      find_tile(tiles, num_tiles, ctx->row_offset + down_row,
+                                ctx->col_offset + down_col, &down_row,
+                                &down_col)))
+                    continue;
+
+                if (num_edge_flows == max_edge_flows) {
+                    max_edge_flows += 1024;
+                    edge_flows = realloc(edge_flows, sizeof *edge_flows *
+                                         max_edge_flows);
+                }
+                if (!down_tile->num_ups) {
+                    size_t num_cells =
+                        (size_t)down_tile->nrows * down_tile->ncols;
+
+                    down_tile->num_ups = calloc(num_cells, 1);
+                    down_tile->adds =
+                        calloc(num_cells, sizeof *down_tile->adds);
+                }
+                edge_flows[num_edge_flows].tile = down_tile;
+                edge_flows[num_edge_flows].row = down_row;
+                edge_flows[num_edge_flows].col = down_col;
+                edge_flows[num_edge_flows].up_tile = ctx;
+                edge_flows[num_edge_flows].up_idx = INDEX(row, col);
+                edge_flows[num_edge_flows++].accum = ACCUM(row, col);
+            }
+        }
+    }
+
+    printf("Adding %zu edge flows...\n", num_edge_flows);
+
+    /* count the inflows of cells downstream of edge flows within their
+     * tile; a path is followed only until it joins a path already counted
+     * and stops at the tile edge, where the edge flow out is already
+     * listed */
+#pragma omp parallel for schedule(dynamic)
+    for (i = 0; i < (int)num_edge_flows; i++) {
+        struct tile *ctx = edge_flows[i].tile;
+        int row = edge_flows[i].row, col = edge_flows[i].col;
+        unsigned char n;
+
+#pragma omp atomic capture
+        n = ctx->num_ups[INDEX(row, col)]++;
+        while (!n && move_down(DIR(row, col), &row, &col) && row >= 0 &&
+               row < ctx->nrows && col >= 0 && col < ctx->ncols &&
+               DIR(row, col) != DIR_NULL) {
+#pragma omp atomic capture
+            n = ctx->num_ups[INDEX(row, col)]++;
+        }
+    }
+
+    /* edge flows from cells that receive nothing themselves start the
+     * propagation; the others are added once their cells are final, so they
+     * are dropped before counting down starts */
+#pragma omp parallel for schedule(static)
+    for (i = 0; i < (int)num_edge_flows; i++) {
+        struct tile *up_tile = edge_flows[i].up_tile;
+
+        if (up_tile->num_ups && up_tile->num_ups[edge_flows[i].up_idx])
+            edge_flows[i].tile = NULL;
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (i = 0; i < (int)num_edge_flows; i++)
+        if (edge_flows[i].tile)
+            add_inflow(tiles, num_tiles, edge_flows[i].tile,
+                       edge_flows[i].row, edge_flows[i].col,
+                       edge_flows[i].accum);
+    free(edge_flows);
+
+    for (i = 0; i < num_tiles; i++) {
+        struct tile *tile = &tiles[i];
+
+        printf("Writing flow accumulation raster <%s>...\n",
+               tile->merged_path);
+        calc_raster_stats(tile->accum_map);
+        tile->accum_map->compress = compress_output;
+        if (write_raster(tile->merged_path, tile->accum_map,
+                         RASTER_MAP_TYPE_AUTO) > 0) {
+            fprintf(stderr, "%s: Failed to write flow accumulation raster\n",
+                    tile->merged_path);
+            num_failed++;
+        }
+        else if (tile->num_ups)
+            num_written++;
+        free_raster(tile->dir_map);
+        free(tile->dir_map);
+        free_raster(tile->accum_map);
+        free(tile->accum_map);
+        free(tile->num_ups);
+        free(tile->adds);
+        free(tile->dir_path);
+    }
+    free(tiles);
+
+    printf("Updated %d of %d tiles\n", num_written, num_tiles);
+
+    return num_failed;
+}
+
+/* add accum to the inflows of a cell and, once all its inflows have been
+ * added, add their sum to the cell and carry it downstream; a path leaving
+ * the tile carries the merged accumulation of its last cell into the next
+ * tile; cells on loops never become final and are left alone */
+static void add_inflow(struct tile *tiles, int num_tiles, struct tile *ctx,
+                       int row, int col, unsigned int accum)
+{
+    do {
+        size_t idx = INDEX(row, col);
+        unsigned char n;
+
+#pragma omp atomic update
+        ctx->adds[idx] += accum;
+#pragma omp flush
+#pragma omp atomic capture
+        n = --ctx->num_ups[idx];
+
+        /* other inflows are still pending */
+        if (n)
+            return;
+
+#pragma omp flush
+        accum = ctx->adds[idx];
+        ACCUM(row, col) += accum;
+
+        if (!move_down(DIR(row, col), &row, &col))
+            return;
+        if (row < 0 || row >= ctx->nrows || col < 0 || col >= ctx->ncols) {
+            accum = ctx->accum_map->cells.uint32[idx];
+            if (!(ctx = find_tile(tiles, num_tiles, ctx->row_offset + row,
+                                  ctx->col_offset + col, &row, &col)))
+                return;
+        }
+    } while (DIR(row, col) != DIR_NULL);
+}
+
+/* each non-empty line that does not start with # lists dir, accum, and
+ * merged accum paths separated by whitespace; merged accum must not be accum
+ * so that a tile is never merged twice; an invalid line fails the whole
+ * manifest because a missing tile would drop its flows */
+static int read_manifest(const char *path, struct tile **tiles)
+{
+    FILE *fp;
+    char line[4096];
+    int num_tiles = 0, max_tiles = 0, num_invalid = 0;
+
+    if (!(fp = fopen(path, "r")))
+        return -1;
+
+    *tiles = NULL;
+    while (fgets(line, sizeof line, fp)) {
+        char *dir_path, *accum_path, *merged_path;
+        size_t dir_len, accum_len;
+
+        if (!(dir_path = strtok(line, " \t\r\n")) || *dir_path == '#')
+            continue;
+        if (!(accum_path = strtok(NULL, " \t\r\n"))) {
+            fprintf(stderr, "%s: Missing accumulation path\n", dir_path);
+            num_invalid++;
+            continue;
+        }
+        if (!(merged_path = strtok(NULL, " \t\r\n"))) {
+            fprintf(stderr, "%s: Missing merged accumulation path\n",
+                    dir_path);
+            num_invalid++;
+            continue;
+        }
+        if (!strcmp(merged_path, accum_path)) {
+            fprintf(stderr,
+                    "%s: Merged accumulation path must differ from "
+                    "accumulation path\n", accum_path);
+            num_invalid++;
+            continue;
+        }
+
+        if (num_tiles == max_tiles) {
+            max_tiles += 256;
+            *tiles = realloc(*tiles, sizeof **tiles * max_tiles);
+        }
+        memset(&(*tiles)[num_tiles], 0, sizeof **tiles);
+        /* one allocation for all paths */
+        dir_len = strlen(dir_path);
+        accum_len = strlen(accum_path);
+        (*tiles)[num_tiles].dir_path =
+            malloc(dir_len + accum_len + strlen(merged_path) + 3);
+        strcpy((*tiles)[num_tiles].dir_path, dir_path);
+        (*tiles)[num_tiles].accum_path =
+            strcpy((*tiles)[num_tiles].dir_path + dir_len + 1, accum_path);
+        (*tiles)[num_tiles].merged_path =
+            strcpy((*tiles)[num_tiles].accum_path + accum_len + 1,
+                   merged_path);
+        num_tiles++;
+    }
+
+    fclose(fp);
+
+    if (num_invalid) {
+        while (num_tiles)
+            free((*tiles)[--num_tiles].dir_path);
+        free(*tiles);
+        return -1;
+    }
+
+    return num_tiles;
+}
+
+/* find the tile with a non-null cell at row and col of the mosaic and return
+ * the cell in the tile */
+static struct tile *find_tile(struct tile *tiles, int num_tiles, int row,
+                              int col, int *tile_row, int *tile_col)
+{
+    int i;
+
+    for (i = 0; i < num_tiles; i++) {
+        struct tile *ctx = &tiles[i];
+        int r = row - ctx->row_offset, c = col - ctx->col_offset;
+
+        if (r >= 0 && r < ctx->nrows && c >= 0 && c < ctx->ncols &&
+            DIR(r, c) != DIR_NULL) {
+            *tile_row = r;
+            *tile_col = c;
+            return ctx;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <omp.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "global.h"
+
+/* target size of a band of rows in bytes */
+#define BAND_SIZE (16 * 1024 * 1024)
+
+static void release_rows(struct raster_map *, int, int);
+static void wait_briefly(void);
+
+/* accumulate flows while a writer thread writes each band of rows to
+ * accum_path as soon as all of its cells are final, so that output overlaps
+ * computation; the memory of written bands is released except for their
+ * first and last rows, which neighboring bands still read */
+int accumulate_progressive(struct raster_map *dir_map,
+                           struct raster_map *accum_map, int use_lessmem,
+                           const char *accum_path)
+{
+    int nrows = dir_map->nrows, ncols = dir_map->ncols;
+    int band_rows = BAND_SIZE / (sizeof(unsigned int) * ncols);
+    int num_bands, accumulated = 0, status;
+    int *band_cells;
+    struct raster_map band_map = *accum_map;
+    int band;
+
+    /* at least one row between the first and last rows to release */
+    if (band_rows < 3)
+        band_rows = 3;
+    num_bands = (nrows + band_rows - 1) / band_rows;
+    band_cells = malloc(sizeof *band_cells * num_bands);
+
+#pragma omp parallel for schedule(dynamic)
+    for (band = 0; band < num_bands; band++) {
+        size_t first = (size_t)band * band_rows * ncols;
+        size_t last = band < num_bands - 1 ?
+            first + (size_t)band_rows * ncols : (size_t)nrows * ncols;
+        size_t i;
+        int n = 0;
+
+        for (i = first; i < last; i++)
+            if (dir_map->cells.byte[i] != dir_map->null_value)
+                n++;
+        band_cells[band] = n;
+    }
+
+    /* create the raster without writing any rows */
+    band_map.nrows = 0;
+    if ((status =
+         write_raster_rows(accum_path, &band_map, RASTER_MAP_TYPE_AUTO, 0,
+                           nrows)) > 0) {
+        free(band_cells);
+        return status;
+    }
+
+    /* one thread for writing and a nested team for accumulation */
+    omp_set_max_active_levels(2);
+
+#pragma omp parallel sections num_threads(2) private(band_map)
+    {
+#pragma omp section
+        {
+            if (use_lessmem)
+                accumulate_progressive_lessmem(dir_map, accum_map, band_cells,
+                                               band_rows);
+            else
+                accumulate_progressive_moremem(dir_map, accum_map, band_cells,
+                                               band_rows);
+#pragma omp atomic write
+            accumulated = 1;
+        }
+#pragma omp section
+        {
+            char *written = calloc(num_bands, 1);
+            int num_written = 0;
+
+            band_map = *accum_map;
+            while (num_written < num_bands && !status) {
+                int all_final, found = 0;
+                int i;
+
+                /* cells in loops are never final, so all bands left are
+                 * written once accumulation is over */
+#pragma omp atomic read
+                all_final = accumulated;
+
+                for (i = 0; i < num_bands && !status; i++) {
+                    int first_row = i * band_rows, num_cells;
+
+                    if (written[i])
+                        continue;
+#pragma omp atomic read
+                    num_cells = band_cells[i];
+                    if (num_cells > 0 && !all_final)
+                        continue;
+#pragma omp flush
+
+                    band_map.nrows = nrows - first_row < band_rows ?
+                        nrows - first_row : band_rows;
+                    band_map.cells.uint32 =
+                        accum_map->cells.uint32 + (size_t)first_row * ncols;
+                    status =
+                        write_raster_rows(accum_path, &band_map,
+                                          RASTER_MAP_TYPE_AUTO, first_row, 0);
+                    release_rows(accum_map, first_row + 1,
+                                 first_row + band_map.nrows - 1);
+                    written[i] = 1;
+                    num_written++;
+                    found = 1;
+                }
+                if (!found)
+                    wait_briefly();
+            }
+
+            free(written);
+        }
+    }
+
+    free(band_cells);
+
+    return status;
+}
+
+/* give rows from first_row up to, but not including, last_row back to the
+ * system; only whole pages are released and they read as 0 afterwards */
+static void release_rows(struct raster_map *accum_map, int first_row,
+                         int last_row)
+{
+#ifndef _WIN32
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)(accum_map->cells.uint32 +
+                            (size_t)first_row * accum_map->ncols);
+    size_t end = (size_t)(accum_map->cells.uint32 +
+                          (size_t)last_row * accum_map->ncols);
+
+    start = (start + page_size - 1) / page_size * page_size;
+    end = end / page_size * page_size;
+    if (start < end)
+        madvise((void *)start, end - start, MADV_DONTNEED);
+#endif
+}
+
+static void wait_briefly(void)
+{
+#ifdef _WIN32
+    Sleep(1);
+#else
+    struct timespec ts = { 0, 1000000 };
+
+    nanosleep(&ts, NULL);
+#endif
+}
@@ -4,6 +4,60 @@
 #include <omp.h>
 #include "raster.h"
 
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* dump_raster() formats bands of about this many cells at a time */
+#define DUMP_BAND_CELLS 65536
+
+static double calc_zone_area(double, double, double);
+
+/* split comma-separated GDAL options into a NULL-terminated list */
+static const char **split_opts(const char *opts)
+{
+    const char **ds_opts;
+    char *o, *p;
+    int n;
+
+    strcpy((o = malloc(strlen(opts) + 1)), opts);
+    for (p = o, n = 2; *p; p++)
+        if (*p == ',')
+            n++;
+    ds_opts = malloc(sizeof *ds_opts * n);
+
+    for (p = o, n = 0; *p; p++) {
+        if (p == o || *(p - 1) == ',') {
+            ds_opts[n++] = p;
+            if (p > o)
+                *(p - 1) = 0;
+        }
+    }
+    ds_opts[n] = NULL;
+
+    return ds_opts;
+}
+
+static size_t get_cell_size(int);
+static char *format_cell(char *, struct raster_map *, size_t);
+static char *format_uint(char *, unsigned long long);
+static char *format_double(char *, double, int);
+static size_t first_cell(struct raster_map *, int);
+static int pad_cells(struct raster_map *);
+static int set_unused_null(struct raster_map *);
+static void set_nulls(struct raster_map *, size_t, size_t);
+static int load_raster(struct raster_map *, const char *, const char *, int,
+                       int, double (*)(double, void *), void *, int, int);
+
+static void alloc_cells(struct raster_map *rast_map, size_t size)
+{
+    if (size > rast_map->cells_size) {
+        free(rast_map->cells.v);
+        rast_map->cells.v = malloc(size);
+        rast_map->cells_size = size;
+    }
+}
+
 void print_raster(const char *path, const char *opts, const char *null_str,
                   const char *fmt)
 {
@@ -143,6 +197,143 @@ void print_raster(const char *path, const char *opts, const char *null_str,
     free_raster(rast_map);
 }
 
+/* dump a raster as text in one of the RASTER_DUMP_* formats to out_path or
+ * standard output if NULL; bands of rows are formatted into per-thread
+ * buffers in parallel without printf and written in order; floating-point
+ * values have 3 decimals as in print_raster(); null_str replaces the nodata
+ * value in ASCII grids and the empty fields of null cells in CSV, and null
+ * cells are skipped in XYZ unless it is given; 0 is returned on success */
+int dump_raster(const char *path, const char *opts, int format,
+                const char *null_str, const char *out_path)
+{
+    struct raster_map *rast_map;
+    FILE *fp;
+    int nrows, ncols, band_rows, num_bands, coor_decimals;
+    size_t null_len, cell_size;
+    char null_text[32];
+    int band, status = 0;
+
+    if (!(rast_map =
+          read_raster(path, opts, RASTER_MAP_TYPE_AUTO, 0, NULL, NULL)))
+        return 1;
+
+    if (!out_path)
+        fp = stdout;
+    else if (!(fp = fopen(out_path, "w"))) {
+        free_raster(rast_map);
+        free(rast_map);
+        return 1;
+    }
+
+    nrows = rast_map->nrows;
+    ncols = rast_map->ncols;
+
+    /* enough decimals for a thousandth of a cell */
+    coor_decimals = 3 - (int)floor(log10(fmin(rast_map->dx, rast_map->dy)));
+    if (coor_decimals < 0)
+        coor_decimals = 0;
+    else if (coor_decimals > 12)
+        coor_decimals = 12;
+
+    if (!null_str) {
+        if (format == RASTER_DUMP_ASC) {
+            /* NaN is not a valid nodata value for ASCII grids */
+            double null_value =
+                isnan(rast_map->null_value) ? -9999 : rast_map->null_value;
+            int is_float = rast_map->type == RASTER_MAP_TYPE_FLOAT64 ||
+                rast_map->type == RASTER_MAP_TYPE_FLOAT32;
+
+            *format_double(null_text, null_value, is_float ? 3 : 0) = 0;
+            null_str = null_text;
+        }
+        else
+            null_str = "";
+    }
+    null_len = strlen(null_str);
+
+    if (format == RASTER_DUMP_ASC) {
+        fprintf(fp, "ncols %d\nnrows %d\nxllcorner %.17g\n"
+                "yllcorner %.17g\n", ncols, nrows, rast_map->geotransform[0],
+                rast_map->geotransform[3] +
+                rast_map->geotransform[5] * nrows);
+        if (rast_map->dx == rast_map->dy)
+            fprintf(fp, "cellsize %.17g\n", rast_map->dx);
+        else
+            fprintf(fp, "dx %.17g\ndy %.17g\n", rast_map->dx, rast_map->dy);
+        fprintf(fp, "NODATA_value %s\n", null_str);
+    }
+
+    /* a number takes at most 24 characters and each cell ends with a
+     * separator or newline */
+    cell_size = (null_len > 24 ? null_len : 24) + 1;
+    if (format == RASTER_DUMP_XYZ)
+        cell_size += 2 * 25;
+    band_rows = DUMP_BAND_CELLS / ncols;
+    if (band_rows < 1)
+        band_rows = 1;
+    num_bands = (nrows + band_rows - 1) / band_rows;
+
+#pragma omp parallel
+    {
+        char *buf = malloc(cell_size * band_rows * ncols);
+
+#pragma omp for ordered schedule(static, 1)
+        for (band = 0; band < num_bands; band++) {
+            int first_row = band * band_rows;
+            int last_row = first_row + band_rows < nrows ?
+                first_row + band_rows : nrows;
+            char *p = buf;
+            int row, col;
+
+            for (row = first_row; row < last_row; row++) {
+                for (col = 0; col < ncols; col++) {
+                    size_t idx = (size_t)row * ncols + col;
+                    int null = is_null(rast_map, row, col);
+
+                    if (format == RASTER_DUMP_XYZ) {
+                        double x, y;
+
+                        if (null && !*null_str)
+                            continue;
+                        calc_coors(rast_map, row, col, &x, &y);
+                        p = format_double(p, x, coor_decimals);
+                        *p++ = ' ';
+                        p = format_double(p, y, coor_decimals);
+                        *p++ = ' ';
+                    }
+                    if (null) {
+                        memcpy(p, null_str, null_len);
+                        p += null_len;
+                    }
+                    else
+                        p = format_cell(p, rast_map, idx);
+                    *p++ = format == RASTER_DUMP_XYZ || col == ncols - 1 ?
+                        '\n' : format == RASTER_DUMP_CSV ? ',' : ' ';
+                }
+            }
+
+#pragma omp ordered
+            {
+                if (!status &&
+                    fwrite(buf, 1, p - buf, fp) != (size_t)(p - buf))
+                    status = 1;
+            }
+        }
+
+        free(buf);
+    }
+
+    if (out_path && fclose(fp))
+        status = 1;
+    else if (!out_path && fflush(fp))
+        status = 1;
+
+    free_raster(rast_map);
+    free(rast_map);
+
+    return status;
+}
+
 int is_null(struct raster_map *rast_map, int row, int col)
 {
     int ret;
@@ -254,12 +445,29 @@ void reset_null(struct raster_map *rast_map, double null_value)
 struct raster_map *init_raster(int nrows, int ncols, int type)
 {
     struct raster_map *rast_map;
-    size_t row_size;
-    int i;
 
     rast_map = malloc(sizeof *rast_map);
+    rast_map->cells.v = NULL;
+    rast_map->cells_size = 0;
+    rast_map->projection = NULL;
+    rast_map->padding = 0;
+    rast_map->has_stats = 0;
+    reinit_raster(rast_map, nrows, ncols, type);
+
+    return rast_map;
+}
+
+/* reset a raster map to a new size and type, reusing its cell buffer if it is
+ * large enough; cells are zeroed */
+void reinit_raster(struct raster_map *rast_map, int nrows, int ncols,
+                   int type)
+{
+    size_t row_size, size;
+    int i;
+
     rast_map->nrows = nrows;
     rast_map->ncols = row_size = ncols;
+    rast_map->nbands = 1;
     rast_map->type = type;
 
     switch (type) {
@@ -283,16 +491,25 @@ struct raster_map *init_raster(int nrows, int ncols, int type)
         break;
     }
 
-    rast_map->cells.v = calloc(nrows, row_size);
+    /* the border of a padded map is zeroed too */
+    row_size += 2 * rast_map->padding * get_cell_size(type);
+    nrows += 2 * rast_map->padding;
+    size = nrows * row_size;
+    if (size > rast_map->cells_size) {
+        free(rast_map->cells.v);
+        rast_map->cells.v = calloc(nrows, row_size);
+        rast_map->cells_size = size;
+    }
+    else
+        memset(rast_map->cells.v, 0, size);
 
     rast_map->null_value = 0;
+    free(rast_map->projection);
     rast_map->projection = NULL;
     for (i = 0; i < 6; i++)
         rast_map->geotransform[i] = 0;
     rast_map->dx = rast_map->dy = 1;
     rast_map->compress = 0;
-
-    return rast_map;
 }
 
 void free_raster(struct raster_map *rast_map)
@@ -306,6 +523,7 @@ void copy_raster_metadata(struct raster_map *dest_map,
 {
     int i;
 
+    free(dest_map->projection);
     dest_map->projection = strdup(src_map->projection);
     for (i = 0; i < 6; i++)
         dest_map->geotransform[i] = src_map->geotransform[i];
@@ -313,12 +531,225 @@ void copy_raster_metadata(struct raster_map *dest_map,
     dest_map->dy = src_map->dy;
 }
 
+/* copy the first band of a row into values as doubles with NaN nulls */
+static void get_row_values(const struct raster_map *rast_map, size_t first,
+                           double *values)
+{
+    int nbands = rast_map->nbands, col;
+
+#define GET_ROW_VALUES(cells) \
+    for (col = 0; col < rast_map->ncols; col++) \
+        values[col] = rast_map->cells[first + (size_t)col * nbands]
+
+    switch (rast_map->type) {
+    case RASTER_MAP_TYPE_FLOAT64:
+        GET_ROW_VALUES(cells.float64);
+        break;
+    case RASTER_MAP_TYPE_FLOAT32:
+        GET_ROW_VALUES(cells.float32);
+        break;
+    case RASTER_MAP_TYPE_UINT32:
+        GET_ROW_VALUES(cells.uint32);
+        break;
+    case RASTER_MAP_TYPE_INT32:
+        GET_ROW_VALUES(cells.int32);
+        break;
+    case RASTER_MAP_TYPE_UINT16:
+        GET_ROW_VALUES(cells.uint16);
+        break;
+    case RASTER_MAP_TYPE_INT16:
+        GET_ROW_VALUES(cells.int16);
+        break;
+    default:
+        GET_ROW_VALUES(cells.byte);
+        break;
+    }
+#undef GET_ROW_VALUES
+
+    for (col = 0; col < rast_map->ncols; col++)
+        if (values[col] == rast_map->null_value)
+            values[col] = NAN;
+}
+
+/* merge the count, mean, and sum of squared deviations of one set into
+ * another (Chan et al., 1979) */
+static void merge_moments(size_t *count, double *mean, double *m2,
+                          size_t count_b, double mean_b, double m2_b)
+{
+    size_t n = *count + count_b;
+    double delta = mean_b - *mean;
+
+    if (!count_b)
+        return;
+    *mean += delta * count_b / n;
+    *m2 += m2_b + delta * delta * ((double)*count * count_b / n);
+    *count = n;
+}
+
+/* compute statistics and a histogram of log2 bins of the first band in one
+ * pass with per-thread reductions so that write_raster() can store them
+ * instead of GDAL rescanning the output; squared deviations are summed per
+ * row while it is in cache and merged across rows and threads to avoid
+ * cancellation in the standard deviation; nulls are skipped */
+void calc_raster_stats(struct raster_map *rast_map)
+{
+    size_t stride = (rast_map->ncols + 2 * rast_map->padding) *
+        rast_map->nbands;
+    size_t count = 0;
+    double min = INFINITY, max = -INFINITY, mean = 0, m2 = 0;
+    int row, i;
+
+    for (i = 0; i < RASTER_HIST_BINS; i++)
+        rast_map->histogram[i] = 0;
+
+#pragma omp parallel
+    {
+        size_t histogram[RASTER_HIST_BINS] = { 0 }, thread_count = 0;
+        double thread_min = INFINITY, thread_max = -INFINITY;
+        double thread_mean = 0, thread_m2 = 0;
+        double *values = malloc(sizeof *values * rast_map->ncols);
+        int j;
+
+#pragma omp for schedule(static)
+        for (row = 0; row < rast_map->nrows; row++) {
+            size_t row_count = 0;
+            double row_sum = 0, row_mean, row_m2 = 0;
+            int col;
+
+            get_row_values(rast_map, (row + rast_map->padding) * stride +
+                           rast_map->padding * rast_map->nbands, values);
+
+            for (col = 0; col < rast_map->ncols; col++) {
+                double value = values[col];
+                int exp;
+
+                if (isnan(value))
+                    continue;
+
+                row_count++;
+                if (value < thread_min)
+                    thread_min = value;
+                if (value > thread_max)
+                    thread_max = value;
+                row_sum += value;
+
+                if (value <= 0)
+                    continue;
+                /* value is in [2^(exp - 1), 2^exp) */
+                frexp(value, &exp);
+                exp -= 1 + RASTER_HIST_MIN_EXP;
+                histogram[exp < 0 ? 0 : exp >= RASTER_HIST_BINS ?
+                          RASTER_HIST_BINS - 1 : exp]++;
+            }
+            if (!row_count)
+                continue;
+
+            row_mean = row_sum / row_count;
+            for (col = 0; col < rast_map->ncols; col++)
+                if (!isnan(values[col]))
+                    row_m2 += (values[col] - row_mean) *
+                        (values[col] - row_mean);
+            merge_moments(&thread_count, &thread_mean, &thread_m2, row_count,
+                          row_mean, row_m2);
+        }
+        free(values);
+
+#pragma omp critical
+        {
+            merge_moments(&count, &mean, &m2, thread_count, thread_mean,
+                          thread_m2);
+            if (thread_min < min)
+                min = thread_min;
+            if (thread_max > max)
+                max = thread_max;
+            for (j = 0; j < RASTER_HIST_BINS; j++)
+                rast_map->histogram[j] += histogram[j];
+        }
+    }
+
+    if (!count) {
+        rast_map->has_stats = 0;
+        return;
+    }
+
+    rast_map->has_stats = 1;
+    rast_map->min = min;
+    rast_map->max = max;
+    rast_map->mean = mean;
+    rast_map->sd = sqrt(m2 / count);
+}
+
 struct raster_map *read_raster(const char *path, const char *opts, int type,
                                int get_stats,
                                double (*recode)(double, void *),
                                void *recode_data)
 {
-    struct raster_map *rast_map;
+    struct raster_map *rast_map = calloc(1, sizeof *rast_map);
+
+    if (reread_raster
+        (rast_map, path, opts, type, get_stats, recode, recode_data)) {
+        free_raster(rast_map);
+        free(rast_map);
+        return NULL;
+    }
+
+    return rast_map;
+}
+
+/* read num_rows rows starting at first_row; the geotransform is shifted to
+ * the first row; rows outside the raster are not read */
+struct raster_map *read_raster_rows(const char *path, const char *opts,
+                                    int type, int first_row, int num_rows,
+                                    double (*recode)(double, void *),
+                                    void *recode_data)
+{
+    struct raster_map *rast_map = calloc(1, sizeof *rast_map);
+
+    if (load_raster
+        (rast_map, path, opts, type, 0, recode, recode_data, first_row,
+         num_rows)) {
+        free_raster(rast_map);
+        free(rast_map);
+        return NULL;
+    }
+
+    return rast_map;
+}
+
+/* get the size of a raster without reading it; 0 is returned on success */
+int get_raster_size(const char *path, const char *opts, int *nrows,
+                    int *ncols)
+{
+    GDALDatasetH dataset;
+
+    if (!(dataset =
+          GDALOpenEx(path, GDAL_OF_RASTER | GDAL_OF_THREAD_SAFE, NULL,
+                     opts ? split_opts(opts) : NULL, NULL)))
+        return 1;
+
+    *nrows = GDALGetRasterYSize(dataset);
+    *ncols = GDALGetRasterXSize(dataset);
+    GDALClose(dataset);
+
+    return 0;
+}
+
+/* read a raster into an existing raster map, reusing its cell buffer if it is
+ * large enough; 0 is returned on success */
+int reread_raster(struct raster_map *rast_map, const char *path,
+                  const char *opts, int type, int get_stats,
+                  double (*recode)(double, void *), void *recode_data)
+{
+    return load_raster(rast_map, path, opts, type, get_stats, recode,
+                       recode_data, 0, 0);
+}
+
+/* read all rows if num_rows is 0 */
+static int load_raster(struct raster_map *rast_map, const char *path,
+                       const char *opts, int type, int get_stats,
+                       double (*recode)(double, void *), void *recode_data,
+                       int first_row, int num_rows)
+{
     const char **ds_opts = NULL;
     GDALDatasetH dataset;
     GDALRasterBandH band;
@@ -327,38 +758,35 @@ struct raster_map *read_raster(const char *path, const char *opts, int type,
     int row;
     int error = 0;
 
-    if (opts) {
-        char *o, *p;
-        int n;
-
-        strcpy((o = malloc(strlen(opts) + 1)), opts);
-        for (p = o, n = 2; *p; p++)
-            if (*p == ',')
-                n++;
-        ds_opts = malloc(sizeof *ds_opts * n);
-
-        for (p = o, n = 0; *p; p++) {
-            if (p == o || *(p - 1) == ',') {
-                ds_opts[n] = p;
-                if (p > o)
-                    *(p - 1) = 0;
-            }
-        }
-    }
+    if (opts)
+        ds_opts = split_opts(opts);
 
     if (!(dataset =
           GDALOpenEx(path, GDAL_OF_RASTER | GDAL_OF_THREAD_SAFE, NULL,
                      ds_opts, NULL)))
-        return NULL;
+        return 1;
 
-    rast_map = calloc(1, sizeof *rast_map);
     rast_map->nrows = GDALGetRasterYSize(dataset);
     rast_map->ncols = row_size = GDALGetRasterXSize(dataset);
+    rast_map->nbands = 1;
+    free(rast_map->projection);
     rast_map->projection = strdup(GDALGetProjectionRef(dataset));
     GDALGetGeoTransform(dataset, rast_map->geotransform);
     rast_map->dx = rast_map->geotransform[1];
     rast_map->dy = -rast_map->geotransform[5];
 
+    if (num_rows) {
+        if (first_row < 0 || first_row >= rast_map->nrows || num_rows < 0) {
+            GDALClose(dataset);
+            return 1;
+        }
+        if (first_row + num_rows > rast_map->nrows)
+            num_rows = rast_map->nrows - first_row;
+        rast_map->nrows = num_rows;
+        rast_map->geotransform[0] += first_row * rast_map->geotransform[2];
+        rast_map->geotransform[3] += first_row * rast_map->geotransform[5];
+    }
+
     band = GDALGetRasterBand(dataset, 1);
 
     if (get_stats) {
@@ -429,23 +857,25 @@ struct raster_map *read_raster(const char *path, const char *opts, int type,
             }
             break;
         }
-        row_size *= GDALGetDataTypeSizeBytes(rast_type);
-
         rast_map->type = rast_type;
-        rast_map->cells.v = malloc(rast_map->nrows * row_size);
+        alloc_cells(rast_map,
+                    (size_t)(rast_map->nrows + 2 * rast_map->padding) *
+                    (rast_map->ncols + 2 * rast_map->padding) *
+                    get_cell_size(rast_type));
 
         if (rast_type == gdt_type) {
 #pragma omp parallel for schedule(dynamic)
             for (row = 0; row < rast_map->nrows; row++) {
                 if (GDALRasterIO
-                    (band, GF_Read, 0, row,
+                    (band, GF_Read, 0, first_row + row,
                      rast_map->ncols, 1,
-                     (char *)rast_map->cells.v + row * row_size,
+                     (char *)rast_map->cells.v +
+                     first_cell(rast_map, row) * get_cell_size(rast_type),
                      rast_map->ncols, 1, gdt_type, 0, 0) == CE_None) {
                     int col;
 
                     for (col = 0; col < rast_map->ncols; col++) {
-                        size_t i = (size_t)row * rast_map->ncols + col;
+                        size_t i = first_cell(rast_map, row) + col;
                         double v;
 
                         switch (gdt_type) {
@@ -546,13 +976,13 @@ struct raster_map *read_raster(const char *path, const char *opts, int type,
                 int thread_num = omp_get_thread_num();
 
                 if (GDALRasterIO
-                    (band, GF_Read, 0, row,
+                    (band, GF_Read, 0, first_row + row,
                      rast_map->ncols, 1, cells[thread_num].v, rast_map->ncols,
                      1, gdt_type, 0, 0) == CE_None) {
                     int col;
 
                     for (col = 0; col < rast_map->ncols; col++) {
-                        size_t i = (size_t)row * rast_map->ncols + col;
+                        size_t i = first_cell(rast_map, row) + col;
                         double v;
 
                         switch (gdt_type) {
@@ -704,31 +1134,237 @@ struct raster_map *read_raster(const char *path, const char *opts, int type,
             }
             break;
         }
-        row_size *= GDALGetDataTypeSizeBytes(gdt_type);
-
         rast_map->type = type;
-        rast_map->cells.v = malloc(rast_map->nrows * row_size);
+        alloc_cells(rast_map,
+                    (size_t)(rast_map->nrows + 2 * rast_map->padding) *
+                    (rast_map->ncols + 2 * rast_map->padding) *
+                    get_cell_size(type));
 
 #pragma omp parallel for schedule(dynamic)
         for (row = 0; row < rast_map->nrows; row++) {
             if (GDALRasterIO
-                (band, GF_Read, 0, row,
+                (band, GF_Read, 0, first_row + row,
                  rast_map->ncols, 1,
-                 (char *)rast_map->cells.v + row * row_size, rast_map->ncols,
-                 1, gdt_type, 0, 0) != CE_None)
+                 (char *)rast_map->cells.v +
+                 first_cell(rast_map, row) * get_cell_size(type),
+                 rast_map->ncols, 1, gdt_type, 0, 0) != CE_None)
                 error = 1;
         }
     }
 
     GDALClose(dataset);
 
-    if (error)
+    if (!error && rast_map->padding && pad_cells(rast_map))
+        error = 1;
+
+    return error ? 2 : 0;
+}
+
+static size_t get_cell_size(int type)
+{
+    switch (type) {
+    case RASTER_MAP_TYPE_FLOAT64:
+        return sizeof(double);
+    case RASTER_MAP_TYPE_FLOAT32:
+        return sizeof(float);
+    case RASTER_MAP_TYPE_UINT32:
+        return sizeof(unsigned int);
+    case RASTER_MAP_TYPE_INT32:
+        return sizeof(int);
+    case RASTER_MAP_TYPE_UINT16:
+        return sizeof(unsigned short);
+    case RASTER_MAP_TYPE_INT16:
+        return sizeof(short);
+    }
+    return 1;
+}
+
+/* index of the first cell of a row read into padded rows */
+static size_t first_cell(struct raster_map *rast_map, int row)
+{
+    return (size_t)(row + rast_map->padding) *
+        (rast_map->ncols + 2 * rast_map->padding) + rast_map->padding;
+}
+
+/* fill the border around rows read into padded rows with nulls; the border
+ * must compare equal to the null value, so a byte raster whose null value is
+ * not a byte, and hence has no null cells, gets a null value no cell has */
+static int pad_cells(struct raster_map *rast_map)
+{
+    int padding = rast_map->padding;
+    int nrows = rast_map->nrows + 2 * padding;
+    size_t stride = rast_map->ncols + 2 * padding;
+    int row;
+
+    if (rast_map->type == RASTER_MAP_TYPE_BYTE &&
+        !(rast_map->null_value >= 0 && rast_map->null_value <= UCHAR_MAX &&
+          rast_map->null_value == (int)rast_map->null_value) &&
+        set_unused_null(rast_map))
+        return 1;
+
+#pragma omp parallel for schedule(static)
+    for (row = 0; row < nrows; row++) {
+        size_t i = row * stride;
+
+        if (row < padding || row >= nrows - padding)
+            set_nulls(rast_map, i, stride);
+        else {
+            set_nulls(rast_map, i, padding);
+            set_nulls(rast_map, i + padding + rast_map->ncols, padding);
+        }
+    }
+
+    return 0;
+}
+
+/* the largest byte value not in any cell becomes the null value; 1 is
+ * returned if all values are used */
+static int set_unused_null(struct raster_map *rast_map)
+{
+    unsigned char used[UCHAR_MAX + 1] = { 0 };
+    int row, i;
+
+#pragma omp parallel
+    {
+        unsigned char thread_used[UCHAR_MAX + 1] = { 0 };
+        int col, j;
+
+#pragma omp for schedule(static)
+        for (row = 0; row < rast_map->nrows; row++) {
+            unsigned char *cells =
+                rast_map->cells.byte + first_cell(rast_map, row);
+
+            for (col = 0; col < rast_map->ncols; col++)
+                thread_used[cells[col]] = 1;
+        }
+
+#pragma omp critical
+        for (j = 0; j <= UCHAR_MAX; j++)
+            used[j] |= thread_used[j];
+    }
+
+    for (i = UCHAR_MAX; i >= 0 && used[i]; i--) ;
+    if (i < 0)
+        return 1;
+    rast_map->null_value = i;
+
+    return 0;
+}
+
+static void set_nulls(struct raster_map *rast_map, size_t first, size_t n)
+{
+    size_t i;
+
+    switch (rast_map->type) {
+    case RASTER_MAP_TYPE_FLOAT64:
+        for (i = first; i < first + n; i++)
+            rast_map->cells.float64[i] = rast_map->null_value;
+        break;
+    case RASTER_MAP_TYPE_FLOAT32:
+        for (i = first; i < first + n; i++)
+            rast_map->cells.float32[i] = rast_map->null_value;
+        break;
+    case RASTER_MAP_TYPE_UINT32:
+        for (i = first; i < first + n; i++)
+            rast_map->cells.uint32[i] = rast_map->null_value;
+        break;
+    case RASTER_MAP_TYPE_INT32:
+        for (i = first; i < first + n; i++)
+            rast_map->cells.int32[i] = rast_map->null_value;
+        break;
+    case RASTER_MAP_TYPE_UINT16:
+        for (i = first; i < first + n; i++)
+            rast_map->cells.uint16[i] = rast_map->null_value;
+        break;
+    case RASTER_MAP_TYPE_INT16:
+        for (i = first; i < first + n; i++)
+            rast_map->cells.int16[i] = rast_map->null_value;
+        break;
+    default:
+        for (i = first; i < first + n; i++)
+            rast_map->cells.byte[i] = rast_map->null_value;
+        break;
+    }
+}
+
+/* read all bands of a raster as doubles interleaved by cell; nulls in any band
+ * become NaN */
+struct raster_map *read_raster_bands(const char *path, const char *opts)
+{
+    struct raster_map *rast_map;
+    const char **ds_opts = NULL;
+    GDALDatasetH dataset;
+    size_t row_size;
+    int row, i;
+    int error = 0;
+
+    if (opts)
+        ds_opts = split_opts(opts);
+
+    if (!(dataset =
+          GDALOpenEx(path, GDAL_OF_RASTER | GDAL_OF_THREAD_SAFE, NULL,
+                     ds_opts, NULL)))
         return NULL;
 
+    rast_map = calloc(1, sizeof *rast_map);
+    rast_map->type = RASTER_MAP_TYPE_FLOAT64;
+    rast_map->nrows = GDALGetRasterYSize(dataset);
+    rast_map->ncols = GDALGetRasterXSize(dataset);
+    rast_map->nbands = GDALGetRasterCount(dataset);
+    rast_map->projection = strdup(GDALGetProjectionRef(dataset));
+    GDALGetGeoTransform(dataset, rast_map->geotransform);
+    rast_map->dx = rast_map->geotransform[1];
+    rast_map->dy = -rast_map->geotransform[5];
+    rast_map->null_value = NAN;
+
+    row_size = sizeof(double) * rast_map->ncols * rast_map->nbands;
+    alloc_cells(rast_map, rast_map->nrows * row_size);
+
+    for (i = 0; i < rast_map->nbands; i++) {
+        GDALRasterBandH band = GDALGetRasterBand(dataset, i + 1);
+        double null_value = GDALGetRasterNoDataValue(band, NULL);
+
+#pragma omp parallel for schedule(dynamic)
+        for (row = 0; row < rast_map->nrows; row++) {
+            double *cells = (double *)((char *)rast_map->cells.v +
+                                       row * row_size) + i;
+            int col;
+
+            if (GDALRasterIO
+                (band, GF_Read, 0, row, rast_map->ncols, 1, cells,
+                 rast_map->ncols, 1, GDT_Float64,
+                 sizeof(double) * rast_map->nbands, 0) != CE_None) {
+                error = 1;
+                continue;
+            }
+
+            for (col = 0; col < rast_map->ncols; col++)
+                if (cells[col * rast_map->nbands] == null_value)
+                    cells[col * rast_map->nbands] = NAN;
+        }
+    }
+
+    GDALClose(dataset);
+
+    if (error) {
+        free_raster(rast_map);
+        free(rast_map);
+        return NULL;
+    }
+
     return rast_map;
 }
 
 int write_raster(const char *path, struct raster_map *rast_map, int type)
+{
+    return write_raster_rows(path, rast_map, type, 0, rast_map->nrows);
+}
+
+/* write the rows of rast_map starting at first_row of a raster; the raster
+ * is created with total_nrows rows if total_nrows is not 0 and updated
+ * otherwise; a map without rows only creates the raster */
+int write_raster_rows(const char *path, struct raster_map *rast_map, int type,
+                      int first_row, int total_nrows)
 {
     GDALDriverH driver = GDALGetDriverByName("GTiff");
     char **metadata, **options = NULL;
@@ -736,6 +1372,7 @@ int write_raster(const char *path, struct raster_map *rast_map, int type)
     GDALRasterBandH band;
     GDALDataType data_type, gdt_type;
     size_t row_size;
+    int i;
 
     if (!driver)
         return 1;
@@ -802,22 +1439,73 @@ int write_raster(const char *path, struct raster_map *rast_map, int type)
             break;
         }
 
-    if (!(dataset =
-          GDALCreate(driver, path, rast_map->ncols, rast_map->nrows, 1,
-                     gdt_type, options)))
-        return 3;
-
-    GDALSetProjection(dataset, rast_map->projection);
-    GDALSetGeoTransform(dataset, rast_map->geotransform);
+    if (!total_nrows) {
+        if (!(dataset =
+              GDALOpenEx(path, GDAL_OF_RASTER | GDAL_OF_UPDATE, NULL, NULL,
+                         NULL)))
+            return 3;
+    }
+    else {
+        if (!(dataset =
+              GDALCreate(driver, path, rast_map->ncols, total_nrows,
+                         rast_map->nbands, gdt_type, options)))
+            return 3;
 
-    band = GDALGetRasterBand(dataset, 1);
-    GDALSetRasterNoDataValue(band, rast_map->null_value);
+        GDALSetProjection(dataset, rast_map->projection);
+        GDALSetGeoTransform(dataset, rast_map->geotransform);
+    }
+    CSLDestroy(options);
+
+    /* multiple bands are interleaved by cell; rows of a padded map start
+     * after the padding */
+    for (i = 0; i < rast_map->nbands; i++) {
+        int data_size = GDALGetDataTypeSizeBytes(data_type);
+        size_t stride = rast_map->ncols + 2 * rast_map->padding;
+        char *cells = (char *)rast_map->cells.v +
+            ((rast_map->padding * stride + rast_map->padding) *
+             rast_map->nbands + i) * data_size;
+
+        band = GDALGetRasterBand(dataset, i + 1);
+        if (total_nrows)
+            GDALSetRasterNoDataValue(band, rast_map->null_value);
+
+        if (rast_map->nrows && GDALRasterIO
+            (band, GF_Write, 0, first_row, rast_map->ncols, rast_map->nrows,
+             cells, rast_map->ncols, rast_map->nrows, data_type,
+             rast_map->nbands * data_size,
+             rast_map->nbands * data_size * stride) !=
+            CE_None)
+            return 4;
+    }
 
-    if (GDALRasterIO
-        (band, GF_Write, 0, 0, rast_map->ncols, rast_map->nrows,
-         (char *)rast_map->cells.v, rast_map->ncols, rast_map->nrows,
-         data_type, 0, 0) != CE_None)
-        return 4;
+    if (rast_map->has_stats && rast_map->nbands == 1) {
+        char buf[32], *histogram = NULL;
+        size_t len = 0;
+        int first = 0, last = RASTER_HIST_BINS - 1;
+
+        band = GDALGetRasterBand(dataset, 1);
+        GDALSetRasterStatistics(band, rast_map->min, rast_map->max,
+                                rast_map->mean, rast_map->sd);
+
+        /* only bins from the first to the last non-empty ones are stored as
+         * comma-separated counts */
+        while (first <= last && !rast_map->histogram[first])
+            first++;
+        while (last >= first && !rast_map->histogram[last])
+            last--;
+        if (first <= last) {
+            histogram = malloc(21 * (last - first + 1));
+            for (i = first; i <= last; i++)
+                len += sprintf(histogram + len, i > first ? ",%zu" : "%zu",
+                               rast_map->histogram[i]);
+            sprintf(buf, "%d", first + RASTER_HIST_MIN_EXP);
+            GDALSetMetadataItem(band, "STATISTICS_LOG2_FIRST_EXP", buf,
+                                NULL);
+            GDALSetMetadataItem(band, "STATISTICS_LOG2_HISTOGRAM", histogram,
+                                NULL);
+            free(histogram);
+        }
+    }
 
     GDALClose(dataset);
 
@@ -847,3 +1535,140 @@ void calc_coors(struct raster_map *rast_map, int row, int col, double *x,
     *y = rast_map->geotransform[3] + rast_map->geotransform[4] * (col + 0.5) +
         rast_map->geotransform[5] * (row + 0.5);
 }
+
+int is_geographic(struct raster_map *rast_map)
+{
+    const char *proj = rast_map->projection;
+
+    return proj && (strncmp(proj, "GEOGCS[", 7) == 0 ||
+                    strncmp(proj, "GEOGCRS[", 8) == 0 ||
+                    strncmp(proj, "GEODCRS[", 8) == 0);
+}
+
+/* per-row cell areas in square meters on the ellipsoid of the projection
+ * (WGS84 if not found) for geographic rasters or in square map units for
+ * projected rasters */
+double *calc_cell_areas(struct raster_map *rast_map)
+{
+    double *cell_areas = malloc(sizeof *cell_areas * rast_map->nrows);
+    double *gt = rast_map->geotransform;
+    int row;
+
+    if (is_geographic(rast_map)) {
+        double a = 6378137, inv_f = 298.257223563, e2, dlon;
+        char *p;
+
+        if (((p = strstr(rast_map->projection, "SPHEROID[")) ||
+             (p = strstr(rast_map->projection, "ELLIPSOID["))) &&
+            (p = strchr(p, ',')) &&
+            sscanf(p + 1, "%lf,%lf", &a, &inv_f) != 2)
+            inv_f = 0;
+        e2 = inv_f > 0 ? (2 - 1 / inv_f) / inv_f : 0;
+        dlon = fabs(gt[1]) * M_PI / 180;
+
+        for (row = 0; row < rast_map->nrows; row++) {
+            double lat = gt[3] + row * gt[5];
+
+            cell_areas[row] = dlon * fabs(calc_zone_area(lat, a, e2) -
+                                          calc_zone_area(lat + gt[5], a, e2));
+        }
+    }
+    else
+        for (row = 0; row < rast_map->nrows; row++)
+            cell_areas[row] = fabs(gt[1] * gt[5] - gt[2] * gt[4]);
+
+    return cell_areas;
+}
+
+/* area per radian of longitude between the equator and lat on an ellipsoid */
+static double calc_zone_area(double lat, double a, double e2)
+{
+    double sin_lat = sin(lat * M_PI / 180), e;
+
+    if (e2 == 0)
+        return a * a * sin_lat;
+
+    e = sqrt(e2);
+
+    return a * a * (1 - e2) / 2 *
+        (sin_lat / (1 - e2 * sin_lat * sin_lat) +
+         log((1 + e * sin_lat) / (1 - e * sin_lat)) / (2 * e));
+}
+
+/* floating-point values have 3 decimals */
+static char *format_cell(char *p, struct raster_map *rast_map, size_t idx)
+{
+    switch (rast_map->type) {
+    case RASTER_MAP_TYPE_FLOAT64:
+        return format_double(p, rast_map->cells.float64[idx], 3);
+    case RASTER_MAP_TYPE_FLOAT32:
+        return format_double(p, rast_map->cells.float32[idx], 3);
+    case RASTER_MAP_TYPE_UINT32:
+        return format_uint(p, rast_map->cells.uint32[idx]);
+    case RASTER_MAP_TYPE_INT32:
+        if (rast_map->cells.int32[idx] < 0) {
+            *p++ = '-';
+            return format_uint(p, -(long long)rast_map->cells.int32[idx]);
+        }
+        return format_uint(p, rast_map->cells.int32[idx]);
+    case RASTER_MAP_TYPE_UINT16:
+        return format_uint(p, rast_map->cells.uint16[idx]);
+    case RASTER_MAP_TYPE_INT16:
+        if (rast_map->cells.int16[idx] < 0) {
+            *p++ = '-';
+            return format_uint(p, -rast_map->cells.int16[idx]);
+        }
+        return format_uint(p, rast_map->cells.int16[idx]);
+    default:
+        return format_uint(p, rast_map->cells.byte[idx]);
+    }
+}
+
+static char *format_uint(char *p, unsigned long long value)
+{
+    char digits[20];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (n)
+        *p++ = digits[--n];
+
+    return p;
+}
+
+/* fixed point with up to 12 decimals converted as integers; values too large
+ * for that, infinities, and NaN fall back to sprintf() */
+static char *format_double(char *p, double value, int decimals)
+{
+    static const double scales[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12
+    };
+    unsigned long long scale = scales[decimals], units;
+    double scaled = value * scales[decimals];
+
+    if (!(fabs(scaled) < 9e18))
+        return p + sprintf(p, "%.17g", value);
+
+    if (scaled < 0) {
+        *p++ = '-';
+        scaled = -scaled;
+    }
+    units = scaled + 0.5;
+    p = format_uint(p, units / scale);
+    if (decimals) {
+        unsigned long long frac = units % scale;
+        int i;
+
+        *p++ = '.';
+        for (i = decimals; i > 0; i--) {
+            p[i - 1] = '0' + frac % 10;
+            frac /= 10;
+        }
+        p += decimals;
+    }
+
+    return p;
+}
@@ -1,6 +1,8 @@
 #ifndef _RASTER_H_
 #define _RASTER_H_
 
+#include <stddef.h>
+
 #define RASTER_MAP_TYPE_AUTO 0
 #define RASTER_MAP_TYPE_BYTE 1
 #define RASTER_MAP_TYPE_INT16 2
@@ -10,10 +12,25 @@
 #define RASTER_MAP_TYPE_FLOAT32 6
 #define RASTER_MAP_TYPE_FLOAT64 7
 
+/* bin i of a histogram counts positive values in [2^(i + min exponent),
+ * 2^(i + 1 + min exponent)); values outside fall in the first or last bin */
+#define RASTER_HIST_BINS 64
+#define RASTER_HIST_MIN_EXP -16
+
+/* text formats for dump_raster() */
+#define RASTER_DUMP_ASC 0
+#define RASTER_DUMP_CSV 1
+#define RASTER_DUMP_XYZ 2
+
 struct raster_map
 {
     int type;
     int nrows, ncols;
+    /* cells of multiple bands are interleaved */
+    int nbands;
+    /* cells are surrounded by this many null cells on each side, so rows
+     * are ncols + 2 * padding cells apart */
+    int padding;
     union
     {
         void *v;
@@ -25,6 +42,7 @@ struct raster_map
         float *float32;
         double *float64;
     } cells;
+    size_t cells_size;
     double null_value;
     char *projection;
     double geotransform[6];
@@ -35,20 +53,33 @@ struct raster_map
     double max;
     double mean;
     double sd;
+    size_t histogram[RASTER_HIST_BINS];
 };
 
 /* raster.c */
 void print_raster(const char *, const char *, const char *, const char *);
+int dump_raster(const char *, const char *, int, const char *, const char *);
 int is_null(struct raster_map *, int, int);
 void set_null(struct raster_map *, int, int);
 void reset_null(struct raster_map *, double);
 struct raster_map *init_raster(int, int, int);
+void reinit_raster(struct raster_map *, int, int, int);
 void free_raster(struct raster_map *);
 void copy_raster_metadata(struct raster_map *, const struct raster_map *);
+void calc_raster_stats(struct raster_map *);
 struct raster_map *read_raster(const char *, const char *, int, int,
                                double (*)(double, void *), void *);
+struct raster_map *read_raster_rows(const char *, const char *, int, int, int,
+                                    double (*)(double, void *), void *);
+int get_raster_size(const char *, const char *, int *, int *);
+int reread_raster(struct raster_map *, const char *, const char *, int, int,
+                  double (*)(double, void *), void *);
+struct raster_map *read_raster_bands(const char *, const char *);
 int write_raster(const char *, struct raster_map *, int);
+int write_raster_rows(const char *, struct raster_map *, int, int, int);
 void calc_row_col(struct raster_map *, double, double, int *, int *);
 void calc_coors(struct raster_map *, int, int, double *, double *);
+int is_geographic(struct raster_map *);
+double *calc_cell_areas(struct raster_map *);
 
 #endif
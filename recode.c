@@ -1,3 +1,5 @@
+#include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include "global.h"
 
@@ -18,3 +20,35 @@ double recode_degree(double value, void *data)
 {
     return pow(2, 8 - (int)((value + 22.5) / 45));
 }
+
+/* set recode for an encoding name or a custom encoding stored in encoding;
+ * recode is NULL for power2 and 1 is returned for an invalid encoding */
+int parse_encoding(const char *str, int *encoding,
+                   double (**recode)(double, void *))
+{
+    int i;
+
+    if (strcmp(str, "power2") == 0) {
+        *recode = NULL;
+        return 0;
+    }
+    if (strcmp(str, "degree") == 0) {
+        *recode = recode_degree;
+        return 0;
+    }
+
+    if (strcmp(str, "taudem") == 0)
+        for (i = 1; i < 9; i++)
+            encoding[i % 8] = 9 - i;
+    else if (strcmp(str, "45degree") == 0)
+        for (i = 0; i < 8; i++)
+            encoding[i] = 8 - i;
+    else if (sscanf(str, "%d,%d,%d,%d,%d,%d,%d,%d", &encoding[0],
+                    &encoding[1], &encoding[2], &encoding[3], &encoding[4],
+                    &encoding[5], &encoding[6], &encoding[7]) != 8)
+        return 1;
+
+    *recode = recode_encoding;
+
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+#include "global.h"
+#include "look_around.h"
+
+struct roi_context
+{
+    struct raster_map *dir_map;
+    int nrows, ncols;
+};
+
+/* accumulate flows only for the window given by map coordinates; cells outside
+ * the window that drain into it are counted by flooding upstream from the
+ * cells just outside the window that flow into it, so time and memory for
+ * accumulation scale with the contributing area; the returned raster covers
+ * the window only and NULL is returned if the window is outside the raster */
+struct raster_map *accumulate_roi(struct raster_map *dir_map, double xmin,
+                                  double ymin, double xmax, double ymax,
+                                  int engine)
+{
+    struct roi_context context, *ctx = &context;
+    struct raster_map *win_dir_map, *accum_map;
+    int row1, col1, row2, col2, win_nrows, win_ncols;
+    int *inflow_rows, *inflow_cols, *target_rows, *target_cols;
+    unsigned int *inflow_counts;
+    int num_inflows = 0, max_inflows;
+    int row, col, i;
+
+    ctx->dir_map = dir_map;
+    ctx->nrows = dir_map->nrows;
+    ctx->ncols = dir_map->ncols;
+
+    calc_row_col(dir_map, xmin, ymax, &row1, &col1);
+    calc_row_col(dir_map, xmax, ymin, &row2, &col2);
+    if (row1 > row2) {
+        row = row1;
+        row1 = row2;
+        row2 = row;
+    }
+    if (col1 > col2) {
+        col = col1;
+        col1 = col2;
+        col2 = col;
+    }
+    if (row1 < 0)
+        row1 = 0;
+    if (col1 < 0)
+        col1 = 0;
+    if (row2 >= ctx->nrows)
+        row2 = ctx->nrows - 1;
+    if (col2 >= ctx->ncols)
+        col2 = ctx->ncols - 1;
+    if (row1 > row2 || col1 > col2)
+        return NULL;
+
+    win_nrows = row2 - row1 + 1;
+    win_ncols = col2 - col1 + 1;
+
+    /* accumulate flows generated within the window */
+    win_dir_map = init_raster(win_nrows, win_ncols, RASTER_MAP_TYPE_BYTE);
+    win_dir_map->null_value = dir_map->null_value;
+#pragma omp parallel for schedule(dynamic)
+    for (row = 0; row < win_nrows; row++)
+        memcpy(win_dir_map->cells.byte + (size_t)row * win_ncols,
+               &DIR(row1 + row, col1), win_ncols);
+
+    accum_map = init_raster(win_nrows, win_ncols, RASTER_MAP_TYPE_UINT32);
+    copy_raster_metadata(accum_map, dir_map);
+    accumulate(win_dir_map, accum_map, engine);
+    free_raster(win_dir_map);
+    free(win_dir_map);
+
+    accum_map->geotransform[0] += col1 * dir_map->geotransform[1] +
+        row1 * dir_map->geotransform[2];
+    accum_map->geotransform[3] += col1 * dir_map->geotransform[4] +
+        row1 * dir_map->geotransform[5];
+
+    /* find cells just outside the window that flow into it */
+    max_inflows = 2 * (win_nrows + win_ncols) + 4;
+    inflow_rows = malloc(sizeof *inflow_rows * max_inflows);
+    inflow_cols = malloc(sizeof *inflow_cols * max_inflows);
+    target_rows = malloc(sizeof *target_rows * max_inflows);
+    target_cols = malloc(sizeof *target_cols * max_inflows);
+    for (row = row1 - 1; row <= row2 + 1; row++) {
+        if (row < 0 || row >= ctx->nrows)
+            continue;
+        for (col = col1 - 1; col <= col2 + 1; col++) {
+            int down_row, down_col;
+
+            /* skip interior cells */
+            if (row >= row1 && row <= row2 && col == col1)
+                col = col2 + 1;
+            down_row = row;
+            down_col = col;
+            if (col < 0 || col >= ctx->ncols || DIR(row, col) == DIR_NULL ||
+                !move_down(DIR(row, col), &down_row, &down_col) ||
+                down_row < row1 || down_row > row2 || down_col < col1 ||
+                down_col > col2 || DIR(down_row, down_col) == DIR_NULL)
+                continue;
+
+            inflow_rows[num_inflows] = row;
+            inflow_cols[num_inflows] = col;
+            target_rows[num_inflows] = down_row;
+            target_cols[num_inflows++] = down_col;
+        }
+    }
+
+    /* count their upstream cells and add them along their downstream paths
+     * within the window; paths that leave the window and come back are
+     * counted by the cells through which they come back */
+    inflow_counts = malloc(sizeof *inflow_counts * (num_inflows + 1));
+    count_upstream(dir_map, num_inflows, inflow_rows, inflow_cols,
+                   inflow_counts, NULL, NULL);
+
+#pragma omp parallel for schedule(dynamic) private(row, col)
+    for (i = 0; i < num_inflows; i++) {
+        row = target_rows[i];
+        col = target_cols[i];
+        do {
+#pragma omp atomic
+            accum_map->cells.uint32[(size_t)(row - row1) * win_ncols + col -
+                                    col1] += inflow_counts[i];
+        } while (move_down(DIR(row, col), &row, &col) && row >= row1 &&
+                 row <= row2 && col >= col1 && col <= col2 &&
+                 DIR(row, col) != DIR_NULL);
+    }
+
+    free(inflow_rows);
+    free(inflow_cols);
+    free(target_rows);
+    free(target_cols);
+    free(inflow_counts);
+
+    return accum_map;
+}
@@ -0,0 +1,901 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "global.h"
+#include "look_around.h"
+
+#define ACCUM(row, col) accum_map->cells.uint32[INDEX(row, col)]
+#define ACCUMS(row, col) (accum_map->cells.float64 + \
+        INDEX(row, col) * accum_map->nbands)
+
+#define SCHEDULE_MAGIC "MEFASCH3"
+
+/* confluence cells are marked so that their pending inflows can be counted
+ * down without being mistaken for chain cells with one inflow */
+#define CONFLUENCE 0x80
+
+/* threads claim this many chains at a time in a level and heads are encoded
+ * in chunks of this many chains */
+#define CHAIN_CHUNK 64
+
+/* chains at least this long are listed cell by cell so that the whole team
+ * can scan them instead of one thread walking them */
+#define LONG_CHAIN 4096
+
+/* bytes of the header in the file */
+#define HEADER_SIZE 72
+
+#define IS_END(idx) (sched->ends[(idx) >> 3] & 1 << ((idx) & 7))
+
+/* the sidecar file is this header with fixed-width little-endian fields
+ * followed by 64-bit little-endian level_offsets, chunk_offsets,
+ * long_levels, long_offsets, and long_cells, and the bytes of heads and
+ * ends */
+struct schedule_header
+{
+    char magic[8];
+    int nrows, ncols;
+    unsigned long long dir_hash;
+    size_t num_levels, num_chains, num_chunks, heads_size;
+    size_t num_long_chains, num_long_cells;
+};
+
+/* chains run from a headwater or confluence cell down through confluences
+ * whose other inflows all come from lower levels and stop before the next
+ * confluence with inflows from the same or a later level; chains of a level
+ * only depend on chains of lower levels, whose accumulation has been pushed
+ * into the chain cells, and level i has chains level_offsets[i] to
+ * level_offsets[i + 1] */
+struct schedule
+{
+    struct schedule_header header;
+    size_t *level_offsets;
+    /* heads are sorted in each level and stored as varint differences that
+     * restart at byte chunk_offsets[j] every CHAIN_CHUNK chains so that
+     * chunks decode independently; level i has chunks level_chunks[i] to
+     * level_chunks[i + 1] */
+    size_t *level_chunks, *chunk_offsets;
+    unsigned char *heads;
+    /* one bit per cell set on the last cell of each chain instead of storing
+     * chain lengths */
+    unsigned char *ends;
+    /* long chain i is not in heads; it runs in level long_levels[i] and has
+     * cells long_cells[long_offsets[i]] to long_cells[long_offsets[i + 1]] */
+    size_t *long_levels, *long_offsets, *long_cells;
+    /* mapped or read file; NULL for a built schedule */
+    void *data;
+    size_t data_size;
+};
+
+struct schedule_context
+{
+    struct raster_map *dir_map;
+    int nrows, ncols;
+};
+
+static void walk_chain(struct schedule *, size_t, struct schedule_context *,
+                       struct raster_map *);
+static void scan_long_chain(struct schedule *, size_t,
+                            struct schedule_context *, struct raster_map *);
+static unsigned long long hash_dir(struct raster_map *);
+static struct schedule *build_schedule(struct raster_map *);
+static size_t encode_heads(struct schedule *, const size_t *,
+                           unsigned char *);
+static void count_chunks(struct schedule *);
+static struct schedule *read_schedule(const char *);
+static int write_schedule(const char *, struct schedule *);
+static int compare_cells(const void *, const void *);
+static size_t put_varint(unsigned char *, size_t);
+static size_t get_varint(const unsigned char **);
+static void put_u64(unsigned char *, unsigned long long);
+static unsigned long long get_u64(const unsigned char *);
+static int write_u64s(FILE *, const size_t *, size_t);
+static size_t *read_u64s(const unsigned char *, size_t);
+
+/* read the traversal schedule for dir_map from path or build and save it if
+ * it does not exist or belongs to another flow direction raster */
+struct schedule *get_schedule(const char *path, struct raster_map *dir_map)
+{
+    struct schedule *sched;
+    unsigned long long dir_hash = hash_dir(dir_map);
+
+    printf("Reading traversal schedule <%s>...\n", path);
+    if ((sched = read_schedule(path))) {
+        if (sched->header.nrows == dir_map->nrows &&
+            sched->header.ncols == dir_map->ncols &&
+            sched->header.dir_hash == dir_hash)
+            return sched;
+        printf("Schedule does not match flow direction raster\n");
+        free_schedule(sched);
+    }
+
+    printf("Building traversal schedule...\n");
+    sched = build_schedule(dir_map);
+    sched->header.dir_hash = dir_hash;
+    printf("%zu chains in %zu levels, %zu long chains\n",
+           sched->header.num_chains, sched->header.num_levels,
+           sched->header.num_long_chains);
+
+    printf("Writing traversal schedule <%s>...\n", path);
+    if (write_schedule(path, sched))
+        fprintf(stderr, "%s: Failed to write traversal schedule\n", path);
+
+    return sched;
+}
+
+void free_schedule(struct schedule *sched)
+{
+    free(sched->level_offsets);
+    free(sched->level_chunks);
+    free(sched->chunk_offsets);
+    free(sched->long_levels);
+    free(sched->long_offsets);
+    free(sched->long_cells);
+    if (!sched->data) {
+        free(sched->heads);
+        free(sched->ends);
+    }
+#ifndef _WIN32
+    else
+        munmap(sched->data, sched->data_size);
+#else
+    else
+        free(sched->data);
+#endif
+    free(sched);
+}
+
+/* sweep the chains level by level without looking around; accumulation is
+ * pushed down into the head of the next chain, which runs in a later level;
+ * accum_map is either uint32 for cell counts or interleaved float64 bands of
+ * weights accumulated in place as in accumulate_weighted() */
+void accumulate_scheduled(struct schedule *sched, struct raster_map *dir_map,
+                          struct raster_map *accum_map)
+{
+    struct schedule_context context, *ctx = &context;
+    int nrows = dir_map->nrows, ncols = dir_map->ncols;
+    int nbands = accum_map->nbands;
+    size_t level, long_chain = 0;
+
+    ctx->dir_map = dir_map;
+    ctx->nrows = nrows;
+    ctx->ncols = ncols;
+
+    if (accum_map->type == RASTER_MAP_TYPE_FLOAT64) {
+        int row;
+
+#pragma omp parallel for schedule(dynamic)
+        for (row = 0; row < nrows; row++) {
+            int col;
+
+            for (col = 0; col < ncols; col++) {
+                double *accums = ACCUMS(row, col);
+                int i;
+
+                for (i = 0; i < nbands; i++)
+                    if (DIR(row, col) == DIR_NULL)
+                        accums[i] = NAN;
+                    else if (isnan(accums[i]))
+                        accums[i] = 0;
+            }
+        }
+    }
+
+    for (level = 0; level < sched->header.num_levels; level++) {
+        long long j;
+
+#pragma omp parallel for schedule(dynamic)
+        for (j = sched->level_chunks[level];
+             j < (long long)sched->level_chunks[level + 1]; j++) {
+            const unsigned char *p = sched->heads + sched->chunk_offsets[j];
+            size_t k = sched->level_offsets[level] +
+                (j - sched->level_chunks[level]) * CHAIN_CHUNK;
+            size_t last = k + CHAIN_CHUNK, head = 0;
+
+            if (last > sched->level_offsets[level + 1])
+                last = sched->level_offsets[level + 1];
+            for (; k < last; k++) {
+                head += get_varint(&p);
+                walk_chain(sched, head, ctx, accum_map);
+            }
+        }
+
+        /* a few long chains, typically main stems, would otherwise leave all
+         * but a few threads idle */
+        for (; long_chain < sched->header.num_long_chains &&
+             sched->long_levels[long_chain] == level; long_chain++)
+            scan_long_chain(sched, long_chain, ctx, accum_map);
+    }
+}
+
+/* walk a chain from its head to the cell marked in ends and push its
+ * accumulation into the cell below */
+static void walk_chain(struct schedule *sched, size_t head,
+                       struct schedule_context *ctx,
+                       struct raster_map *accum_map)
+{
+    int row = head / ctx->ncols, col = head % ctx->ncols;
+    int nrows = ctx->nrows, ncols = ctx->ncols;
+
+    if (accum_map->type == RASTER_MAP_TYPE_FLOAT64) {
+        int nbands = accum_map->nbands, b;
+        double *accums = ACCUMS(row, col);
+
+        while (!IS_END(INDEX(row, col))) {
+            double *up_accums = accums;
+
+            move_down(DIR(row, col), &row, &col);
+            accums = ACCUMS(row, col);
+            for (b = 0; b < nbands; b++)
+                accums[b] += up_accums[b];
+        }
+        if (move_down(DIR(row, col), &row, &col) && row >= 0 &&
+            row < nrows && col >= 0 && col < ncols &&
+            DIR(row, col) != DIR_NULL) {
+            double *down_accums = ACCUMS(row, col);
+
+            for (b = 0; b < nbands; b++)
+#pragma omp atomic update
+                down_accums[b] += accums[b];
+        }
+    }
+    else {
+        /* chain cells already hold the inflows pushed into them */
+        unsigned int accum = ACCUM(row, col) + 1;
+
+        ACCUM(row, col) = accum;
+        while (!IS_END(INDEX(row, col))) {
+            move_down(DIR(row, col), &row, &col);
+            accum += ACCUM(row, col) + 1;
+            ACCUM(row, col) = accum;
+        }
+        if (move_down(DIR(row, col), &row, &col) && row >= 0 &&
+            row < nrows && col >= 0 && col < ncols &&
+            DIR(row, col) != DIR_NULL)
+#pragma omp atomic update
+            ACCUM(row, col) += accum;
+    }
+}
+
+/* accumulation along a chain is a prefix sum over its listed cells, which
+ * hold the side inflows pushed into them; both cell counts and weights use
+ * a blocked scan with one block per thread */
+static void scan_long_chain(struct schedule *sched, size_t long_chain,
+                            struct schedule_context *ctx,
+                            struct raster_map *accum_map)
+{
+    const size_t *cells =
+        sched->long_cells + sched->long_offsets[long_chain];
+    long long num_cells = sched->long_offsets[long_chain + 1] -
+        sched->long_offsets[long_chain];
+    int row = cells[num_cells - 1] / ctx->ncols;
+    int col = cells[num_cells - 1] % ctx->ncols;
+    int has_down;
+
+    has_down = move_down(DIR(row, col), &row, &col) && row >= 0 &&
+        row < ctx->nrows && col >= 0 && col < ctx->ncols &&
+        DIR(row, col) != DIR_NULL;
+
+    if (accum_map->type == RASTER_MAP_TYPE_FLOAT64) {
+        int nbands = accum_map->nbands;
+        int num_blocks = omp_get_max_threads(), b;
+        long long block_size = (num_cells + num_blocks - 1) / num_blocks;
+        double *carries = calloc((size_t)num_blocks * nbands,
+                                 sizeof *carries);
+
+        /* scan each block in place */
+#pragma omp parallel for schedule(static)
+        for (b = 0; b < num_blocks; b++) {
+            long long first = b * block_size, last = first + block_size;
+            long long k;
+
+            if (last > num_cells)
+                last = num_cells;
+            for (k = first + 1; k < last; k++) {
+                double *accums = accum_map->cells.float64 + cells[k] * nbands;
+                double *up_accums = accum_map->cells.float64 +
+                    cells[k - 1] * nbands;
+                int i;
+
+                for (i = 0; i < nbands; i++)
+                    accums[i] += up_accums[i];
+            }
+        }
+
+        /* each block carries the sums of all blocks before it */
+        for (b = 1; b < num_blocks && (b - 1) * block_size < num_cells; b++) {
+            long long last = b * block_size < num_cells ?
+                b * block_size : num_cells;
+            const double *accums = accum_map->cells.float64 +
+                cells[last - 1] * nbands;
+            int i;
+
+            for (i = 0; i < nbands; i++)
+                carries[b * nbands + i] =
+                    carries[(b - 1) * nbands + i] + accums[i];
+        }
+
+#pragma omp parallel for schedule(static)
+        for (b = 1; b < num_blocks; b++) {
+            long long first = b * block_size, last = first + block_size;
+            long long k;
+
+            if (last > num_cells)
+                last = num_cells;
+            for (k = first; k < last; k++) {
+                double *accums = accum_map->cells.float64 + cells[k] * nbands;
+                int i;
+
+                for (i = 0; i < nbands; i++)
+                    accums[i] += carries[b * nbands + i];
+            }
+        }
+        free(carries);
+
+        if (has_down) {
+            double *down_accums = ACCUMS(row, col);
+            const double *accums = accum_map->cells.float64 +
+                cells[num_cells - 1] * nbands;
+            int i;
+
+            for (i = 0; i < nbands; i++)
+                down_accums[i] += accums[i];
+        }
+    }
+    else {
+        unsigned int *accums = accum_map->cells.uint32;
+        int num_blocks = omp_get_max_threads(), b;
+        long long block_size = (num_cells + num_blocks - 1) / num_blocks;
+        unsigned int *carries = calloc(num_blocks, sizeof *carries);
+
+        /* each cell adds itself to its inflows */
+#pragma omp parallel for schedule(static)
+        for (b = 0; b < num_blocks; b++) {
+            long long first = b * block_size, last = first + block_size;
+            long long k;
+
+            if (last > num_cells)
+                last = num_cells;
+            if (first < last)
+                accums[cells[first]]++;
+            for (k = first + 1; k < last; k++)
+                accums[cells[k]] += accums[cells[k - 1]] + 1;
+        }
+
+        for (b = 1; b < num_blocks && (b - 1) * block_size < num_cells; b++) {
+            long long last = b * block_size < num_cells ?
+                b * block_size : num_cells;
+
+            carries[b] = carries[b - 1] + accums[cells[last - 1]];
+        }
+
+#pragma omp parallel for schedule(static)
+        for (b = 1; b < num_blocks; b++) {
+            long long first = b * block_size, last = first + block_size;
+            long long k;
+
+            if (last > num_cells)
+                last = num_cells;
+            for (k = first; k < last; k++)
+                accums[cells[k]] += carries[b];
+        }
+        free(carries);
+
+        if (has_down)
+            ACCUM(row, col) += accums[cells[num_cells - 1]];
+    }
+}
+
+/* FNV-1a per row combined by row so that rows can be hashed in parallel */
+static unsigned long long hash_dir(struct raster_map *dir_map)
+{
+    unsigned long long hash = 0;
+    int row;
+
+#pragma omp parallel for schedule(dynamic) reduction(^:hash)
+    for (row = 0; row < dir_map->nrows; row++) {
+        const unsigned char *dirs = dir_map->cells.byte +
+            (size_t)row * dir_map->ncols;
+        unsigned long long row_hash = 14695981039346656037ULL;
+        int col;
+
+        for (col = 0; col < dir_map->ncols; col++) {
+            row_hash ^= dirs[col] == dir_map->null_value ? 0 : dirs[col];
+            row_hash *= 1099511628211ULL;
+        }
+        hash ^= row_hash * (2ULL * row + 1);
+    }
+
+    return hash;
+}
+
+/* chains start at headwater cells in level 0; a chain reaching a confluence
+ * continues through it if it is the only inflow still pending when the level
+ * starts, so that main stems are not cut at every side inflow; otherwise it
+ * stops, and the confluence starts a chain one level up once all its inflows
+ * have stopped there; inflows are counted down after each level so that the
+ * pending counts stay fixed while chains are walked */
+static struct schedule *build_schedule(struct raster_map *dir_map)
+{
+    struct schedule_context context, *ctx = &context;
+    struct schedule *sched = calloc(1, sizeof *sched);
+    int nrows = dir_map->nrows, ncols = dir_map->ncols;
+    size_t num_cells = (size_t)nrows * ncols;
+    unsigned char *num_ups = malloc(num_cells);
+    size_t *heads, *stops, *level_offsets, *long_heads;
+    unsigned int *lengths;
+    size_t num_chains = 0, num_heads = 0, num_levels = 0, max_levels = 64;
+    size_t num_short = 0, num_long = 0, num_long_cells = 0, start = 0;
+    size_t level, i;
+    int row;
+
+    ctx->dir_map = dir_map;
+    ctx->nrows = nrows;
+    ctx->ncols = ncols;
+
+#pragma omp parallel for schedule(dynamic) reduction(+:num_chains)
+    for (row = 0; row < nrows; row++) {
+        int col;
+
+        for (col = 0; col < ncols; col++) {
+            int up, n;
+
+            if (DIR(row, col) == DIR_NULL)
+                continue;
+
+            for (up = FIND_UP(row, col), n = 0; up; up &= up - 1)
+                n++;
+            num_ups[INDEX(row, col)] = n > 1 ? CONFLUENCE | n : n;
+            if (n != 1)
+                num_chains++;
+        }
+    }
+
+    level_offsets = malloc(sizeof *level_offsets * max_levels);
+    heads = malloc(sizeof *heads * num_chains);
+    lengths = malloc(sizeof *lengths * num_chains);
+    stops = malloc(sizeof *stops * num_chains);
+    sched->ends = calloc((num_cells + 7) / 8, 1);
+
+    /* headwater cells */
+#pragma omp parallel for schedule(dynamic)
+    for (row = 0; row < nrows; row++) {
+        int col;
+
+        for (col = 0; col < ncols; col++) {
+            size_t i;
+
+            if (DIR(row, col) == DIR_NULL || num_ups[INDEX(row, col)])
+                continue;
+#pragma omp atomic capture
+            i = num_heads++;
+            heads[i] = INDEX(row, col);
+        }
+    }
+
+    while (start < num_heads) {
+        size_t end = num_heads;
+        long long k;
+
+        if (num_levels + 1 >= max_levels) {
+            max_levels *= 2;
+            level_offsets =
+                realloc(level_offsets, sizeof *level_offsets * max_levels);
+        }
+        level_offsets[num_levels++] = start;
+
+        /* heads are appended in any order; sort them for locality and for
+         * encoding */
+        qsort(heads + start, end - start, sizeof *heads, compare_cells);
+
+#pragma omp parallel for schedule(dynamic, CHAIN_CHUNK)
+        for (k = start; k < (long long)end; k++) {
+            int chain_row = heads[k] / ncols, chain_col = heads[k] % ncols;
+            size_t last = heads[k];
+            unsigned int length = 1;
+
+            stops[k] = num_cells;
+            while (move_down(DIR(chain_row, chain_col), &chain_row,
+                             &chain_col) && chain_row >= 0 &&
+                   chain_row < nrows && chain_col >= 0 && chain_col < ncols &&
+                   DIR(chain_row, chain_col) != DIR_NULL) {
+                size_t idx = INDEX(chain_row, chain_col);
+
+                if (num_ups[idx] & CONFLUENCE &&
+                    num_ups[idx] != (CONFLUENCE | 1)) {
+                    stops[k] = idx;
+                    break;
+                }
+                last = idx;
+                length++;
+            }
+#pragma omp atomic update
+            sched->ends[last >> 3] |= 1 << (last & 7);
+            lengths[k] = length;
+        }
+
+        /* the last chain to stop at a confluence starts the next chain */
+#pragma omp parallel for schedule(static)
+        for (k = start; k < (long long)end; k++) {
+            size_t idx = stops[k], j;
+            unsigned char n;
+
+            if (idx == num_cells)
+                continue;
+#pragma omp atomic capture
+            n = --num_ups[idx];
+            if (n == CONFLUENCE) {
+#pragma omp atomic capture
+                j = num_heads++;
+                heads[j] = idx;
+            }
+        }
+
+        start = end;
+    }
+    level_offsets[num_levels] = num_heads;
+
+    free(num_ups);
+    free(stops);
+
+    /* long chains leave the heads of their level */
+    for (i = 0; i < num_heads; i++)
+        if (lengths[i] >= LONG_CHAIN)
+            num_long++;
+    sched->level_offsets = malloc(sizeof *sched->level_offsets *
+                                  (num_levels + 1));
+    sched->long_levels = malloc(sizeof *sched->long_levels * num_long);
+    sched->long_offsets =
+        malloc(sizeof *sched->long_offsets * (num_long + 1));
+    long_heads = malloc(sizeof *long_heads * num_long);
+
+    for (level = 0, num_long = 0; level < num_levels; level++) {
+        sched->level_offsets[level] = num_short;
+        for (i = level_offsets[level]; i < level_offsets[level + 1]; i++) {
+            if (lengths[i] < LONG_CHAIN) {
+                heads[num_short++] = heads[i];
+                continue;
+            }
+            sched->long_levels[num_long] = level;
+            long_heads[num_long] = heads[i];
+            sched->long_offsets[num_long++] = num_long_cells;
+            num_long_cells += lengths[i];
+        }
+    }
+    sched->level_offsets[num_levels] = num_short;
+    sched->long_offsets[num_long] = num_long_cells;
+    free(level_offsets);
+    free(lengths);
+
+    /* chains in or below loops are never started */
+    memcpy(sched->header.magic, SCHEDULE_MAGIC, sizeof sched->header.magic);
+    sched->header.nrows = nrows;
+    sched->header.ncols = ncols;
+    sched->header.num_levels = num_levels;
+    sched->header.num_chains = num_short;
+    sched->header.num_long_chains = num_long;
+    sched->header.num_long_cells = num_long_cells;
+
+    count_chunks(sched);
+    sched->chunk_offsets = malloc(sizeof *sched->chunk_offsets *
+                                  (sched->header.num_chunks + 1));
+    sched->header.heads_size = encode_heads(sched, heads, NULL);
+    sched->heads = malloc(sched->header.heads_size);
+    encode_heads(sched, heads, sched->heads);
+    free(heads);
+
+    /* list the cells of long chains in order */
+    sched->long_cells = malloc(sizeof *sched->long_cells * num_long_cells);
+
+#pragma omp parallel for schedule(dynamic)
+    for (i = 0; i < num_long; i++) {
+        size_t *cells = sched->long_cells + sched->long_offsets[i];
+        size_t n = sched->long_offsets[i + 1] - sched->long_offsets[i], k;
+        int chain_row = long_heads[i] / ncols;
+        int chain_col = long_heads[i] % ncols;
+
+        cells[0] = long_heads[i];
+        for (k = 1; k < n; k++) {
+            move_down(DIR(chain_row, chain_col), &chain_row, &chain_col);
+            cells[k] = INDEX(chain_row, chain_col);
+        }
+    }
+    free(long_heads);
+
+    return sched;
+}
+
+/* encode the sorted heads of each chunk as differences from the previous
+ * head into buf and return the number of bytes; with a NULL buf, only
+ * chunk_offsets are filled */
+static size_t encode_heads(struct schedule *sched, const size_t *heads,
+                           unsigned char *buf)
+{
+    size_t size = 0, level, j;
+
+    for (level = 0; level < sched->header.num_levels; level++) {
+        for (j = sched->level_chunks[level];
+             j < sched->level_chunks[level + 1]; j++) {
+            size_t k = sched->level_offsets[level] +
+                (j - sched->level_chunks[level]) * CHAIN_CHUNK;
+            size_t last = k + CHAIN_CHUNK, prev = 0;
+
+            if (last > sched->level_offsets[level + 1])
+                last = sched->level_offsets[level + 1];
+            sched->chunk_offsets[j] = size;
+            for (; k < last; k++) {
+                size += put_varint(buf ? buf + size : NULL, heads[k] - prev);
+                prev = heads[k];
+            }
+        }
+    }
+    sched->chunk_offsets[sched->header.num_chunks] = size;
+
+    return size;
+}
+
+/* each level starts a new chunk */
+static void count_chunks(struct schedule *sched)
+{
+    size_t num_chunks = 0, level;
+
+    sched->level_chunks = malloc(sizeof *sched->level_chunks *
+                                 (sched->header.num_levels + 1));
+    for (level = 0; level < sched->header.num_levels; level++) {
+        sched->level_chunks[level] = num_chunks;
+        num_chunks += (sched->level_offsets[level + 1] -
+                       sched->level_offsets[level] + CHAIN_CHUNK - 1) /
+            CHAIN_CHUNK;
+    }
+    sched->level_chunks[sched->header.num_levels] = num_chunks;
+    sched->header.num_chunks = num_chunks;
+}
+
+/* map the schedule file read-only instead of reading it where possible; the
+ * 64-bit arrays are decoded and heads and ends are used in place */
+static struct schedule *read_schedule(const char *path)
+{
+    struct schedule *sched;
+    struct schedule_header header;
+    const unsigned char *p;
+    unsigned long long size;
+    void *data;
+    size_t data_size;
+    int valid;
+#ifdef _WIN32
+    FILE *fp;
+    long file_size;
+
+    if (!(fp = fopen(path, "rb")))
+        return NULL;
+    if (fseek(fp, 0, SEEK_END) || (file_size = ftell(fp)) <= 0 ||
+        fseek(fp, 0, SEEK_SET)) {
+        fclose(fp);
+        return NULL;
+    }
+    data_size = file_size;
+    data = malloc(data_size);
+    if (fread(data, 1, data_size, fp) != data_size) {
+        free(data);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+#else
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) || !(data_size = st.st_size) ||
+        (data =
+         mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+#endif
+
+    p = data;
+    valid = data_size >= HEADER_SIZE &&
+        !memcmp(p, SCHEDULE_MAGIC, sizeof header.magic);
+    if (valid) {
+        memcpy(header.magic, p, sizeof header.magic);
+        /* nrows and ncols are 32-bit fields */
+        header.nrows = get_u64(p + 8) & 0xffffffff;
+        header.ncols = get_u64(p + 8) >> 32;
+        header.dir_hash = get_u64(p + 16);
+        header.num_levels = get_u64(p + 24);
+        header.num_chains = get_u64(p + 32);
+        header.num_chunks = get_u64(p + 40);
+        header.heads_size = get_u64(p + 48);
+        header.num_long_chains = get_u64(p + 56);
+        header.num_long_cells = get_u64(p + 64);
+
+        /* counts no larger than the file cannot overflow the sum */
+        valid = header.nrows > 0 && header.ncols > 0 &&
+            header.num_levels < data_size && header.num_chunks < data_size &&
+            header.heads_size < data_size &&
+            header.num_long_chains < data_size &&
+            header.num_long_cells < data_size;
+    }
+    if (valid) {
+        size = HEADER_SIZE + 8ULL * (header.num_levels + 1 +
+                                     header.num_chunks + 1 +
+                                     2 * header.num_long_chains + 1 +
+                                     header.num_long_cells) +
+            header.heads_size +
+            ((unsigned long long)header.nrows * header.ncols + 7) / 8;
+        valid = size == data_size;
+    }
+    if (!valid) {
+        fprintf(stderr, "%s: Invalid traversal schedule\n", path);
+#ifdef _WIN32
+        free(data);
+#else
+        munmap(data, data_size);
+#endif
+        return NULL;
+    }
+
+    sched = calloc(1, sizeof *sched);
+    sched->header = header;
+    p += HEADER_SIZE;
+    sched->level_offsets = read_u64s(p, header.num_levels + 1);
+    p += 8 * (header.num_levels + 1);
+    sched->chunk_offsets = read_u64s(p, header.num_chunks + 1);
+    p += 8 * (header.num_chunks + 1);
+    sched->long_levels = read_u64s(p, header.num_long_chains);
+    p += 8 * header.num_long_chains;
+    sched->long_offsets = read_u64s(p, header.num_long_chains + 1);
+    p += 8 * (header.num_long_chains + 1);
+    sched->long_cells = read_u64s(p, header.num_long_cells);
+    p += 8 * header.num_long_cells;
+    sched->heads = (unsigned char *)p;
+    sched->ends = (unsigned char *)p + header.heads_size;
+    sched->data = data;
+    sched->data_size = data_size;
+    count_chunks(sched);
+
+    if (sched->header.num_chunks != header.num_chunks ||
+        sched->level_offsets[header.num_levels] != header.num_chains ||
+        sched->chunk_offsets[header.num_chunks] != header.heads_size ||
+        sched->long_offsets[header.num_long_chains] !=
+        header.num_long_cells) {
+        fprintf(stderr, "%s: Invalid traversal schedule\n", path);
+        free_schedule(sched);
+        return NULL;
+    }
+
+    return sched;
+}
+
+static int write_schedule(const char *path, struct schedule *sched)
+{
+    const struct schedule_header *header = &sched->header;
+    unsigned char buf[HEADER_SIZE];
+    FILE *fp;
+    int status = 0;
+
+    if (!(fp = fopen(path, "wb")))
+        return 1;
+
+    memcpy(buf, header->magic, sizeof header->magic);
+    put_u64(buf + 8, (unsigned long long)header->ncols << 32 | header->nrows);
+    put_u64(buf + 16, header->dir_hash);
+    put_u64(buf + 24, header->num_levels);
+    put_u64(buf + 32, header->num_chains);
+    put_u64(buf + 40, header->num_chunks);
+    put_u64(buf + 48, header->heads_size);
+    put_u64(buf + 56, header->num_long_chains);
+    put_u64(buf + 64, header->num_long_cells);
+
+    if (fwrite(buf, HEADER_SIZE, 1, fp) != 1 ||
+        write_u64s(fp, sched->level_offsets, header->num_levels + 1) ||
+        write_u64s(fp, sched->chunk_offsets, header->num_chunks + 1) ||
+        write_u64s(fp, sched->long_levels, header->num_long_chains) ||
+        write_u64s(fp, sched->long_offsets, header->num_long_chains + 1) ||
+        write_u64s(fp, sched->long_cells, header->num_long_cells) ||
+        fwrite(sched->heads, 1, header->heads_size, fp) !=
+        header->heads_size ||
+        fwrite(sched->ends, 1,
+               ((size_t)header->nrows * header->ncols + 7) / 8,
+               fp) != ((size_t)header->nrows * header->ncols + 7) / 8)
+        status = 2;
+
+    if (fclose(fp) && !status)
+        status = 3;
+
+    return status;
+}
+
+static int compare_cells(const void *a, const void *b)
+{
+    size_t idx_a = *(const size_t *)a, idx_b = *(const size_t *)b;
+
+    return idx_a < idx_b ? -1 : idx_a > idx_b;
+}
+
+/* seven bits per byte, least significant first, with the high bit set on
+ * all but the last byte; only the length is returned for a NULL buf */
+static size_t put_varint(unsigned char *buf, size_t value)
+{
+    size_t n = 0;
+
+    do {
+        if (buf)
+            buf[n] = (value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+        n++;
+        value >>= 7;
+    } while (value);
+
+    return n;
+}
+
+static size_t get_varint(const unsigned char **buf)
+{
+    size_t value = 0;
+    int shift = 0;
+
+    do {
+        value |= (size_t)(**buf & 0x7f) << shift;
+        shift += 7;
+    } while (*(*buf)++ & 0x80);
+
+    return value;
+}
+
+static void put_u64(unsigned char *buf, unsigned long long value)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+        buf[i] = value >> 8 * i;
+}
+
+static unsigned long long get_u64(const unsigned char *buf)
+{
+    unsigned long long value = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+        value = value << 8 | buf[i];
+
+    return value;
+}
+
+static int write_u64s(FILE *fp, const size_t *values, size_t n)
+{
+    unsigned char buf[8 * 1024];
+
+    while (n) {
+        size_t m = n < 1024 ? n : 1024, i;
+
+        for (i = 0; i < m; i++)
+            put_u64(buf + 8 * i, values[i]);
+        if (fwrite(buf, 8, m, fp) != m)
+            return 1;
+        values += m;
+        n -= m;
+    }
+
+    return 0;
+}
+
+static size_t *read_u64s(const unsigned char *buf, size_t n)
+{
+    size_t *values = malloc(sizeof *values * (n ? n : 1)), i;
+
+    for (i = 0; i < n; i++)
+        values[i] = get_u64(buf + 8 * i);
+
+    return values;
+}
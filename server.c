@@ -0,0 +1,429 @@
+#ifndef _WIN32
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <omp.h>
+#include "global.h"
+
+#define INDEX(row, col) ((size_t)(row) * grid->dir_map->ncols + (col))
+#define DIR(row, col) grid->dir_map->cells.byte[INDEX(row, col)]
+#define ACCUM(row, col) grid->accum_map->cells.uint32[INDEX(row, col)]
+#define AREA(row, col) (grid->area_map ? \
+                        grid->area_map->cells.float64[INDEX(row, col)] : \
+                        ACCUM(row, col) * grid->cell_area)
+
+/* largest window in cells answered at once; define MAX_WINDOW_CELLS when
+ * compiling to change it */
+#ifndef MAX_WINDOW_CELLS
+#define MAX_WINDOW_CELLS 1048576
+#endif
+
+struct server_grid
+{
+    struct raster_map *dir_map, *accum_map;
+    /* upstream areas accumulated like -a for geographic rasters whose cell
+     * areas vary by row; NULL for projected rasters with one cell_area */
+    struct raster_map *area_map;
+    double cell_area;
+    int refs;
+};
+
+struct server
+{
+    const char *dir_opts;
+    double (*recode)(double, void *);
+    void *recode_data;
+    int engine;
+    struct server_grid *grid;
+    int listen_fd;
+    /* connected clients to wake up on shutdown */
+    int *client_fds;
+    int num_clients, max_clients;
+    int done;
+};
+
+static struct server_grid *load_grid(struct server *, const char *,
+                                     const char *);
+static void free_grid(struct server_grid *);
+static struct server_grid *get_grid(struct server *);
+static void put_grid(struct server_grid *);
+static int reload_grid(struct server *, const char *, const char *);
+static int add_client(struct server *, int);
+static void remove_client(struct server *, int);
+static void handle_client(struct server *, int);
+
+/* keep the flow direction raster and its accumulation in memory and answer
+ * point and window queries over a Unix socket; if accum_path is NULL,
+ * accumulation is computed at load time */
+int serve(const char *socket_path, const char *dir_path, const char *dir_opts,
+          const char *accum_path, double (*recode)(double, void *),
+          void *recode_data, int engine)
+{
+    struct server srv;
+    struct sockaddr_un addr;
+
+    srv.dir_opts = dir_opts;
+    srv.recode = recode;
+    srv.recode_data = recode_data;
+    srv.engine = engine;
+    srv.client_fds = NULL;
+    srv.num_clients = srv.max_clients = 0;
+    srv.done = 0;
+
+    if (!(srv.grid = load_grid(&srv, dir_path, accum_path)))
+        return 1;
+
+    if (strlen(socket_path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "%s: Socket path too long\n", socket_path);
+        return 2;
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+
+    if ((srv.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(srv.listen_fd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+        listen(srv.listen_fd, SOMAXCONN) < 0) {
+        perror(socket_path);
+        return 3;
+    }
+
+    /* clients hanging up mid-reply must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Listening on <%s>...\n", socket_path);
+    fflush(stdout);
+
+    /* reloading in a task uses a nested team for reading and accumulation */
+    omp_set_max_active_levels(2);
+
+#pragma omp parallel
+#pragma omp single
+    while (1) {
+        int fd = accept(srv.listen_fd, NULL, NULL);
+        int done;
+
+#pragma omp atomic read
+        done = srv.done;
+        if (done) {
+            if (fd >= 0)
+                close(fd);
+            break;
+        }
+        if (fd < 0)
+            continue;
+
+        /* a lone thread would leave the task queued while it waits in
+         * accept(), so it serves clients one at a time instead */
+#pragma omp task firstprivate(fd) shared(srv) if(omp_get_num_threads() > 1)
+        handle_client(&srv, fd);
+    }
+
+    close(srv.listen_fd);
+    unlink(socket_path);
+    free_grid(srv.grid);
+    free(srv.client_fds);
+
+    return 0;
+}
+
+static struct server_grid *load_grid(struct server *srv, const char *dir_path,
+                                     const char *accum_path)
+{
+    struct server_grid *grid;
+    struct raster_map *dir_map, *accum_map, *area_map = NULL;
+    double *cell_areas;
+    struct timeval start_time, end_time;
+
+    gettimeofday(&start_time, NULL);
+
+    printf("Reading flow direction raster <%s>...\n", dir_path);
+    if (!(dir_map =
+          read_raster(dir_path, srv->dir_opts, RASTER_MAP_TYPE_BYTE, 0,
+                      srv->recode, srv->recode_data))) {
+        fprintf(stderr, "%s: Failed to read flow direction raster\n",
+                dir_path);
+        return NULL;
+    }
+
+    if (accum_path) {
+        printf("Reading flow accumulation raster <%s>...\n", accum_path);
+        if (!(accum_map =
+              read_raster(accum_path, NULL, RASTER_MAP_TYPE_UINT32, 0, NULL,
+                          NULL))) {
+            fprintf(stderr, "%s: Failed to read flow accumulation raster\n",
+                    accum_path);
+            free_raster(dir_map);
+            free(dir_map);
+            return NULL;
+        }
+        if (accum_map->nrows != dir_map->nrows ||
+            accum_map->ncols != dir_map->ncols) {
+            fprintf(stderr, "%s: Inconsistent dimensions\n", accum_path);
+            free_raster(dir_map);
+            free_raster(accum_map);
+            free(dir_map);
+            free(accum_map);
+            return NULL;
+        }
+    }
+    else {
+        printf("Accumulating flows...\n");
+        accum_map =
+            init_raster(dir_map->nrows, dir_map->ncols,
+                        RASTER_MAP_TYPE_UINT32);
+        copy_raster_metadata(accum_map, dir_map);
+        accumulate(dir_map, accum_map, srv->engine);
+    }
+
+    cell_areas = calc_cell_areas(dir_map);
+    if (is_geographic(dir_map)) {
+        printf("Accumulating cell areas...\n");
+        area_map =
+            init_raster(dir_map->nrows, dir_map->ncols,
+                        RASTER_MAP_TYPE_FLOAT64);
+        copy_raster_metadata(area_map, dir_map);
+        accumulate_area(dir_map, area_map, srv->engine == ENGINE_LESSMEM,
+                        cell_areas);
+    }
+
+    grid = malloc(sizeof *grid);
+    grid->dir_map = dir_map;
+    grid->accum_map = accum_map;
+    grid->area_map = area_map;
+    grid->cell_area = cell_areas[0];
+    free(cell_areas);
+    /* one reference for the server itself */
+    grid->refs = 1;
+
+    gettimeofday(&end_time, NULL);
+    printf("Load time: %lld microsec\n",
+           timeval_diff(NULL, &end_time, &start_time));
+    fflush(stdout);
+
+    return grid;
+}
+
+static void free_grid(struct server_grid *grid)
+{
+    free_raster(grid->dir_map);
+    free_raster(grid->accum_map);
+    free(grid->dir_map);
+    free(grid->accum_map);
+    if (grid->area_map) {
+        free_raster(grid->area_map);
+        free(grid->area_map);
+    }
+    free(grid);
+}
+
+static struct server_grid *get_grid(struct server *srv)
+{
+    struct server_grid *grid;
+
+#pragma omp critical(server_grid)
+    {
+        grid = srv->grid;
+        grid->refs++;
+    }
+
+    return grid;
+}
+
+static void put_grid(struct server_grid *grid)
+{
+    int refs;
+
+#pragma omp critical(server_grid)
+    refs = --grid->refs;
+
+    if (!refs)
+        free_grid(grid);
+}
+
+/* the old grid keeps serving queries until the new one is ready */
+static int reload_grid(struct server *srv, const char *dir_path,
+                       const char *accum_path)
+{
+    struct server_grid *grid, *old_grid;
+
+    if (!(grid = load_grid(srv, dir_path, accum_path)))
+        return 1;
+
+#pragma omp critical(server_grid)
+    {
+        old_grid = srv->grid;
+        srv->grid = grid;
+    }
+
+    put_grid(old_grid);
+
+    return 0;
+}
+
+/* clients connecting after shutdown are turned away */
+static int add_client(struct server *srv, int fd)
+{
+    int added = 0;
+
+#pragma omp critical(server_clients)
+    if (!srv->done) {
+        if (srv->num_clients == srv->max_clients) {
+            srv->max_clients += 16;
+            srv->client_fds = realloc(srv->client_fds,
+                                      sizeof *srv->client_fds *
+                                      srv->max_clients);
+        }
+        srv->client_fds[srv->num_clients++] = fd;
+        added = 1;
+    }
+
+    return added;
+}
+
+static void remove_client(struct server *srv, int fd)
+{
+    int i;
+
+#pragma omp critical(server_clients)
+    for (i = 0; i < srv->num_clients; i++)
+        if (srv->client_fds[i] == fd) {
+            srv->client_fds[i] = srv->client_fds[--srv->num_clients];
+            break;
+        }
+}
+
+/* one request per line:
+ * point x y
+ * window xmin ymin xmax ymax
+ * reload dir [accum]
+ * shutdown */
+static void handle_client(struct server *srv, int fd)
+{
+    FILE *in, *out;
+    char line[4096];
+
+    if (!add_client(srv, fd)) {
+        close(fd);
+        return;
+    }
+    if (!(in = fdopen(fd, "r"))) {
+        remove_client(srv, fd);
+        close(fd);
+        return;
+    }
+    if (!(out = fdopen(dup(fd), "w"))) {
+        remove_client(srv, fd);
+        fclose(in);
+        return;
+    }
+
+    while (fgets(line, sizeof line, in)) {
+        char cmd[16], dir_path[2048], accum_path[2048];
+        double x, y, x2, y2;
+        int n;
+
+        if (sscanf(line, "%15s", cmd) != 1)
+            continue;
+
+        if (strcmp(cmd, "point") == 0 &&
+            sscanf(line, "%*s %lf %lf", &x, &y) == 2) {
+            struct server_grid *grid = get_grid(srv);
+            int row, col;
+
+            calc_row_col(grid->dir_map, x, y, &row, &col);
+            if (row < 0 || row >= grid->dir_map->nrows || col < 0 ||
+                col >= grid->dir_map->ncols)
+                fprintf(out, "ERR Outside raster\n");
+            else if (DIR(row, col) == grid->dir_map->null_value)
+                fprintf(out, "OK %d %d null\n", row, col);
+            else
+                fprintf(out, "OK %d %d %u %.6f\n", row, col, ACCUM(row, col),
+                        AREA(row, col));
+            put_grid(grid);
+        }
+        else if (strcmp(cmd, "window") == 0 &&
+                 sscanf(line, "%*s %lf %lf %lf %lf", &x, &y, &x2, &y2) == 4) {
+            struct server_grid *grid = get_grid(srv);
+            int row, col, row2, col2, r, c;
+
+            calc_row_col(grid->dir_map, x, y2, &row, &col);
+            calc_row_col(grid->dir_map, x2, y, &row2, &col2);
+            if (row > row2) {
+                r = row;
+                row = row2;
+                row2 = r;
+            }
+            if (col > col2) {
+                c = col;
+                col = col2;
+                col2 = c;
+            }
+            if (row < 0)
+                row = 0;
+            if (col < 0)
+                col = 0;
+            if (row2 >= grid->dir_map->nrows)
+                row2 = grid->dir_map->nrows - 1;
+            if (col2 >= grid->dir_map->ncols)
+                col2 = grid->dir_map->ncols - 1;
+
+            if (row > row2 || col > col2)
+                fprintf(out, "ERR Outside raster\n");
+            else if ((size_t)(row2 - row + 1) * (col2 - col + 1) >
+                     MAX_WINDOW_CELLS)
+                fprintf(out, "ERR Window too large\n");
+            else {
+                fprintf(out, "OK %d %d %d %d\n", row, col, row2 - row + 1,
+                        col2 - col + 1);
+                for (r = row; r <= row2; r++)
+                    for (c = col; c <= col2; c++) {
+                        if (DIR(r, c) == grid->dir_map->null_value)
+                            fputs("null", out);
+                        else
+                            fprintf(out, "%u", ACCUM(r, c));
+                        fputc(c < col2 ? ' ' : '\n', out);
+                    }
+            }
+            put_grid(grid);
+        }
+        else if (strcmp(cmd, "reload") == 0 &&
+                 (n = sscanf(line, "%*s %2047s %2047s", dir_path,
+                             accum_path)) >= 1) {
+            if (reload_grid(srv, dir_path, n == 2 ? accum_path : NULL))
+                fprintf(out, "ERR Failed to reload\n");
+            else
+                fprintf(out, "OK Reloaded\n");
+        }
+        else if (strcmp(cmd, "shutdown") == 0) {
+            int i;
+
+            fprintf(out, "OK Shutting down\n");
+            /* wake up accept() and other clients waiting for requests */
+#pragma omp critical(server_clients)
+            {
+#pragma omp atomic write
+                srv->done = 1;
+                for (i = 0; i < srv->num_clients; i++)
+                    if (srv->client_fds[i] != fd)
+                        shutdown(srv->client_fds[i], SHUT_RD);
+            }
+            shutdown(srv->listen_fd, SHUT_RDWR);
+            break;
+        }
+        else
+            fprintf(out, "ERR Invalid request\n");
+        fflush(out);
+    }
+
+    remove_client(srv, fd);
+    fclose(in);
+    fclose(out);
+}
+#endif
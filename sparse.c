@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "global.h"
+
+/* cells are stored in square blocks and blocks without any valid cells are
+ * not stored at all */
+#define BLOCK_SHIFT 6
+#define BLOCK_SIZE (1 << BLOCK_SHIFT)
+#define BLOCK_MASK (BLOCK_SIZE - 1)
+#define BLOCK_CELLS ((size_t)BLOCK_SIZE * BLOCK_SIZE)
+
+#define BLOCK(row, col) \
+    (((size_t)(row) >> BLOCK_SHIFT) * ctx->num_block_cols + \
+     ((col) >> BLOCK_SHIFT))
+#define OCCUPIED(block) (ctx->occupancy[(block) >> 3] & 1 << ((block) & 7))
+#define CELL(row, col) \
+    (ctx->blocks[BLOCK(row, col)] + \
+     ((size_t)((row) & BLOCK_MASK) << BLOCK_SHIFT) + ((col) & BLOCK_MASK))
+
+/* these override the dense layout in look_around.h */
+#define DIR_NULL ctx->null_value
+#define DIR(row, col) \
+    (OCCUPIED(BLOCK(row, col)) ? ctx->dir_cells[CELL(row, col)] : \
+     (unsigned char)ctx->null_value)
+#include "look_around.h"
+
+#define ACCUM(row, col) ctx->accum_cells[CELL(row, col)]
+
+/* valid cells col >= start and col < end in a row */
+struct span
+{
+    int start, end;
+};
+
+struct sparse_map
+{
+    int nrows, ncols;
+    int num_block_rows, num_block_cols;
+    double null_value;
+    /* one bit per block; blocks holds the first cell of each stored block */
+    unsigned char *occupancy;
+    size_t *blocks, num_blocks;
+    unsigned char *dir_cells;
+    unsigned int *accum_cells;
+    /* spans of row are spans[row_spans[row]] to spans[row_spans[row + 1]] */
+    size_t *row_spans;
+    struct span *spans;
+    /* projection and geotransform of the input */
+    struct raster_map *metadata;
+};
+
+static unsigned int sum_up(struct sparse_map *, int, int);
+
+/* read a flow direction raster one block row at a time into sparse storage
+ * so that the dense raster is never held in memory */
+struct sparse_map *read_sparse_dir(const char *path, const char *opts,
+                                   double (*recode)(double, void *),
+                                   void *recode_data)
+{
+    struct sparse_map *ctx;
+    int nrows, ncols, block_row;
+    size_t num_spans = 0, max_spans = 0, max_blocks = 0;
+
+    if (get_raster_size(path, opts, &nrows, &ncols))
+        return NULL;
+
+    ctx = calloc(1, sizeof *ctx);
+    ctx->nrows = nrows;
+    ctx->ncols = ncols;
+    ctx->num_block_rows = (nrows + BLOCK_MASK) >> BLOCK_SHIFT;
+    ctx->num_block_cols = (ncols + BLOCK_MASK) >> BLOCK_SHIFT;
+    ctx->occupancy =
+        calloc(((size_t)ctx->num_block_rows * ctx->num_block_cols + 7) / 8, 1);
+    ctx->blocks = malloc(sizeof *ctx->blocks * ctx->num_block_rows *
+                         ctx->num_block_cols);
+    ctx->row_spans = malloc(sizeof *ctx->row_spans * (nrows + 1));
+
+    for (block_row = 0; block_row < ctx->num_block_rows; block_row++) {
+        int first_row = block_row << BLOCK_SHIFT;
+        struct raster_map *chunk;
+        unsigned char null_byte;
+        size_t first_block = BLOCK(first_row, 0), block;
+        int row, i;
+
+        if (!(chunk =
+              read_raster_rows(path, opts, RASTER_MAP_TYPE_BYTE, first_row,
+                               BLOCK_SIZE, recode, recode_data))) {
+            free_sparse_map(ctx);
+            return NULL;
+        }
+        if (!block_row) {
+            ctx->null_value = chunk->null_value;
+            ctx->metadata = init_raster(1, 1, RASTER_MAP_TYPE_UINT32);
+            copy_raster_metadata(ctx->metadata, chunk);
+        }
+        null_byte = ctx->null_value;
+
+        /* run-length encode the valid cells of each row and mark the blocks
+         * that the runs touch */
+        for (row = 0; row < chunk->nrows; row++) {
+            const unsigned char *dirs = chunk->cells.byte +
+                (size_t)row * ncols;
+            int col = 0;
+
+            ctx->row_spans[first_row + row] = num_spans;
+            while (col < ncols) {
+                int start;
+
+                while (col < ncols && dirs[col] == ctx->null_value)
+                    col++;
+                if (col == ncols)
+                    break;
+                start = col;
+                while (col < ncols && dirs[col] != ctx->null_value)
+                    col++;
+
+                if (num_spans == max_spans) {
+                    max_spans = 2 * max_spans + ncols;
+                    ctx->spans =
+                        realloc(ctx->spans, sizeof *ctx->spans * max_spans);
+                }
+                ctx->spans[num_spans].start = start;
+                ctx->spans[num_spans++].end = col;
+
+                for (i = start >> BLOCK_SHIFT; i <= (col - 1) >> BLOCK_SHIFT;
+                     i++)
+                    ctx->occupancy[(first_block + i) >> 3] |=
+                        1 << ((first_block + i) & 7);
+            }
+        }
+
+        /* store occupied blocks in order */
+        for (i = 0; i < ctx->num_block_cols; i++) {
+            block = first_block + i;
+            if (!OCCUPIED(block))
+                continue;
+            if (ctx->num_blocks == max_blocks) {
+                max_blocks = 2 * max_blocks + ctx->num_block_cols;
+                ctx->dir_cells =
+                    realloc(ctx->dir_cells, BLOCK_CELLS * max_blocks);
+            }
+            ctx->blocks[block] = ctx->num_blocks++ * BLOCK_CELLS;
+        }
+
+#pragma omp parallel for schedule(dynamic) private(block, row)
+        for (i = 0; i < ctx->num_block_cols; i++) {
+            int first_col = i << BLOCK_SHIFT;
+            int ncols_block = ncols - first_col < BLOCK_SIZE ?
+                ncols - first_col : BLOCK_SIZE;
+            unsigned char *cells;
+
+            block = first_block + i;
+            if (!OCCUPIED(block))
+                continue;
+            cells = ctx->dir_cells + ctx->blocks[block];
+
+            /* cells outside the raster are null */
+            for (row = 0; row < BLOCK_SIZE; row++) {
+                unsigned char *block_row_cells = cells + row * BLOCK_SIZE;
+
+                if (row < chunk->nrows) {
+                    memcpy(block_row_cells,
+                           chunk->cells.byte + (size_t)row * ncols + first_col,
+                           ncols_block);
+                    memset(block_row_cells + ncols_block, null_byte,
+                           BLOCK_SIZE - ncols_block);
+                }
+                else
+                    memset(block_row_cells, null_byte, BLOCK_SIZE);
+            }
+        }
+
+        free_raster(chunk);
+        free(chunk);
+    }
+    ctx->row_spans[nrows] = num_spans;
+
+    /* give back the slack from growing */
+    ctx->dir_cells = realloc(ctx->dir_cells, BLOCK_CELLS * ctx->num_blocks);
+    ctx->spans = realloc(ctx->spans, sizeof *ctx->spans * num_spans);
+
+    printf("Stored %zu of %zu blocks in %zu spans\n", ctx->num_blocks,
+           (size_t)ctx->num_block_rows * ctx->num_block_cols, num_spans);
+
+    return ctx;
+}
+
+/* MEFA lessmem on sparse storage; only the valid spans are scanned for
+ * headwater cells */
+void accumulate_sparse(struct sparse_map *ctx)
+{
+    int row;
+
+    free(ctx->accum_cells);
+    ctx->accum_cells =
+        calloc(ctx->num_blocks * BLOCK_CELLS, sizeof *ctx->accum_cells);
+
+#pragma omp parallel for schedule(dynamic)
+    for (row = 0; row < ctx->nrows; row++) {
+        size_t i;
+
+        for (i = ctx->row_spans[row]; i < ctx->row_spans[row + 1]; i++) {
+            int col;
+
+            for (col = ctx->spans[i].start; col < ctx->spans[i].end; col++) {
+                int trace_row = row, trace_col = col;
+                unsigned int accum = 1;
+
+                if (FIND_UP(row, col))
+                    continue;
+
+                /* trace down from the headwater cell */
+                do {
+                    ACCUM(trace_row, trace_col) = accum;
+
+                    /* if the downstream cell is null or any upstream cells of
+                     * the downstream cell have never been visited, stop
+                     * tracing down */
+                    if (!move_down
+                        (DIR(trace_row, trace_col), &trace_row, &trace_col) ||
+                        trace_row < 0 || trace_row >= ctx->nrows ||
+                        trace_col < 0 || trace_col >= ctx->ncols ||
+                        DIR(trace_row, trace_col) == DIR_NULL ||
+                        !(accum = sum_up(ctx, trace_row, trace_col)))
+                        break;
+                    accum++;
+                } while (1);
+            }
+        }
+    }
+}
+
+/* write the accumulation one block row at a time; null cells are 0 as in the
+ * dense output */
+int write_sparse_accum(const char *path, struct sparse_map *ctx,
+                       int compress_output)
+{
+    struct raster_map *chunk = init_raster(BLOCK_SIZE, ctx->ncols,
+                                           RASTER_MAP_TYPE_UINT32);
+    int block_row, status = 0;
+
+    for (block_row = 0; block_row < ctx->num_block_rows && !status;
+         block_row++) {
+        int first_row = block_row << BLOCK_SHIFT;
+        int nrows = ctx->nrows - first_row < BLOCK_SIZE ?
+            ctx->nrows - first_row : BLOCK_SIZE;
+        size_t first_block = BLOCK(first_row, 0);
+        int i;
+
+        reinit_raster(chunk, nrows, ctx->ncols, RASTER_MAP_TYPE_UINT32);
+        copy_raster_metadata(chunk, ctx->metadata);
+        chunk->compress = compress_output;
+
+#pragma omp parallel for schedule(dynamic)
+        for (i = 0; i < ctx->num_block_cols; i++) {
+            size_t block = first_block + i;
+            int first_col = i << BLOCK_SHIFT;
+            int ncols_block = ctx->ncols - first_col < BLOCK_SIZE ?
+                ctx->ncols - first_col : BLOCK_SIZE;
+            int row;
+
+            if (!OCCUPIED(block))
+                continue;
+            for (row = 0; row < nrows; row++)
+                memcpy(chunk->cells.uint32 + (size_t)row * ctx->ncols +
+                       first_col,
+                       ctx->accum_cells + ctx->blocks[block] +
+                       row * BLOCK_SIZE,
+                       sizeof *ctx->accum_cells * ncols_block);
+        }
+
+        status = write_raster_rows(path, chunk, RASTER_MAP_TYPE_AUTO,
+                                   first_row, block_row ? 0 : ctx->nrows);
+    }
+
+    free_raster(chunk);
+    free(chunk);
+
+    return status;
+}
+
+void free_sparse_map(struct sparse_map *ctx)
+{
+    free(ctx->occupancy);
+    free(ctx->blocks);
+    free(ctx->dir_cells);
+    free(ctx->accum_cells);
+    free(ctx->row_spans);
+    free(ctx->spans);
+    if (ctx->metadata) {
+        free_raster(ctx->metadata);
+        free(ctx->metadata);
+    }
+    free(ctx);
+}
+
+/* if any upstream cells have never been visited, 0 is returned; otherwise, the
+ * sum of upstream accumulation is returned */
+static unsigned int sum_up(struct sparse_map *ctx, int row, int col)
+{
+    int up = FIND_UP(row, col);
+    unsigned int sum = 0, accum;
+
+#pragma omp flush
+    if (up & NW) {
+        if (!(accum = ACCUM(row - 1, col - 1)))
+            return 0;
+        sum += accum;
+    }
+    if (up & N) {
+        if (!(accum = ACCUM(row - 1, col)))
+            return 0;
+        sum += accum;
+    }
+    if (up & NE) {
+        if (!(accum = ACCUM(row - 1, col + 1)))
+            return 0;
+        sum += accum;
+    }
+    if (up & W) {
+        if (!(accum = ACCUM(row, col - 1)))
+            return 0;
+        sum += accum;
+    }
+    if (up & E) {
+        if (!(accum = ACCUM(row, col + 1)))
+            return 0;
+        sum += accum;
+    }
+    if (up & SW) {
+        if (!(accum = ACCUM(row + 1, col - 1)))
+            return 0;
+        sum += accum;
+    }
+    if (up & S) {
+        if (!(accum = ACCUM(row + 1, col)))
+            return 0;
+        sum += accum;
+    }
+    if (up & SE) {
+        if (!(accum = ACCUM(row + 1, col + 1)))
+            return 0;
+        sum += accum;
+    }
+
+    return sum;
+}
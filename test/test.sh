@@ -1,14 +1,206 @@
 #!/bin/sh
+status=0
+
+# all files must have the same contents
+check() {
+	name=$1
+	shift
+	if [ $(md5sum "$@" | sed 's/ .*//' | uniq | wc -l) -eq 1 ]; then
+		echo "$name: PASSED!"
+	else
+		echo "$name: FAILED..."
+		status=1
+	fi
+}
+
+# write each raster as text next to it; outputs of other modes are compared as
+# text because their GeoTIFF metadata can differ
+dump() {
+	for f in "$@"; do
+		../mefa dump $f ${f%.tif}.asc
+	done
+}
+
 ../mefa small_fdr_power2.tif small_fac_power2.tif
 ../mefa -e taudem small_fdr_taudem.tif small_fac_taudem.tif
 ../mefa -e 45degree small_fdr_45degree.tif small_fac_45degree.tif
 ../mefa -e degree small_fdr_degree_int.tif small_fac_degree_int.tif
 ../mefa -e degree small_fdr_degree_double.tif small_fac_degree_double.tif
 ../mefa -e 1,8,7,6,5,4,3,2 small_fdr_taudem.tif small_fac_taudem_custom.tif
+
+# the same cells in every text format, from one thread, and on standard output
+dump small_fac_power2.tif
+../mefa dump -f xyz small_fac_power2.tif small_fac_power2.xyz
+../mefa dump -f csv small_fac_power2.tif small_out_dump.csv
+../mefa dump -t 1 small_fac_power2.tif small_out_dump_t1.asc
+../mefa dump small_fac_power2.tif > small_out_dump_stdout.asc
+sed 1,6d small_fac_power2.asc > small_fac_power2.txt
+tr ' ' , < small_fac_power2.txt > small_out_dump_csv.txt
+tr ' ' '\n' < small_fac_power2.txt > small_out_dump_cells.txt
+cut -d' ' -f3 small_fac_power2.xyz > small_fac_cells.txt
+
+# batch jobs, also with GDAL open options for dir
+echo "small_fdr_power2.tif small_out_b.tif" > small_out_batch.txt
+../mefa -b small_out_batch.txt
+echo "small_fdr_power2.tif small_out_bD.tif" > small_out_batch_D.txt
+../mefa -D GEOREF_SOURCES=INTERNAL -b small_out_batch_D.txt
+dump small_out_b.tif small_out_bD.tif
+
+# serve the whole grid as a window and the upper left cell as a point whose
+# area is 900 m^2 per cell
+query() {
+	python3 -c 'import socket, sys
+s = socket.socket(socket.AF_UNIX)
+s.connect("small.sock")
+s.sendall(sys.argv[1].encode() + b"\n")
+s.shutdown(socket.SHUT_WR)
+sys.stdout.write(s.makefile().read())' "$1"
+}
+../mefa -S small.sock small_fdr_power2.tif &
+i=0
+while [ ! -S small.sock ] && [ $i -lt 30 ]; do
+	sleep 1
+	i=$((i + 1))
+done
+query "window -302145 846945 -301665 847395" | sed 1d > small_out_server.txt
+query "point -302145 847395" > small_out_point.txt
+query shutdown > /dev/null
+wait
+awk '{ print $4 }' small_out_point.txt > small_out_point_cells.txt
+awk '{ print $5 / 900 }' small_out_point.txt > small_out_point_area.txt
+
+# every cell as an outlet nested in its downstream outlets
+cut -d' ' -f1,2 small_fac_power2.xyz > small_out_outlets.txt
+../mefa -o small_out_outlets.txt small_fdr_power2.tif small_out_outlets.csv
+sed 1d small_out_outlets.csv | cut -d, -f5 > small_out_outlets_cells.txt
+sed 1d small_out_outlets.csv | awk -F, '{ print $6 / 900 }' \
+	> small_out_outlets_area.txt
+
+# cells draining into a window clipped to it
+../mefa -w -302085,847035,-301845,847335 small_fdr_power2.tif small_out_w.tif
+../mefa dump -f xyz small_out_w.tif small_out_w.xyz
+awk '$1 >= -302085 && $1 <= -301845 && $2 >= 847035 && $2 <= 847335' \
+	small_fac_power2.xyz > small_out_w_ref.xyz
+
+# areas from both engines, 900 m^2 per cell
+../mefa -a m2 small_fdr_power2.tif small_out_a.tif
+../mefa -a m2 -m small_fdr_power2.tif small_out_a_m.tif
+dump small_out_a.tif small_out_a_m.tif
+../mefa dump -f xyz small_out_a.tif | awk '{ print $1, $2, $3 / 900 }' \
+	> small_out_a_cells.xyz
+
+# weights of integer and double types from both engines
+../mefa -W small_fdr_degree_int.tif small_fdr_power2.tif small_out_W_int.tif
+../mefa -W small_fdr_degree_double.tif small_fdr_power2.tif \
+	small_out_W_double.tif
+../mefa -W small_fdr_degree_int.tif -m small_fdr_power2.tif \
+	small_out_W_int_m.tif
+dump small_out_W_int.tif small_out_W_double.tif small_out_W_int_m.tif
+
+# flows of the first pass reused by the second
+../mefa -f -m small_fdr_power2.tif small_out_f.tif
+dump small_out_f.tif
+
+# an engine chosen within a memory limit
+../mefa -M 1G small_fdr_power2.tif small_out_M.tif
+dump small_out_M.tif
+
+# pending inflows counted by the HP engine
+../mefa -H small_fdr_power2.tif small_out_H.tif
+dump small_out_H.tif
+
+# flow directions from the flow accumulation as a DEM on every engine
+../mefa -F small_fac_power2.tif small_out_F.tif
+../mefa -F -m small_fac_power2.tif small_out_F_m.tif
+../mefa -F -H small_fac_power2.tif small_out_F_H.tif
+dump small_out_F.tif small_out_F_m.tif small_out_F_H.tif
+
+# depressions filled by both engines
+../mefa -F -P small_fac_power2.tif small_out_P.tif
+../mefa -F -P -m small_fac_power2.tif small_out_P_m.tif
+dump small_out_P.tif small_out_P_m.tif
+
+# accumulation over sparse blocks
+../mefa -N small_fdr_power2.tif small_out_N.tif
+dump small_out_N.tif
+
+# accumulation written progressively
+../mefa -p small_fdr_power2.tif small_out_p.tif
+dump small_out_p.tif
+
+# a schedule built by the first run and read by the second
+../mefa -T small_out_schedule.bin small_fdr_power2.tif small_out_T.tif
+../mefa -T small_out_schedule.bin small_fdr_power2.tif small_out_T_read.tif
+dump small_out_T.tif small_out_T_read.tif
+
+# accumulation written compressed
+../mefa -c small_fdr_power2.tif small_out_c.tif
+dump small_out_c.tif
+
+# one tile receives no flows from others
+echo "small_fdr_power2.tif small_fac_power2.tif small_out_j.tif" > \
+	small_out_tiles.txt
+../mefa -j small_out_tiles.txt
+dump small_out_j.tif
+
+# padded borders on both engines
+../mefa -B small_fdr_power2.tif small_out_B.tif
+../mefa -B -m small_fdr_power2.tif small_out_B_m.tif
+dump small_out_B.tif small_out_B_m.tif
+
+# multiple flow directions from a team and from one thread
+../mefa -F -X 1.1 small_fac_power2.tif small_out_X.tif
+../mefa -t 1 -F -X 1.1 small_fac_power2.tif small_out_X_t1.tif
+dump small_out_X.tif small_out_X_t1.tif
+
+# HAND from both engines next to an unchanged accumulation
+../mefa -F -R 5,small_out_R_hand.tif small_fac_power2.tif small_out_R.tif
+../mefa -F -m -R 5,small_out_R_hand_m.tif small_fac_power2.tif \
+	small_out_R_m.tif
+../mefa -F small_fac_power2.tif small_out_R_F.tif
+dump small_out_R.tif small_out_R_m.tif small_out_R_F.tif \
+	small_out_R_hand.tif small_out_R_hand_m.tif
+
+# a checkpoint cleared of its complete flag and 100 cells from the fifth on
+../mefa -C small_out_checkpoint.bin small_fdr_power2.tif small_out_C.tif
+dd if=/dev/zero of=small_out_checkpoint.bin bs=4 seek=6 count=1 \
+	conv=notrunc 2> /dev/null
+dd if=/dev/zero of=small_out_checkpoint.bin bs=4 seek=1028 count=100 \
+	conv=notrunc 2> /dev/null
+../mefa -C small_out_checkpoint.bin --resume small_fdr_power2.tif \
+	small_out_C_resume.tif
+dump small_out_C.tif small_out_C_resume.tif
+
 echo
-if [ $(md5sum small_fac_*.tif | sed 's/ .*//' | uniq | wc -l) -eq 1 ]; then
-	echo "PASSED!"
-else
-	echo "FAILED..."
-fi
-rm -f small_fac_*.tif
+check encodings small_fac_*.tif
+check dump small_fac_power2.asc small_out_dump_t1.asc \
+	small_out_dump_stdout.asc
+check dump_csv small_out_dump.csv small_out_dump_csv.txt
+check dump_xyz small_out_dump_cells.txt small_fac_cells.txt
+check batch small_fac_power2.asc small_out_b.asc small_out_bD.asc
+check server small_fac_power2.txt small_out_server.txt
+check server_area small_out_point_cells.txt small_out_point_area.txt
+check outlets small_fac_cells.txt small_out_outlets_cells.txt \
+	small_out_outlets_area.txt
+check window small_out_w.xyz small_out_w_ref.xyz
+check area small_out_a.asc small_out_a_m.asc
+check area_cells small_fac_power2.xyz small_out_a_cells.xyz
+check weights small_out_W_int.asc small_out_W_double.asc \
+	small_out_W_int_m.asc
+check first_pass small_fac_power2.asc small_out_f.asc
+check memory_limit small_fac_power2.asc small_out_M.asc
+check hp small_fac_power2.asc small_out_H.asc
+check dem small_out_F.asc small_out_F_m.asc small_out_F_H.asc
+check fill small_out_P.asc small_out_P_m.asc
+check sparse small_fac_power2.asc small_out_N.asc
+check progressive small_fac_power2.asc small_out_p.asc
+check schedule small_fac_power2.asc small_out_T.asc small_out_T_read.asc
+check compress small_fac_power2.asc small_out_c.asc
+check merge small_fac_power2.asc small_out_j.asc
+check padding small_fac_power2.asc small_out_B.asc small_out_B_m.asc
+check mfd small_out_X.asc small_out_X_t1.asc
+check hand small_out_R_hand.asc small_out_R_hand_m.asc
+check hand_accum small_out_R.asc small_out_R_m.asc small_out_R_F.asc
+check checkpoint small_fac_power2.asc small_out_C.asc small_out_C_resume.asc
+rm -f small_fac_* small_out_* small.sock
+exit $status
@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "global.h"
+#include "look_around.h"
+
+/* hand off half of a flood stack to a new task once it grows this large */
+#define SPLIT_SIZE 4096
+
+struct outlet_cell
+{
+    size_t idx;
+    int outlet;
+};
+
+struct upstream_context
+{
+    struct raster_map *dir_map;
+    int nrows, ncols;
+    struct outlet_cell *outlet_cells;
+    int num_outlet_cells;
+    int *parents;
+    unsigned int *counts;
+    const double *cell_areas;
+    double *areas;
+};
+
+static const int up_dirs[8] = { NW, N, NE, W, E, SW, S, SE };
+static const int up_drows[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+static const int up_dcols[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+
+static int compare_outlet_cells(const void *, const void *);
+static int find_outlet(struct upstream_context *, size_t);
+static void flood_up(struct upstream_context *, int, size_t *, size_t);
+static void merge_loops(struct upstream_context *, int *);
+
+/* count upstream cells including each outlet itself; counts for null or
+ * out-of-bound outlets are 0; the flood from each outlet stops at other
+ * outlets so that nested outlets reuse the counts of their upstream outlets
+ * and every cell is visited at most once; if cell_areas is not NULL, areas
+ * gets the sums of cell_areas[row] over the same cells */
+void count_upstream(struct raster_map *dir_map, int num_outlets,
+                    const int *rows, const int *cols, unsigned int *counts,
+                    const double *cell_areas, double *areas)
+{
+    struct upstream_context context, *ctx = &context;
+    unsigned int *totals;
+    double *total_areas;
+    int *outlets, *heads, *pending, *queue;
+    int i, n, num_queue;
+
+    ctx->dir_map = dir_map;
+    ctx->nrows = dir_map->nrows;
+    ctx->ncols = dir_map->ncols;
+
+    ctx->outlet_cells = malloc(sizeof *ctx->outlet_cells * num_outlets);
+    for (i = n = 0; i < num_outlets; i++) {
+        if (rows[i] < 0 || rows[i] >= ctx->nrows || cols[i] < 0 ||
+            cols[i] >= ctx->ncols || DIR(rows[i], cols[i]) == DIR_NULL)
+            continue;
+        ctx->outlet_cells[n].idx = INDEX(rows[i], cols[i]);
+        ctx->outlet_cells[n++].outlet = i;
+    }
+    qsort(ctx->outlet_cells, n, sizeof *ctx->outlet_cells,
+          compare_outlet_cells);
+
+    /* outlets[i] is the index of the unique outlet cell for outlet i */
+    outlets = malloc(sizeof *outlets * num_outlets);
+    for (i = 0; i < num_outlets; i++)
+        outlets[i] = -1;
+    for (i = ctx->num_outlet_cells = 0; i < n; i++) {
+        if (i > 0 && ctx->outlet_cells[i].idx == ctx->outlet_cells[i - 1].idx) {
+            outlets[ctx->outlet_cells[i].outlet] = ctx->num_outlet_cells - 1;
+            continue;
+        }
+        outlets[ctx->outlet_cells[i].outlet] = ctx->num_outlet_cells;
+        ctx->outlet_cells[ctx->num_outlet_cells].idx =
+            ctx->outlet_cells[i].idx;
+        ctx->outlet_cells[ctx->num_outlet_cells].outlet =
+            ctx->num_outlet_cells;
+        ctx->num_outlet_cells++;
+    }
+    n = ctx->num_outlet_cells;
+
+    ctx->parents = malloc(sizeof *ctx->parents * n);
+    ctx->counts = calloc(n, sizeof *ctx->counts);
+    ctx->cell_areas = cell_areas;
+    ctx->areas = cell_areas ? calloc(n, sizeof *ctx->areas) : NULL;
+    totals = calloc(n, sizeof *totals);
+    total_areas = calloc(n, sizeof *total_areas);
+    for (i = 0; i < n; i++)
+        ctx->parents[i] = -1;
+
+#pragma omp parallel
+#pragma omp single
+    for (i = 0; i < n; i++) {
+        size_t *seeds = malloc(sizeof *seeds);
+
+        *seeds = ctx->outlet_cells[i].idx;
+#pragma omp task firstprivate(i, seeds)
+        flood_up(ctx, i, seeds, 1);
+    }
+
+    heads = malloc(sizeof *heads * n);
+    merge_loops(ctx, heads);
+
+    /* collect loops into their heads and count the nested heads of each */
+    pending = calloc(n, sizeof *pending);
+    for (i = 0; i < n; i++) {
+        totals[heads[i]] += ctx->counts[i];
+        if (ctx->areas)
+            total_areas[heads[i]] += ctx->areas[i];
+        if (heads[i] == i && ctx->parents[i] >= 0)
+            pending[heads[ctx->parents[i]]]++;
+    }
+
+    /* add each head to its downstream head once all its nested heads have
+     * been added to it */
+    queue = malloc(sizeof *queue * n);
+    for (i = num_queue = 0; i < n; i++)
+        if (heads[i] == i && !pending[i])
+            queue[num_queue++] = i;
+    while (num_queue) {
+        int h = queue[--num_queue], p;
+
+        if (ctx->parents[h] < 0)
+            continue;
+        p = heads[ctx->parents[h]];
+        totals[p] += totals[h];
+        total_areas[p] += total_areas[h];
+        if (!--pending[p])
+            queue[num_queue++] = p;
+    }
+
+    for (i = 0; i < num_outlets; i++) {
+        counts[i] = outlets[i] >= 0 ? totals[heads[outlets[i]]] : 0;
+        if (areas)
+            areas[i] = outlets[i] >= 0 ? total_areas[heads[outlets[i]]] : 0;
+    }
+
+    free(queue);
+    free(pending);
+    free(heads);
+    free(total_areas);
+    free(totals);
+    free(ctx->areas);
+    free(outlets);
+    free(ctx->counts);
+    free(ctx->parents);
+    free(ctx->outlet_cells);
+}
+
+/* read x and y coordinates separated by whitespace or commas from
+ * outlets_path and write upstream cell counts and areas for them as CSV to
+ * output_path; lines that do not start with coordinates are skipped */
+int calc_outlet_areas(struct raster_map *dir_map, const char *outlets_path,
+                      const char *output_path)
+{
+    FILE *fp;
+    char line[1024];
+    double *xs = NULL, *ys = NULL;
+    int *rows, *cols;
+    unsigned int *counts;
+    double *cell_areas, *areas;
+    int num_outlets = 0, max_outlets = 0;
+    int i;
+    struct timeval start_time, end_time;
+
+    if (!(fp = fopen(outlets_path, "r"))) {
+        fprintf(stderr, "%s: Failed to read outlets\n", outlets_path);
+        return 1;
+    }
+    while (fgets(line, sizeof line, fp)) {
+        char *p;
+        double x, y;
+
+        for (p = line; *p; p++)
+            if (*p == ',')
+                *p = ' ';
+        if (sscanf(line, "%lf %lf", &x, &y) != 2)
+            continue;
+        if (num_outlets == max_outlets) {
+            max_outlets += 1024;
+            xs = realloc(xs, sizeof *xs * max_outlets);
+            ys = realloc(ys, sizeof *ys * max_outlets);
+        }
+        xs[num_outlets] = x;
+        ys[num_outlets++] = y;
+    }
+    fclose(fp);
+
+    rows = malloc(sizeof *rows * num_outlets);
+    cols = malloc(sizeof *cols * num_outlets);
+    counts = malloc(sizeof *counts * num_outlets);
+    areas = malloc(sizeof *areas * num_outlets);
+    cell_areas = calc_cell_areas(dir_map);
+    for (i = 0; i < num_outlets; i++)
+        calc_row_col(dir_map, xs[i], ys[i], &rows[i], &cols[i]);
+
+    printf("Counting upstream cells for %d outlets...\n", num_outlets);
+    gettimeofday(&start_time, NULL);
+    count_upstream(dir_map, num_outlets, rows, cols, counts, cell_areas,
+                   areas);
+    gettimeofday(&end_time, NULL);
+    printf("Computation time for upstream cells: %lld microsec\n",
+           timeval_diff(NULL, &end_time, &start_time));
+
+    if (!(fp = fopen(output_path, "w"))) {
+        fprintf(stderr, "%s: Failed to write outlet areas\n", output_path);
+        return 2;
+    }
+    fprintf(fp, "x,y,row,col,cells,area\n");
+    for (i = 0; i < num_outlets; i++)
+        fprintf(fp, "%.10g,%.10g,%d,%d,%u,%.10g\n", xs[i], ys[i], rows[i],
+                cols[i], counts[i], areas[i]);
+    fclose(fp);
+
+    free(xs);
+    free(ys);
+    free(rows);
+    free(cols);
+    free(counts);
+    free(areas);
+    free(cell_areas);
+
+    return 0;
+}
+
+static int compare_outlet_cells(const void *a, const void *b)
+{
+    const struct outlet_cell *cell_a = a, *cell_b = b;
+
+    return cell_a->idx < cell_b->idx ? -1 : cell_a->idx > cell_b->idx;
+}
+
+static int find_outlet(struct upstream_context *ctx, size_t idx)
+{
+    struct outlet_cell key, *cell;
+
+    key.idx = idx;
+    cell = bsearch(&key, ctx->outlet_cells, ctx->num_outlet_cells,
+                   sizeof *ctx->outlet_cells, compare_outlet_cells);
+
+    return cell ? cell->outlet : -1;
+}
+
+/* outlets on a flow direction loop flood each other, or themselves if alone
+ * on it, and share all their upstream cells; each loop is merged into its
+ * first outlet found, which becomes heads[] of all outlets on it and gets no
+ * parent, so that walking down parents always ends */
+static void merge_loops(struct upstream_context *ctx, int *heads)
+{
+    int n = ctx->num_outlet_cells;
+    /* 0: not visited, 1: on the current walk, 2: done */
+    char *states = calloc(n, 1);
+    int *walk = malloc(sizeof *walk * n);
+    int i;
+
+    for (i = 0; i < n; i++)
+        heads[i] = i;
+
+    for (i = 0; i < n; i++) {
+        int num_walk = 0, p;
+
+        for (p = i; p >= 0 && !states[p]; p = ctx->parents[p]) {
+            states[p] = 1;
+            walk[num_walk++] = p;
+        }
+        if (p >= 0 && states[p] == 1) {
+            int q = p;
+
+            do {
+                heads[q] = p;
+                q = ctx->parents[q];
+            } while (q != p);
+            ctx->parents[p] = -1;
+        }
+        while (num_walk)
+            states[walk[--num_walk]] = 2;
+    }
+
+    free(walk);
+    free(states);
+}
+
+/* flood upstream from seed cells that drain to outlet; seeds is freed */
+static void flood_up(struct upstream_context *ctx, int outlet, size_t *seeds,
+                     size_t num_seeds)
+{
+    size_t max_cells = num_seeds > SPLIT_SIZE ? num_seeds : SPLIT_SIZE;
+    size_t *stack = malloc(sizeof *stack * max_cells);
+    size_t n = num_seeds;
+    unsigned int count = 0;
+    double area = 0;
+
+    memcpy(stack, seeds, sizeof *stack * num_seeds);
+    free(seeds);
+
+    while (n) {
+        size_t idx = stack[--n];
+        int row = idx / ctx->ncols, col = idx % ctx->ncols;
+        int up = FIND_UP(row, col);
+        int i;
+
+        count++;
+        if (ctx->cell_areas)
+            area += ctx->cell_areas[row];
+
+        for (i = 0; i < 8; i++) {
+            size_t up_idx;
+            int up_outlet;
+
+            if (!(up & up_dirs[i]))
+                continue;
+
+            up_idx = INDEX(row + up_drows[i], col + up_dcols[i]);
+            if ((up_outlet = find_outlet(ctx, up_idx)) >= 0) {
+                /* a nested outlet floods its own upstream cells */
+                ctx->parents[up_outlet] = outlet;
+                continue;
+            }
+
+            if (n == max_cells) {
+                max_cells *= 2;
+                stack = realloc(stack, sizeof *stack * max_cells);
+            }
+            stack[n++] = up_idx;
+        }
+
+        if (n >= SPLIT_SIZE) {
+            size_t half = n / 2;
+
+            seeds = malloc(sizeof *seeds * half);
+            memcpy(seeds, stack, sizeof *seeds * half);
+            memmove(stack, stack + half, sizeof *stack * (n - half));
+            n -= half;
+#pragma omp task firstprivate(seeds, half)
+            flood_up(ctx, outlet, seeds, half);
+        }
+    }
+
+#pragma omp atomic
+    ctx->counts[outlet] += count;
+    if (ctx->areas) {
+#pragma omp atomic
+        ctx->areas[outlet] += area;
+    }
+
+    free(stack);
+}